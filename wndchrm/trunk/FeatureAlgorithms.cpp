@@ -347,55 +347,47 @@ ObjectFeatures::ObjectFeatures() : FeatureAlgorithm ("Otsu Object Features", 34)
 	//cout << "Instantiating new " << name << " object." << endl;
 }
 
-std::vector<double> ObjectFeatures::execute (const ImageMatrix &IN_matrix) const {
+/* pack ObjectStatistics into the 34 Otsu object features */
+static std::vector<double> ObjectStatisticsCoeffs (const ObjectStatistics &objects, int n_features) {
 	std::vector<double> coeffs;
-	if (verbosity > 3) std::cout << "calculating " << name << std::endl;
-
 	coeffs.resize (n_features, 0);
-
-	unsigned long feature_count=0, AreaMin=0, AreaMax=0;
-	long Euler=0;
-	unsigned int AreaMedian=0,
-			area_histogram[10]={0,0,0,0,0,0,0,0,0,0},
-			dist_histogram[10]={0,0,0,0,0,0,0,0,0,0};
-
-	double centroid_x=0, centroid_y=0, AreaMean=0, AreaVar=0, DistMin=0,
-				 DistMax=0, DistMean=0, DistMedian=0, DistVar=0;
-
-	IN_matrix.FeatureStatistics(&feature_count, &Euler, &centroid_x, &centroid_y,
-			&AreaMin, &AreaMax, &AreaMean, &AreaMedian,
-			&AreaVar, area_histogram, &DistMin, &DistMax,
-			&DistMean, &DistMedian, &DistVar, dist_histogram, 10);
-
 	int j, here = 0;
 
 	for( j = 0; j < 10; j++ ){
-		coeffs[here++] = area_histogram[j];
+		coeffs[here++] = objects.area_histogram[j];
 	}
 
-	coeffs[here++] = AreaMax;
-	coeffs[here++] = AreaMean;
-	coeffs[here++] = AreaMedian;
-	coeffs[here++] = AreaMin;
-	coeffs[here++] = AreaVar;
-	coeffs[here++] = centroid_x;
-	coeffs[here++] = centroid_y;
-	coeffs[here++] = feature_count;
+	coeffs[here++] = objects.AreaMax;
+	coeffs[here++] = objects.AreaMean;
+	coeffs[here++] = objects.AreaMedian;
+	coeffs[here++] = objects.AreaMin;
+	coeffs[here++] = objects.AreaVar;
+	coeffs[here++] = objects.centroid_x;
+	coeffs[here++] = objects.centroid_y;
+	coeffs[here++] = objects.count;
 
 	for( j = 0; j < 10; j++ ) {
-		coeffs[here++] = dist_histogram[j];
+		coeffs[here++] = objects.dist_histogram[j];
 	}
 
-	coeffs[here++] = DistMax;
-	coeffs[here++] = DistMean;
-	coeffs[here++] = DistMedian;
-	coeffs[here++] = DistMin;
-	coeffs[here++] = DistVar;
-	coeffs[here++] = Euler;
+	coeffs[here++] = objects.DistMax;
+	coeffs[here++] = objects.DistMean;
+	coeffs[here++] = objects.DistMedian;
+	coeffs[here++] = objects.DistMin;
+	coeffs[here++] = objects.DistVar;
+	coeffs[here++] = objects.Euler;
 
 	return coeffs;
 }
 
+std::vector<double> ObjectFeatures::execute (const ImageMatrix &IN_matrix) const {
+	if (verbosity > 3) std::cout << "calculating " << name << std::endl;
+
+	ObjectStatistics objects;
+	IN_matrix.OtsuObjectStatistics (&objects, NULL);
+	return ObjectStatisticsCoeffs (objects, n_features);
+}
+
 // Register a static instance of the class using a global bool
 static bool ObjectFeaturesReg = ComputationTaskInstances::add (new ObjectFeatures);
 
@@ -405,12 +397,13 @@ InverseObjectFeatures::InverseObjectFeatures() : FeatureAlgorithm ("Inverse-Otsu
 	//cout << "Instantiating new " << name << " object." << endl;
 }
 
+/* Same as ObjectFeatures on the inverted image, without making an inverted copy */
 std::vector<double> InverseObjectFeatures::execute (const ImageMatrix &IN_matrix) const {
-	ImageMatrix InvMatrix;
-	InvMatrix.copy (IN_matrix);
-	InvMatrix.invert();
-	static ObjectFeatures ObjFeaturesInst;
-	return (ObjFeaturesInst.execute (InvMatrix));
+	if (verbosity > 3) std::cout << "calculating " << name << std::endl;
+
+	ObjectStatistics inv_objects;
+	IN_matrix.OtsuObjectStatistics (NULL, &inv_objects);
+	return ObjectStatisticsCoeffs (inv_objects, n_features);
 }
 
 // Register a static instance of the class using a global bool
@@ -455,7 +448,8 @@ std::vector<double> GiniCoefficient::execute (const ImageMatrix &IN_matrix) cons
 
 	coeffs.resize(n_features, 0);
 
-	long pixel_index, num_pixels;
+	long num_pixels;
+	unsigned int x, y;
 	double *pixels, mean = 0.0, g = 0.0;
 	long i, count = 0;
 	double val;
@@ -464,12 +458,14 @@ std::vector<double> GiniCoefficient::execute (const ImageMatrix &IN_matrix) cons
 	pixels = new double[ num_pixels ];
 
 	readOnlyPixels IN_matrix_pix_plane = IN_matrix.ReadablePixels();
-	for( pixel_index = 0; pixel_index < num_pixels; pixel_index++ ) {
-		val = IN_matrix_pix_plane.array().coeff(pixel_index);
-		if( val > 0 ) {
-			pixels[ count ] = val;
-			mean += val;
-			count++;
+	for( y = 0; y < IN_matrix.height; y++ ) {
+		for( x = 0; x < IN_matrix.width; x++ ) {
+			val = IN_matrix_pix_plane(y,x);
+			if( val > 0 ) {
+				pixels[ count ] = val;
+				mean += val;
+				count++;
+			}
 		}
 	}
 	if( count > 0 )
@@ -500,6 +496,7 @@ static bool GiniCoefficientReg = ComputationTaskInstances::add (new GiniCoeffici
 
 */
 ColorHistogram::ColorHistogram() : FeatureAlgorithm ("Color Histogram", COLORS_NUM+1) {
+	reads_colors = true;
 	//cout << "Instantiating new " << name << " object." << endl;
 }
 
@@ -511,7 +508,6 @@ std::vector<double> ColorHistogram::execute (const ImageMatrix &IN_matrix) const
 	unsigned int x,y, width = IN_matrix.width, height = IN_matrix.height;
 	HSVcolor hsv_pixel;
 	unsigned long color_index=0;   
-	double certainties[COLORS_NUM+1];
 
 	readOnlyColors clr_plane = IN_matrix.ReadableColors();
 
@@ -519,7 +515,7 @@ std::vector<double> ColorHistogram::execute (const ImageMatrix &IN_matrix) const
 	for( y = 0; y < height; y++ ) {
 		for( x = 0; x < width; x++ ) { 
 			hsv_pixel = clr_plane (y, x);
-			color_index = FindColor( hsv_pixel.h,  hsv_pixel.s, hsv_pixel.v, certainties );
+			color_index = FindColorLUT( hsv_pixel.h,  hsv_pixel.s, hsv_pixel.v, NULL );
 			coeffs[ color_index ]++;
 		}
 	}
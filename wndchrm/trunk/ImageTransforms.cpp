@@ -114,7 +114,9 @@ static bool EdgeTransformReg = ComputationTaskInstances::add (new EdgeTransform)
 
 //===========================================================================
 
-ColorTransform::ColorTransform () : ImageTransform ("Color") {};
+ColorTransform::ColorTransform () : ImageTransform ("Color") {
+	reads_colors = true;
+};
 
 void ColorTransform::execute (const ImageMatrix &matrix_IN, ImageMatrix &matrix_OUT ) const {
 	if (verbosity > 3) std::cout << "Performing transform " << name << std::endl;
@@ -128,7 +130,9 @@ static bool ColorTransformReg = ComputationTaskInstances::add (new ColorTransfor
 
 //===========================================================================
 
-HueTransform::HueTransform () : ImageTransform ("Hue") {};
+HueTransform::HueTransform () : ImageTransform ("Hue") {
+	reads_colors = true;
+};
 
 void HueTransform::execute (const ImageMatrix &matrix_IN, ImageMatrix &matrix_OUT ) const {
 	if (verbosity > 3) std::cout << "Performing transform " << name << std::endl;
@@ -0,0 +1,105 @@
+#include "MappedImageMatrix.h"
+#include "cmatrix.h"
+
+#include <iostream>
+#include <vector>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>    // mkstemp, exit
+#include <unistd.h>    // sysconf(), page_size, ftruncate, unlink, close
+#include <errno.h>
+#include <sys/mman.h>  // mmap, munmap, madvise
+
+/* global variable */
+extern int verbosity;
+
+// storage and initialization for the object statics
+size_t MappedImageMatrix::page_size = sysconf(_SC_PAGE_SIZE);
+std::string MappedImageMatrix::map_directory = "";
+size_t MappedImageMatrix::map_min_bytes = MAPPED_IMAGE_MIN_BYTES;
+
+// This is a helper class method to calculate offsets into the mapped file.
+// Note that this is a class method declared as static in the header.
+size_t MappedImageMatrix::calc_map_size (const unsigned int w, const unsigned int h, const enum ColorModes ColorMode, size_t &clr_plane_offset) {
+	size_t new_mat_size = (size_t)w * h;
+	size_t new_map_size = new_mat_size * sizeof (pixDataType);
+	// Expand the size to be a multiple of the page size.
+	new_map_size = ( (1 + (new_map_size / page_size)) * page_size );
+	// The color plane starts at a page boundary.
+	clr_plane_offset = new_map_size;
+	if (ColorMode != cmGRAY) new_map_size += new_mat_size * sizeof (HSVcolor);
+	// Expand the total size to be a multiple of the page size.
+	new_map_size = ( (1 + (new_map_size / page_size)) * page_size );
+	return (new_map_size);
+}
+
+// Release the mapped planes, leaving the scratch file open for the next allocate()
+void MappedImageMatrix::unmap () {
+	if (mmap_ptr == MAP_FAILED) return;
+	drop_planes ();
+	munmap (mmap_ptr, map_size);
+	mmap_ptr = (byte *)MAP_FAILED;
+	map_size = 0;
+}
+
+// override of parent class allocate method to use a memory-mapped scratch file for large planes.
+// Each call maps fresh planes - their previous contents are not preserved, same as in the parent class.
+void MappedImageMatrix::allocate (unsigned int w, unsigned int h) {
+	size_t new_map_size, clr_plane_offset;
+	new_map_size = calc_map_size (w, h, ColorMode, clr_plane_offset);
+
+	if (!MappingEnabled() || new_map_size < map_min_bytes) {
+		unmap ();
+		ImageMatrix::allocate (w, h);
+		return;
+	}
+
+	// release whatever planes we have, mapped or not.
+	unmap ();
+	release_planes ();
+
+	// The scratch file is unlinked right away, so it disappears when it's closed, even if we don't exit cleanly.
+	if (map_fd < 0) {
+		std::string path = map_directory + "/wndchrm-XXXXXX";
+		std::vector<char> path_buf (path.begin(), path.end());
+		path_buf.push_back ('\0');
+		map_fd = mkstemp (&(path_buf[0]));
+		if (map_fd < 0) {
+			std::cerr << "Could not create image scratch file in '" << map_directory << "': " << strerror(errno) << std::endl;
+			exit (-1);
+		}
+		unlink (&(path_buf[0]));
+	}
+
+	// Truncating to 0 first discards the old contents, so they are never written back.
+	if (ftruncate (map_fd, 0) == -1 || ftruncate (map_fd, new_map_size) == -1) {
+		std::cerr << "ftruncate error on image scratch file: " << strerror(errno) << std::endl;
+		exit (-1);
+	}
+
+	mmap_ptr = (byte *)mmap(NULL, new_map_size, PROT_READ | PROT_WRITE, MAP_SHARED, map_fd, (off_t) 0);
+	if (mmap_ptr == MAP_FAILED) {
+		std::cerr << "mmap error on image scratch file: " << strerror(errno) << std::endl;
+		exit (-1);
+	}
+	map_size = new_map_size;
+	if (verbosity > 7) fprintf (stdout, "mapped %lu bytes at %p (%d,%d)\n", (unsigned long)map_size, (void *)mmap_ptr, w, h);
+
+	// remap the data for the object to use the mmap_ptr.
+	remap_pix_plane ( (pixDataType *)mmap_ptr, w, h);
+	if (ColorMode != cmGRAY) remap_clr_plane ((HSVcolor *)(mmap_ptr + clr_plane_offset), w, h);
+}
+
+// MADV_DONTNEED on a shared file mapping removes the pages from our address space (and our RSS),
+// but modified pages stay in the page cache until the kernel writes them to the scratch file.
+void MappedImageMatrix::page_out () {
+	if (mmap_ptr == MAP_FAILED) return;
+	madvise (mmap_ptr, map_size, MADV_DONTNEED);
+}
+
+MappedImageMatrix::~MappedImageMatrix () {
+	finish();
+	unmap ();
+	if (map_fd > -1) close (map_fd);
+	map_fd = -1;
+}
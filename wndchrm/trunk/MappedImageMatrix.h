@@ -0,0 +1,66 @@
+#ifndef __MAPPED_IMAGE_MATRIX_H_
+#define __MAPPED_IMAGE_MATRIX_H_
+
+#include <string>
+#include <sys/mman.h>  // mmap, MAP_FAILED
+#include "cmatrix.h"
+
+#define MAPPED_IMAGE_MIN_BYTES ((size_t)256 * 1024 * 1024)
+
+/*! MappedImageMatrix
+* inherits from ImageMatrix to store its planes in a memory-mapped scratch file instead of in RAM,
+* so that images larger than RAM (e.g. whole-slide images) can be sampled in tiles.
+* Only the pages of the file that are touched (e.g. by a tile's submatrix_view) are paged in,
+* and page_out() lets the kernel drop them again once a tile is done.
+* Mapping is off by default.  It is turned on for all MappedImageMatrix objects with SetMapping().
+* Planes smaller than the mapping's min_bytes (and all planes when mapping is off) are allocated as in ImageMatrix.
+*/
+class MappedImageMatrix: public ImageMatrix {
+	public:
+		MappedImageMatrix () : ImageMatrix () {
+			map_fd = -1;
+			mmap_ptr = (byte *)MAP_FAILED;
+			map_size = 0;
+		}
+
+	// Class methods
+		// map planes of min_bytes or more in a scratch file created in directory. An empty directory turns mapping off.
+		static void SetMapping (const std::string &directory, const size_t min_bytes = MAPPED_IMAGE_MIN_BYTES) {
+			map_directory = directory;
+			map_min_bytes = min_bytes;
+		}
+		static bool MappingEnabled () {return (!map_directory.empty());};
+
+	// Accessors
+		bool is_mapped () const {return (mmap_ptr != MAP_FAILED);};
+		// Drop the pages of the mapped planes from memory.  They are written to the scratch file if they were modified,
+		// and paged back in when they are next read.
+		void page_out ();
+
+	// Overrides of parent class methods
+		virtual void allocate (unsigned int w, unsigned int h) ;
+		virtual ~MappedImageMatrix();                                 // destructor
+
+	private:
+		// class statics
+		static size_t page_size;
+		static std::string map_directory;
+		static size_t map_min_bytes;
+
+		// private class methods
+		static size_t calc_map_size (const unsigned int w, const unsigned int h, const enum ColorModes ColorMode, size_t &clr_plane_offset);
+		// private instance methods
+		void unmap ();
+
+		// private object fields
+		int map_fd;            // the scratch file, which is unlinked as soon as it is created
+		byte *mmap_ptr;
+		size_t map_size;
+
+		// mapped layout:
+		// First pages are the array of pixDataType (double or float) for pix_plane
+		// Second set of pages are array of HSVColor for clr_plane if ColorMode != cmGRAY
+		// The pix_plane storage ends on a page boundary so that clr_plane can begin at a page boundary
+};
+
+#endif // __MAPPED_IMAGE_MATRIX_H_
@@ -0,0 +1,63 @@
+// PlanePool: a cache of aligned memory blocks for pixel planes and plane-sized scratch buffers.
+// See PlanePool.h for usage.
+
+#include <map>
+#include <vector>
+#include "Eigen/Core"
+#include "PlanePool.h"
+
+// The free blocks of one thread, keyed by size class
+struct PlaneArena {
+	std::map<size_t, std::vector<void *> > free_blocks;
+};
+
+// The bytes of free blocks cached in all the arenas, updated atomically.
+static size_t cached_bytes = 0;
+
+// One arena per thread, created on first use.
+static PlaneArena *thread_arena = NULL;
+#pragma omp threadprivate(thread_arena)
+
+static PlaneArena &arena () {
+	if (!thread_arena) thread_arena = new PlaneArena;
+	return (*thread_arena);
+}
+
+// Round the size up to one of four steps per power of two, so the most a block can be over-sized is 25%.
+// This must only depend on bytes, because deallocate_bytes() is given the requested size, not the class size.
+static size_t size_class (size_t bytes) {
+	size_t step = 64;
+	while (step * 8 <= bytes) step *= 2;
+	return (((bytes + step - 1) / step) * step);
+}
+
+void *PlanePool::allocate_bytes (size_t bytes) {
+	if (!bytes) return (NULL);
+	size_t block_size = size_class (bytes);
+	PlaneArena &our_arena = arena();
+	std::map<size_t, std::vector<void *> >::iterator it = our_arena.free_blocks.find (block_size);
+	if (it != our_arena.free_blocks.end() && !it->second.empty()) {
+		void *ptr = it->second.back();
+		it->second.pop_back();
+#pragma omp atomic
+		cached_bytes -= block_size;
+		return (ptr);
+	}
+	return (Eigen::internal::aligned_malloc (block_size));
+}
+
+void PlanePool::deallocate_bytes (void *ptr, size_t bytes) {
+	if (!ptr) return;
+	size_t block_size = size_class (bytes);
+	size_t new_cached_bytes;
+	// reserve the block's bytes in the cache, and give them back if that goes over the limit
+#pragma omp atomic capture
+	new_cached_bytes = cached_bytes += block_size;
+	if (new_cached_bytes > PLANE_POOL_MAX_BYTES) {
+#pragma omp atomic
+		cached_bytes -= block_size;
+		Eigen::internal::aligned_free (ptr);
+		return;
+	}
+	arena().free_blocks[block_size].push_back (ptr);
+}
@@ -0,0 +1,53 @@
+// PlanePool: a cache of aligned memory blocks for pixel planes and plane-sized scratch buffers.
+// synopsis:
+//		double *plane = PlanePool::allocate<double> (width * height);
+//		...
+//		PlanePool::deallocate (plane, width * height);  // must be given the same number of elements
+//	or, for scratch memory released at the end of a scope:
+//		PooledArray<double> buf (width * height);
+//		buf[i] = ...;  // converts to a plain double *
+//
+// Blocks are grouped in size classes (four per power of two), so that a block freed by one tile or transform
+// is reused by the next one of the same or similar size, instead of going back to malloc/free each time.
+// Each thread has its own arena of free blocks, so no locking is needed.
+// A block may be returned to a different thread's arena than the one it was allocated from.
+// The arenas of all the threads together cache at most PLANE_POOL_MAX_BYTES of free blocks - blocks beyond that are freed.
+
+#ifndef __PLANE_POOL_H__
+#define __PLANE_POOL_H__
+#include <stddef.h>
+
+#define PLANE_POOL_MAX_BYTES ((size_t)256 * 1024 * 1024)
+
+class PlanePool {
+	private:
+		PlanePool(); // private constructor: static class
+	public:
+		// Blocks are 16-byte aligned, as required by Eigen's vectorized Maps.
+		static void *allocate_bytes (size_t bytes);
+		static void deallocate_bytes (void *ptr, size_t bytes);
+		template <typename T> static T *allocate (size_t n) {
+			return ((T *)allocate_bytes (n * sizeof (T)));
+		}
+		template <typename T> static void deallocate (T *ptr, size_t n) {
+			deallocate_bytes ((void *)ptr, n * sizeof (T));
+		}
+};
+
+// A scope-bound array drawn from the PlanePool
+template <typename T> class PooledArray {
+	private:
+		size_t _n;
+		T *_ptr;
+		// disable copies
+		PooledArray (const PooledArray &);
+		PooledArray &operator= (const PooledArray &);
+	public:
+		PooledArray (size_t n) : _n (n), _ptr (PlanePool::allocate<T> (n)) {}
+		~PooledArray () { PlanePool::deallocate (_ptr, _n); }
+		T *data () const { return _ptr; }
+		size_t size () const { return _n; }
+		operator T* () const { return _ptr; }
+};
+
+#endif // __PLANE_POOL_H__
@@ -69,7 +69,7 @@ void SharedImageMatrix::SetShmemName ( ) {
 //   It is not declared static here because static in a .cpp means something else entirely.
 const size_t SharedImageMatrix::calc_shmem_size (const unsigned int w, const unsigned int h, const enum ColorModes ColorMode, size_t &clr_plane_offset, size_t &shmem_data_offset) {
 	size_t new_mat_size = w * h;
-	size_t new_shmem_size = new_mat_size * sizeof (double);
+	size_t new_shmem_size = new_mat_size * sizeof (pixDataType);
 	// Expand the size to be a multiple of the page size.
 	new_shmem_size = ( (1 + (new_shmem_size / shmem_page_size)) * shmem_page_size );
 	// The color plane starts at a page boundary.
@@ -138,7 +138,7 @@ void SharedImageMatrix::allocate (unsigned int w, unsigned int h) {
 	}
 	shmem_size = new_shmem_size;
 	// remap the data for the object to use the mmap_ptr.
-	remap_pix_plane ( (double *)mmap_ptr, w, h);
+	remap_pix_plane ( (pixDataType *)mmap_ptr, w, h);
 	if (ColorMode != cmGRAY) remap_clr_plane ((HSVcolor *)(mmap_ptr + clr_plane_offset), w, h);
 			
 	
@@ -253,7 +253,7 @@ std::cout << "shmem_size: " << shmem_size << std::endl;
 			
 			// Looks like we have a valid matrix stored, so create the cached result.
 			// remap the data for the object to use the mmap_ptr, keeping the rest of the object where it was.
-			remap_pix_plane ( (double *)mmap_ptr, stored_shmem_data->width, stored_shmem_data->height);
+			remap_pix_plane ( (pixDataType *)mmap_ptr, stored_shmem_data->width, stored_shmem_data->height);
 			if (ColorMode != cmGRAY) remap_clr_plane ((HSVcolor *)(mmap_ptr + stored_clr_plane_offset), stored_shmem_data->width, stored_shmem_data->height);
 			if (width != stored_shmem_data->width || height != stored_shmem_data->height) {
 				error_str = string_format ("error when mapping existing shmem: recovered w,h (%u, %u) doesn't match that in shmem (%u, %u)",
@@ -358,7 +358,7 @@ std::cout <<         "-------- called SharedImageMatrix::Cache on [" << cached_s
 // This attempts to read the file from cache, and calls the superclass to do the work if we need to read it in.
 int SharedImageMatrix::OpenImage(char *image_file_name,
 		int downsample, rect *bounding_rect,
-		double mean, double stddev) {
+		double mean, double stddev, bool load_colors) {
 
 	std::string open_operation;
 	int fildes = open (image_file_name, O_RDONLY);
@@ -380,12 +380,15 @@ int SharedImageMatrix::OpenImage(char *image_file_name,
 		open_operation.append ( string_format ("_DS_%lf_%lf",((double)downsample)/100.0,((double)downsample)/100.0) );
 	if (mean>0)  /* normalize to a given mean and standard deviation */
 		open_operation.append ( string_format ("_Nstd_%lf_%lf",mean,stddev) );
+	// an image opened without its color plane is a different cached object than one opened with it
+	if (!load_colors)
+		open_operation.append ("_Gray");
 
 	// We're setting an empty cached_source since we don't have a shared memory name to begin with.
 	fromCache ("", open_operation);
 	
 	if (cache_status == csWRITE) {
-		int ret = ImageMatrix::OpenImage (image_file_name,downsample,bounding_rect,mean,stddev);
+		int ret = ImageMatrix::OpenImage (image_file_name,downsample,bounding_rect,mean,stddev,load_colors);
 		Cache();
 		return (ret);
 	} else if (cache_status == csREAD) {
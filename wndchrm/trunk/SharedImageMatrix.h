@@ -39,7 +39,7 @@ class SharedImageMatrix: public ImageMatrix {
 		virtual void allocate (unsigned int w, unsigned int h) ;
 		virtual int OpenImage(char *image_file_name,            // load an image of any supported format
 			int downsample, rect *bounding_rect,
-			double mean, double stddev);
+			double mean, double stddev, bool load_colors = true);
 		virtual ImageMatrix &transform (const ImageTransform *transform) const;
 
 		virtual ~SharedImageMatrix();                                 // destructor
@@ -71,7 +71,7 @@ class SharedImageMatrix: public ImageMatrix {
 
 		// shared-memory layout:
 		// last sizeof(shmem_data) bytes are shmem_data.
-		// First pages are the array of doubles for pix_plane
+		// First pages are the array of pixDataType (double or float) for pix_plane
 		// Second set of pages are array of HSVColor for clr_plane if shmem_data->ColorMode != cmGRAY
 		// The pix_plane matrix storage ends on a page boundary so that clr_plane can begin at a page boundary
 		// The shmem_data storage does not necessarily begin at a page boundary, but it is at the end of the last page.
@@ -134,11 +134,13 @@ void FeatureComputationPlan::add (const FeatureGroup *fg) {
 		if (!trans_node_name.empty()) trans_node_name += "->";
 		trans_node_name += fg->transforms[i]->name;
 		source_node = add_get_node (node_key, source_node, fg->transforms[i], trans_node_name);
+		if (fg->transforms[i]->reads_colors) reads_colors = true;
 	}
 
 	// Add the feature algorithm
 	node_key += fg->algorithm->name;
 	FG_node_map[fg->name] = add_get_node (node_key, source_node, fg->algorithm, fg->name);
+	if (fg->algorithm->reads_colors) reads_colors = true;
 
 	// Determine the column where to put this FG's results, and update the feature count.
 	size_t start_idx = n_features;
@@ -259,11 +261,11 @@ void FeatureComputationPlanExecutor::finish_node_execution (const ComputationTas
 }
 
 
-void FeatureComputationPlanExecutor::run (const ImageMatrix *source_mat, std::vector<double> &feature_mat_in, size_t dest_row) {
+void FeatureComputationPlanExecutor::run (const ImageMatrix *source_mat, double *feature_mat_in, size_t dest_row) {
 
 	reset();
 
-	feature_mat = &feature_mat_in[0];
+	feature_mat = feature_mat_in;
 	current_feature_mat_row = dest_row;
 	// put the source_mat into the cache
 	IM_map["root"] = source_mat;
@@ -283,6 +285,7 @@ void FeatureComputationPlanExecutor::run (const ImageMatrix *source_mat, std::ve
 
 void FeatureComputationPlanExecutor::reset () {
 	// The ImageMatrixes in IM_map were all created within the execution, so they must all be deleted.
+	// Their planes go back to the PlanePool, where the next run's transforms pick them up again.
 	// EXCEPT the root node, which was a parameter to run().
 	// The root node must be called 'root'
 	IM_map.erase ("root");
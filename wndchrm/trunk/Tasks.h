@@ -49,6 +49,7 @@ class ComputationTask {
 		};
 		std::string name;
 		TaskType type;
+		bool reads_colors; // the task reads the color plane of its input (false by default)
 
 		virtual bool register_task() const = 0;
 
@@ -57,7 +58,7 @@ class ComputationTask {
 		const char *typeLabel () const {return (typeLabels(type));}
 	// Protected so inherited classes can still call the parent constructor
 	protected:
-		ComputationTask (const std::string &s, TaskType t) { name = s; type = t;}
+		ComputationTask (const std::string &s, TaskType t) { name = s; type = t; reads_colors = false;}
 	private:
         ComputationTask(ComputationTask const&);              // Don't Implement
         void operator=(ComputationTask const&); // Don't implement
@@ -271,6 +272,7 @@ class FeatureComputationPlan : public ComputationPlan {
 	public:
 		size_t n_features;
 		int feature_vec_type;              // stores the integer value of the feature_vec_types enum.
+		bool reads_colors;                 // one or more of the plan's tasks reads the color plane, so images must be opened with one
 
 		virtual void add (const std::string &FGname);
 		void add (const FeatureGroup *fg);
@@ -288,6 +290,7 @@ class FeatureComputationPlan : public ComputationPlan {
 		FeatureComputationPlan (const std::string &name_in) : ComputationPlan (name_in) {
 			n_features = 0;
 			feature_vec_type = 0;
+			reads_colors = false;
 		}
 		// parent destructor takes care of CalculationTask objects
 		// This plan doesn't own any of the objects it has references to
@@ -320,7 +323,7 @@ class FeatureComputationPlanExecutor : public ComputationPlanExecutor {
 		size_t current_feature_mat_row;
 
 		virtual void finish_node_execution (const ComputationTaskNode *exec_node);
-		virtual void run (const ImageMatrix *source_mat, std::vector<double> &feature_mat_in, size_t dest_row);
+		virtual void run (const ImageMatrix *source_mat, double *feature_mat_in, size_t dest_row);
 		// in the parent, the run method signature has no parameters and is pure virtual
 		// this class has to have run parameters, so we override the paren't virtual run() with a noop
 		virtual void run () {}
@@ -68,6 +68,7 @@
 #include <math.h>
 
 #include "TrainingSet.h"
+#include "MappedImageMatrix.h"
 
 #include "gsl/specfunc.h"
 
@@ -78,6 +79,10 @@
 /* global variable */
 extern int verbosity;
 
+// storage and initialization for the class statics
+bool TrainingSet::batch_distances = false;
+bool TrainingSet::use_wnn_index = false;
+
 /* compare_two_doubles
    function used for qsort
 */
@@ -167,6 +172,9 @@ TrainingSet::TrainingSet(long samples_num, long class_num)
 //   for (sample_index=0;sample_index<MAX_CLASS_NUM;sample_index++)
 //     strcpy(class_labels[sample_index],"");
    count=0;
+   wnd_features.valid = false;
+   wnn_index.valid = false;
+   batch_features.valid = false;
 
 	 // Memory allocated for the aggregated_feature_stats
 	 // if this* is the top Level TrainingSet from which all
@@ -218,7 +226,7 @@ int TrainingSet::AddContinuousClass(char *label) {
 	is_numeric = 1;
 	class_num = 1;
 	if (label) snprintf(class_labels[CONTINUOUS_CLASS_INDEX],MAX_CLASS_NAME_LENGTH,"%s",label);
-	else class_labels[CONTINUOUS_CLASS_INDEX] = '\0';
+	else class_labels[CONTINUOUS_CLASS_INDEX][0] = '\0';
 	class_nsamples[CONTINUOUS_CLASS_INDEX] = 0;
 	
 	return (1);
@@ -322,6 +330,9 @@ int TrainingSet::AddSample(signatures *new_sample)
 		signature_count = new_sample->count;
 
 	samples[count]=new_sample;
+	wnd_features.valid = false;
+	wnn_index.valid = false;
+	batch_features.valid = false;
 	signature_count=new_sample->count;
 	class_nsamples[new_sample->sample_class]++;
 //printf ("Adding Sample to class: %d, total:%ld, signature_count:%ld\n",new_sample->sample_class,class_nsamples[new_sample->sample_class],signature_count);
@@ -329,6 +340,65 @@ int TrainingSet::AddSample(signatures *new_sample)
 	return(1);
 }
 
+/* AddSamplesFrom
+   Add samples of another set by their indexes, e.g. to make a split of it.
+   The other set is packed first (see PackSamples), and its samples must outlive this set's.
+   from -TrainingSet *- the set to add samples from
+   sample_indexes -std::vector<long> &- the indexes of its samples to add, in order
+   view -bool- if true, the samples added are views of the other set's values, so no values are copied (only for sets whose values won't be changed, e.g. test sets).
+     Otherwise, if this set is empty, their values are copied straight into a new feature_matrix, one row per sample, which normalize() then works on in place.
+     Otherwise the samples are duplicated one at a time.
+   returned value -int- 1 if suceeded, < 0 if AddSample failed.
+*/
+int TrainingSet::AddSamplesFrom(TrainingSet *from, const std::vector<long> &sample_indexes, bool view) {
+	size_t row_index, n_rows = sample_indexes.size();
+	long n_cols = from->signature_count;
+	signatures *new_sample;
+	int res;
+
+	from->PackSamples();
+	bool pack = (!view && count == 0);
+	if (pack) {
+		for (row_index = 0; row_index < n_rows; row_index++)
+			if (from->samples[ sample_indexes[row_index] ]->count > n_cols) n_cols = from->samples[ sample_indexes[row_index] ]->count;
+		feature_matrix.setZero (n_rows, n_cols);
+	}
+
+	for (row_index = 0; row_index < n_rows; row_index++) {
+		signatures *sample = from->samples[ sample_indexes[row_index] ];
+		if (view) new_sample = sample->duplicate (sample->data);
+		else if (pack) new_sample = sample->duplicate (feature_matrix.row(row_index).data());
+		else new_sample = sample->duplicate ();
+		if ( (res = AddSample (new_sample)) < 0) {
+			delete new_sample;
+			return (res);
+		}
+	}
+	return (1);
+}
+
+/* PackSamples
+   Copy the values of all the samples into feature_matrix, one row per sample, and make each sample a view of its row.
+   Loops over the samples then stream through one contiguous block of memory instead of one allocation per sample.
+   A sample added afterwards keeps its own storage until PackSamples is called again.
+*/
+void TrainingSet::PackSamples() {
+	long sample_index, n_cols = signature_count;
+	bool is_packed = (feature_matrix.rows() == count);
+	for (sample_index = 0; sample_index < count; sample_index++) {
+		if (samples[sample_index]->count > n_cols) n_cols = samples[sample_index]->count;
+		if (is_packed && samples[sample_index]->data != feature_matrix.row(sample_index).data()) is_packed = false;
+	}
+	// nothing to do if the samples are already the rows of feature_matrix (e.g. added by AddSamplesFrom)
+	if (is_packed && n_cols <= feature_matrix.cols()) return;
+
+	// the samples may be bound to the rows of the old matrix, so it's replaced only after they're copied.
+	FeatureMatrix packed (count, n_cols);
+	for (sample_index = 0; sample_index < count; sample_index++)
+		samples[sample_index]->bind (packed.row(sample_index).data(), n_cols);
+	feature_matrix.swap (packed);
+}
+
 /* SaveToFile
    filename -char *- the name of the file to save
    returned value -int- 1 is successful, 0 if failed.
@@ -493,7 +563,7 @@ long index;
 
 	for (index=0;index < class_num;index++) strcpy(class_labels[index],"");
 	if (label) snprintf(class_labels[CONTINUOUS_CLASS_INDEX],MAX_CLASS_NAME_LENGTH,"%s",label);
-	else class_labels[CONTINUOUS_CLASS_INDEX] = '\0';
+	else class_labels[CONTINUOUS_CLASS_INDEX][0] = '\0';
 
 
 	/* make the samples referring to class_index refer to class 0 */
@@ -503,6 +573,9 @@ long index;
 	// The number of defined classes is reduced by 1
 	class_num=1;
 	is_continuous = 1;
+	wnd_features.valid = false;
+	wnn_index.valid = false;
+	batch_features.valid = false;
 }
 
 /*
@@ -532,6 +605,9 @@ long index;
 	
 	// The number of defined classes is reduced by 1
 	class_num--;
+	wnd_features.valid = false;
+	wnn_index.valid = false;
+	batch_features.valid = false;
 }
 
 /* RemoveClass
@@ -572,6 +648,9 @@ void TrainingSet::RemoveClass(long class_index)
 	// change the number of classes
 		class_num--;
 	}
+	wnd_features.valid = false;
+	wnn_index.valid = false;
+	batch_features.valid = false;
 
 	return;
 }
@@ -579,15 +658,16 @@ void TrainingSet::RemoveClass(long class_index)
 /* SaveWeightVector
    save the weights of the features into a file 
    filename -char *- the name of the file into which the weight values should be written
+   output_file -FILE *- where the progress message is printed (stdout if NULL)
 */
-int TrainingSet::SaveWeightVector(char *filename)
+int TrainingSet::SaveWeightVector(char *filename, FILE *output_file)
 {  FILE *sig_file;
    int sig_index;
    if (!(sig_file=fopen(filename,"w"))) {
     catError ("Can't write weight vector to '%s'.\n",filename);
    	return(0);
    }
-   if (verbosity>=2) printf("Saving weight vector to file '%s'...\n",filename);   
+   if (verbosity>=2) fprintf((output_file ? output_file : stdout),"Saving weight vector to file '%s'...\n",filename);   
    for (sig_index=0;sig_index<signature_count;sig_index++)
      fprintf(sig_file,"%f %s\n",SignatureWeights[sig_index],SignatureNames[sig_index]);
    fclose(sig_file);
@@ -598,9 +678,10 @@ int TrainingSet::SaveWeightVector(char *filename)
    load the weights of the features from a file and assign them to the features of the training set
    filename -char *- the name of the file into which the weight values should be read from
    factor -double- multiple the loaded feature vector and add to the existing vecotr (-1 is subtracting). 0 replaces the existing vector with the loaded vector.
+   output_file -FILE *- where the progress message is printed (stdout if NULL)
    returned value -double- the square difference between the original weight vector and the imported weight vector
 */
-double TrainingSet::LoadWeightVector(char *filename, double factor)
+double TrainingSet::LoadWeightVector(char *filename, double factor, FILE *output_file)
 {  FILE *sig_file;
    int sig_index=0;
    char line[128],*p_line;
@@ -609,7 +690,7 @@ double TrainingSet::LoadWeightVector(char *filename, double factor)
     catError ("Can't read weight vector from '%s'.\n",filename);
    	return(0);
    }
-   if (verbosity>=2) printf("Loading weight vector from file '%s'...\n",filename);
+   if (verbosity>=2) fprintf((output_file ? output_file : stdout),"Loading weight vector from file '%s'...\n",filename);
    p_line=fgets(line,sizeof(line),sig_file);
    while (p_line)
    {  if (strlen(p_line)>0)
@@ -622,6 +703,9 @@ double TrainingSet::LoadWeightVector(char *filename, double factor)
       p_line=fgets(line,sizeof(line),sig_file);   
    }
    fclose(sig_file);
+	wnd_features.valid = false;
+	wnn_index.valid = false;
+	batch_features.valid = false;
 	if (sig_index!=signature_count) {
 		catError ("Feature count in weight vector '%s' (%d) don't match dataset (%d).\n",filename,sig_index,signature_count);
 		return(-1.0);
@@ -643,12 +727,26 @@ void TrainingSet::SetAttrib(TrainingSet *set)
    /* copy the signature names to the training and test set */
    for (sig_index=0;sig_index<signature_count;sig_index++)
      strcpy(set->SignatureNames[sig_index],SignatureNames[sig_index]);
+   LookupFeatureInfos();
+   set->feature_infos = feature_infos;
    set->is_numeric = is_numeric;
    set->is_pure_numeric = is_pure_numeric;
    set->is_continuous = is_continuous;
    
 }
 
+/* LookupFeatureInfos
+   Look up the FeatureNames info of each signature by its name, unless they have been looked up already.
+   SetAttrib passes them on to the sets made from this one, so they are looked up once instead of in every split.
+   Note that FeatureNames adds the names it hasn't seen to its map, so this must not be called from more than one thread at a time.
+*/
+void TrainingSet::LookupFeatureInfos() {
+	if (feature_infos.size() == (size_t)signature_count) return;
+	feature_infos.resize (signature_count);
+	for (int sig_index = 0; sig_index < signature_count; sig_index++)
+		feature_infos[ sig_index ] = FeatureNames::getFeatureInfoByName ( SignatureNames[ sig_index ] );
+}
+
 /*  split
     split into a training set and a test set
     randomize -int- If true, split randomly.  If false, split by sample order in object
@@ -676,6 +774,7 @@ int TrainingSet::split(int randomize, double ratio,TrainingSet *TrainSet,Trainin
 	class_samples = new long[count];
 	bool make_test_set = true;
 	long rand_index;
+	std::vector<long> train_indexes, test_indexes;   // the samples are picked first, then added all at once
 
 	// copy the same attributes to the training and test set
 	SetAttrib( TrainSet );
@@ -730,7 +829,7 @@ int TrainingSet::split(int randomize, double ratio,TrainingSet *TrainSet,Trainin
 			else rand_index=0;
 
 			for( tile_index=0; tile_index < tiles; tile_index++ )    // add all the tiles of that image 
-				if( ( res = TrainSet->AddSample( samples[ class_samples[ rand_index * tiles + tile_index ] ]->duplicate() ) ) < 0) return (res);   // add the random sample		   
+				train_indexes.push_back( class_samples[ rand_index * tiles + tile_index ] );   // add the random sample
 			// remove the index
 			memmove( &( class_samples[ rand_index * tiles ] ), &( class_samples[ rand_index * tiles + tiles ] ), sizeof( long )*( tiles*( class_samples_count - rand_index ) ) );
 			class_samples_count--;
@@ -753,7 +852,7 @@ int TrainingSet::split(int randomize, double ratio,TrainingSet *TrainSet,Trainin
 			//printf ("getting %d testing samples from class %s\n", sample_count, class_labels[class_index]);
 			for( sample_index = 0; sample_count > 0; sample_index++ )
 			{
-				if( ( res = TestSet->AddSample( samples[ class_samples[ sample_index ] ]->duplicate() ) ) < 0 ) return (res);
+				test_indexes.push_back( class_samples[ sample_index ] );
 				sample_count--;
 			}
 		}
@@ -766,15 +865,19 @@ int TrainingSet::split(int randomize, double ratio,TrainingSet *TrainSet,Trainin
 				else rand_index=0;
 
 				for( tile_index=0; tile_index < tiles; tile_index++ )    // add all the tiles of that image 
-					if( ( res = TestSet->AddSample( samples[ class_samples[ rand_index * tiles + tile_index ] ]->duplicate() ) ) < 0) return (res);   // add the random sample		   
+					test_indexes.push_back( class_samples[ rand_index * tiles + tile_index ] );   // add the random sample
 				// remove the index
 				memmove( &( class_samples[ rand_index * tiles ] ), &( class_samples[ rand_index * tiles + tiles ] ), sizeof( long )*( tiles*( class_samples_count - rand_index ) ) );
 				class_samples_count--;
 			}
 		}
 	} // end iterating over each image class
-
 	delete [] class_samples;
+
+	// The training samples get their own copy of the values to be normalized, packed in one matrix.
+	// The test samples aren't changed when they're classified, so they're views of our values.
+	if( ( res = TrainSet->AddSamplesFrom( this, train_indexes, false ) ) < 0 ) return (res);
+	if( ( res = TestSet->AddSamplesFrom( this, test_indexes, true ) ) < 0 ) return (res);
 	return (1);
 }
 
@@ -790,13 +893,13 @@ int TrainingSet::SplitAreas(long tiles_num, TrainingSet **TrainingSets)
    {  TrainingSets[tile_index]=new TrainingSet((long)ceil((double)count/(double)tiles_num),class_num);   /* allocate memory for the new set of each tile location */
       SetAttrib(TrainingSets[tile_index]);
    }
-   tile_index=0;
-   for (samp_index=0;samp_index<count;samp_index++)
-   {  if ( (res=TrainingSets[tile_index]->AddSample(samples[samp_index]->duplicate())) < 0) return (res);
-      tile_index++;
-      if (tile_index>=tiles_num) tile_index=0;
+   for (tile_index=0;tile_index<tiles_num;tile_index++)
+   {  std::vector<long> tile_samples;
+      for (samp_index=tile_index;samp_index<count;samp_index+=tiles_num)
+        tile_samples.push_back(samp_index);
+      if ( (res=TrainingSets[tile_index]->AddSamplesFrom(this,tile_samples,false)) < 0) return (res);
    }
-   
+
    return (1);
 }
 
@@ -1183,6 +1286,37 @@ int TrainingSet::LoadFromPath(char *path, int save_sigs, featureset_t *featurese
 
 
 
+// true if the .sig files of all the samples of the image, sampled as a single page, are on disk
+static bool SinglePageSigsExist (const char *filename, const featureset_t *featureset) {
+	signatures probe;
+	char buffer[IMAGE_PATH_LENGTH+SAMPLE_NAME_LENGTH+1];
+	struct stat sig_stat;
+
+	strcpy (probe.full_path, filename);
+	for (int sample_index = 0; sample_index < featureset->n_samples; sample_index++) {
+		strcpy (probe.sample_name, featureset->samples[sample_index].sample_name);
+		if (stat (probe.GetFileName (buffer), &sig_stat) != 0) return (false);
+	}
+	return (true);
+}
+
+// get a feature calculation plan based on our featureset
+static const FeatureComputationPlan *GetFeaturePlan (const featureset_t *featureset) {
+	if (featureset->feature_opts.large_set) {
+		if (featureset->feature_opts.compute_colors) {
+			return (StdFeatureComputationPlans::getFeatureSetLongColor());
+		} else {
+			return (StdFeatureComputationPlans::getFeatureSetLong());
+		}
+	} else {
+		if (featureset->feature_opts.compute_colors) {
+			return (StdFeatureComputationPlans::getFeatureSetColor());
+		} else {
+			return (StdFeatureComputationPlans::getFeatureSet());
+		}
+	}
+}
+
 /* LoadFromFilesDir
    load images from the specified path, assigning them to the specified class, giving them the specified value
      Both can be 0 if the class is unknown
@@ -1253,13 +1387,40 @@ int TrainingSet::LoadFromFilesDir(char *path, unsigned short sample_class, doubl
 		
 	// N.B.: A call to AddClass must already have occurred, otherwise AddSample called from AddImageFile will fail.
 
-	// Process the files in sort order
+	// Process the files in sort order.
+	// Each thread locks the sigs for an image, reads it and computes its features, while the other threads work on the next images.
+	// The samples are added to the training set in the ordered section, so they end up in file order.
+	// A thread that's done with its image waits there for the threads working on the images before it,
+	// which keeps the number of images in memory at one per thread.
+	GetFeaturePlan (featureset); // make sure the plan is built before the threads use it
+	bool failed = false;
+#pragma omp parallel for ordered schedule(dynamic,1)
 	for (file_index=0; file_index<n_img_basenames; file_index++) {
-		sprintf(buffer,"%s/%s",path,base_names_vec[file_index].c_str());
-		res = AddImageFile(buffer, sample_class, sample_value, save_sigs, featureset, skip_sig_comparison_check);
-		if (res < 0) return (res);
-		else files_in_class_count += res; // May be zero
+		char file_path[512];
+		std::vector<image_sample_t> image_samples;
+		int image_res = -1;
+
+#pragma omp flush(failed)
+		if (!failed) {
+			sprintf(file_path,"%s/%s",path,base_names_vec[file_index].c_str());
+			image_res = ComputeImageSamples(file_path, sample_class, sample_value, featureset, skip_sig_comparison_check, image_samples);
+		}
+#pragma omp ordered
+		{
+			if (!failed) {
+				image_res = AddImageSamples (image_samples, image_res);
+				if (image_res < 0) {
+					res = image_res;
+					failed = true;
+#pragma omp flush(failed)
+				} else files_in_class_count += image_res; // May be zero
+			} else {
+				for (size_t sample_index = 0; sample_index < image_samples.size(); sample_index++)
+					delete image_samples[sample_index].sig;
+			}
+		}
 	}
+	if (failed) return (res);
 	return (files_in_class_count);
 }
 
@@ -1295,6 +1456,34 @@ int TrainingSet::LoadFromFilesDir(char *path, unsigned short sample_class, doubl
 
  
 int TrainingSet::AddImageFile(char *filename, unsigned short sample_class, double sample_value, int save_sigs, featureset_t *featureset, int skip_sig_comparison_check ) {
+	std::vector<image_sample_t> image_samples;
+	int res = ComputeImageSamples (filename, sample_class, sample_value, featureset, skip_sig_comparison_check, image_samples);
+	return (AddImageSamples (image_samples, res));
+}
+
+/* AddImageSamples
+   Add the samples gathered by ComputeImageSamples to the training set, in order.
+   res is the value returned by ComputeImageSamples, which is returned unless a sample can't be added.
+   Samples that can't be added (and any after them) are deleted.
+*/
+int TrainingSet::AddImageSamples (std::vector<image_sample_t> &image_samples, int res) {
+	int add_res = 1;
+	for (size_t sample_index = 0; sample_index < image_samples.size(); sample_index++) {
+		if (add_res >= 0) add_res = AddSample (image_samples[sample_index].sig);
+		if (add_res < 0) delete image_samples[sample_index].sig;
+		else if (image_samples[sample_index].clear) image_samples[sample_index].sig->Clear ();
+	}
+	image_samples.clear();
+	return (add_res < 0 ? add_res : res);
+}
+
+/* ComputeImageSamples
+   Does the work of AddImageFile, except that the samples are appended to image_samples instead of being added to the training set,
+   so that images can be processed concurrently while their samples are added in order (see LoadFromFilesDir).
+   Except for AddSample (which is done by AddImageSamples), this does not change the TrainingSet.
+*/
+int TrainingSet::ComputeImageSamples(char *filename, unsigned short sample_class, double sample_value, featureset_t *featureset, int skip_sig_comparison_check,
+	std::vector<image_sample_t> &image_samples) {
 	int res=0;
 	int sample_index;
 	signatures *ImageSignatures;
@@ -1302,22 +1491,21 @@ int TrainingSet::AddImageFile(char *filename, unsigned short sample_class, doubl
 	int sig_index,n_sigs=0;
 
 	std::vector<feature_vec_info_t> our_sigs;
-	feature_vec_info_t null_sig_info = {NULL,-1, -1, -1, false, false};
+	feature_vec_info_t null_sig_info = {NULL, -1, -1, -1, -1, false, false};
+	image_sample_t read_sample = {NULL, false}, computed_sample = {NULL, true};
 	
-	// get a feature calculation plan based on our featureset
-	const FeatureComputationPlan *feature_plan;
-	if (featureset->feature_opts.large_set) {
-		if (featureset->feature_opts.compute_colors) {
-			feature_plan = StdFeatureComputationPlans::getFeatureSetLongColor();
-		} else {
-			feature_plan = StdFeatureComputationPlans::getFeatureSetLong();
-		}
-	} else {
-		if (featureset->feature_opts.compute_colors) {
-			feature_plan = StdFeatureComputationPlans::getFeatureSetColor();
-		} else {
-			feature_plan = StdFeatureComputationPlans::getFeatureSet();
-		}
+	const FeatureComputationPlan *feature_plan = GetFeaturePlan (featureset);
+
+	// Each page of a multi-page TIFF (e.g. a z-stack) is sampled as if it were its own image,
+	// with the page number at the start of its sample names.
+	// The TIFF is opened once here, and kept open to read the pages if any sigs need to be computed.
+	// If the sigs of the image sampled as a single page are all on disk, the TIFF isn't opened at all (see AddImageFile):
+	// its pages are only counted to name the sigs of a multi-page TIFF, or to find out if there are any to compute.
+	TIFFPageReader page_reader;
+	int page, n_pages = 1;
+	if ((strstr(filename,".tif") || strstr(filename,".TIF")) && !SinglePageSigsExist (filename, featureset)) {
+		if (page_reader.open (filename) < 2) page_reader.close();
+		else n_pages = page_reader.pages();
 	}
 
 
@@ -1328,61 +1516,75 @@ int TrainingSet::AddImageFile(char *filename, unsigned short sample_class, doubl
 // Eventually, the sampling code would live here, and be generic but the set-up of the parameters would be done elsewhere
 // It seems this would be a good application of functional programming (i.e. closures, functors, etc).
 	our_sigs.push_back (null_sig_info);
-	for (sample_index=0; sample_index < featureset->n_samples; sample_index++) {
-	// make signature objects for samples
-		ImageSignatures=new signatures ();
-		ImageSignatures->Resize (featureset->n_features);
-
-		ImageSignatures->NamesTrainingSet=this;
-		strcpy(ImageSignatures->full_path,filename);
-		ImageSignatures->sample_class=sample_class;
-		ImageSignatures->sample_value=sample_value;
-
-	// set the sample name and try to read it from disk.
-	// This will acquire a lock if the sample doesn't exist
-	// Note that we're acquiring locks for all the sig files for this image because its inefficient
-	// for multiple processes to read the same image and compute different sub-sets of the same sig-set.
-	// Initially, multiple processes will "win" on one image and do this anyway, but eventually they will become de-synchronized.
-	// The image file itself could be locked to prevent this, but this would be more complicated:
-	//  * are the other processes really computing the same sate of sigs?  Not necessarily.
-	//  * we would have to wait for the image lock to clear and issue locks on any left over sig files that weren't locked while we waited.
-		strcpy (ImageSignatures->sample_name,featureset->samples[sample_index].sample_name);
-	// ask for an exclusive write-lock if file doesn't exist
-	// if its the last sample, then we wait for the lock.
-		res = ImageSignatures->ReadFromFile(0);
-		if (res == 0 && ImageSignatures->wf && ImageSignatures->wf->status == WORMfile::WORM_WR) { // got a lock: file didn't exist previously, and is not locked by another process.
-			if (verbosity>=2) printf ("Adding '%s' for sig calc.\n",ImageSignatures->GetFileName(buffer));
-			our_sigs[n_sigs].sig = ImageSignatures;
-			our_sigs[n_sigs].rot_index = featureset->samples[sample_index].rot_index;
-			our_sigs[n_sigs].tile_index_x = featureset->samples[sample_index].tile_index_x;
-			our_sigs[n_sigs].tile_index_y = featureset->samples[sample_index].tile_index_y;
-		// Initialize the next one
-			our_sigs.push_back (null_sig_info);
-			n_sigs++;
-		} else if (res == 0) {
-		// File already has a lock.
-			if (verbosity>=2) printf ("Sig '%s' being processed by someone else\n",ImageSignatures->GetFileName(buffer));
-			if ( (res=AddSample(ImageSignatures)) < 0) break;
-
-		} else if (res == NO_SIGS_IN_FILE) {
-		// File exists and lockable, but no sigs
-			catError ("Sig File '%s' for image '%s' has no data. Processing may have prematurely terminated, or file locking may not be functional.\n",
-				ImageSignatures->GetFileName(buffer), filename);
-			if ( (res=AddSample(ImageSignatures)) < 0) break;
-
-		} else if (res < 0) {
-		// no lock or sig file, couldn't create, other errors
-			catError ("Error locking/creating '%s'.\n",ImageSignatures->GetFileName(buffer));
-			break;
+	for (page = 0; page < n_pages && res >= 0; page++) {
+		for (sample_index=0; sample_index < featureset->n_samples; sample_index++) {
+		// make signature objects for samples
+			ImageSignatures=new signatures ();
+			ImageSignatures->Resize (featureset->n_features);
 
-		} else if (res > 0) {
-		// file was successfully read in (no write lock, file present, samples present).
-		// over-write these fields read in from the file
+			ImageSignatures->NamesTrainingSet=this;
 			strcpy(ImageSignatures->full_path,filename);
 			ImageSignatures->sample_class=sample_class;
 			ImageSignatures->sample_value=sample_value;
-			if (verbosity>=2) printf ("Sig '%s' read in.\n",ImageSignatures->GetFileName(buffer));
-			if ( (res=AddSample(ImageSignatures)) < 0) break;
+
+		// set the sample name and try to read it from disk.
+		// This will acquire a lock if the sample doesn't exist
+		// Note that we're acquiring locks for all the sig files for this image because its inefficient
+		// for multiple processes to read the same image and compute different sub-sets of the same sig-set.
+		// Initially, multiple processes will "win" on one image and do this anyway, but eventually they will become de-synchronized.
+		// The image file itself could be locked to prevent this, but this would be more complicated:
+		//  * are the other processes really computing the same sate of sigs?  Not necessarily.
+		//  * we would have to wait for the image lock to clear and issue locks on any left over sig files that weren't locked while we waited.
+			if (n_pages > 1) {
+				snprintf (ImageSignatures->sample_name, SAMPLE_NAME_LENGTH, "-%s%d%s",
+					featureset->sampling_opts.page_base, page, featureset->samples[sample_index].sample_name);
+			} else {
+				strcpy (ImageSignatures->sample_name,featureset->samples[sample_index].sample_name);
+			}
+		// ask for an exclusive write-lock if file doesn't exist
+		// if its the last sample, then we wait for the lock.
+			res = ImageSignatures->ReadFromFile(0);
+			if (res == 0 && ImageSignatures->wf && ImageSignatures->wf->status == WORMfile::WORM_WR) { // got a lock: file didn't exist previously, and is not locked by another process.
+				if (verbosity>=2) printf ("Adding '%s' for sig calc.\n",ImageSignatures->GetFileName(buffer));
+				our_sigs[n_sigs].sig = ImageSignatures;
+				our_sigs[n_sigs].page = page;
+				our_sigs[n_sigs].rot_index = featureset->samples[sample_index].rot_index;
+				our_sigs[n_sigs].tile_index_x = featureset->samples[sample_index].tile_index_x;
+				our_sigs[n_sigs].tile_index_y = featureset->samples[sample_index].tile_index_y;
+			// Initialize the next one
+				our_sigs.push_back (null_sig_info);
+				n_sigs++;
+			} else if (res == 0) {
+			// File already has a lock.
+				if (verbosity>=2) printf ("Sig '%s' being processed by someone else\n",ImageSignatures->GetFileName(buffer));
+				read_sample.sig = ImageSignatures;
+				image_samples.push_back (read_sample);
+				res = 1;
+
+			} else if (res == NO_SIGS_IN_FILE) {
+			// File exists and lockable, but no sigs
+				catError ("Sig File '%s' for image '%s' has no data. Processing may have prematurely terminated, or file locking may not be functional.\n",
+					ImageSignatures->GetFileName(buffer), filename);
+				read_sample.sig = ImageSignatures;
+				image_samples.push_back (read_sample);
+				res = 1;
+
+			} else if (res < 0) {
+			// no lock or sig file, couldn't create, other errors
+				catError ("Error locking/creating '%s'.\n",ImageSignatures->GetFileName(buffer));
+				break;
+
+			} else if (res > 0) {
+			// file was successfully read in (no write lock, file present, samples present).
+			// over-write these fields read in from the file
+				strcpy(ImageSignatures->full_path,filename);
+				ImageSignatures->sample_class=sample_class;
+				ImageSignatures->sample_value=sample_value;
+				if (verbosity>=2) printf ("Sig '%s' read in.\n",ImageSignatures->GetFileName(buffer));
+				read_sample.sig = ImageSignatures;
+				image_samples.push_back (read_sample);
+				res = 1;
+			}
 		}
 	}
 	
@@ -1405,58 +1607,89 @@ int TrainingSet::AddImageFile(char *filename, unsigned short sample_class, doubl
 	// for all the sigs we will calculate.  The code separation b/w sampling parameter setup and the sampling itself points to
 	// doing this in a more general way with functional programming (or some other technique).
 	ImageMatrix *rot_matrix_p=NULL, *tile_matrix_p=NULL;
-	ImageMatrix image_matrix, rot_matrix, tile_matrix;
+	// Whole images (and their rotations) are memory-mapped if MappedImageMatrix::SetMapping() was called,
+	// in which case only the pages of the tile being sampled need to be in memory.
+	// The pages of a multi-page TIFF alternate between the two page_matrices:
+	// while the sigs of one page are computed, the next page with sigs to compute is read into the other one.
+	MappedImageMatrix page_matrices[2], rot_matrix;
+	ImageMatrix tile_matrix;
+	int page_res[2] = {0, 0}, matrix_index = 0;
+	int page_start, page_end, next_page;
 	int rot_matrix_indx=0;
 	int tiles_x = featureset->sampling_opts.tiles_x, tiles_y = featureset->sampling_opts.tiles_y, tiles = tiles_x * tiles_y;
 	preproc_opts_t *preproc_opts = &(featureset->preproc_opts);
 	feature_opts_t *feature_opts = &(featureset->feature_opts);
 	int rot_index,tile_index_x,tile_index_y;
-	for (sig_index = 0; sig_index < n_sigs; sig_index++) {
-		ImageSignatures = our_sigs[sig_index].sig;
-		rot_index = our_sigs[sig_index].rot_index;
-		tile_index_x = our_sigs[sig_index].tile_index_x;
-		tile_index_y = our_sigs[sig_index].tile_index_y;
-		our_sigs[sig_index].saved = false; // don't unlink if true
-		our_sigs[sig_index].added = false; // don't delete if true
-		if (verbosity>=2) printf ("processing '%s' (index %d).\n",ImageSignatures->GetFileName(buffer),sig_index);
+	for (page_start = 0; page_start < n_sigs; page_start = page_end) {
+		MappedImageMatrix &image_matrix = page_matrices[matrix_index];
+		page = our_sigs[page_start].page;
+		for (page_end = page_start + 1; page_end < n_sigs && our_sigs[page_end].page == page; page_end++);
+		next_page = (page_end < n_sigs ? our_sigs[page_end].page : -1);
 
 		// Open the image once for the first sample
-		if (sig_index == 0) {
+		if (page_start == 0) {
 		// any pre-existing sig files may have different paths for the image (i.e. different NFS mountpoints, etc.)
 		// One of these could be reachable if the image is not in the same directory as the sigs.
 		// There is no support for this now though - its an error for the image not to exist together with the sigs
 		// if we need to open the image to recalculate sigs (which we only need if one or more sigs is missing).
-			if ( (res = image_matrix.OpenImage(filename,preproc_opts->downsample,&(preproc_opts->bounding_rect),(double)preproc_opts->mean,(double)preproc_opts->stddev)) < 1) {
-				catError ("Could not read image file '%s' to recalculate sigs.\n",filename);
-				res = -1; // make sure its negative for cleanup below
-				break;
-			}
+			// The color plane is only loaded if the feature plan has color features
+			if (n_pages > 1) page_res[matrix_index] = page_reader.read (image_matrix, page,
+				preproc_opts->downsample,&(preproc_opts->bounding_rect),(double)preproc_opts->mean,(double)preproc_opts->stddev,feature_plan->reads_colors);
+			else page_res[matrix_index] = image_matrix.OpenImage(filename,
+				preproc_opts->downsample,&(preproc_opts->bounding_rect),(double)preproc_opts->mean,(double)preproc_opts->stddev,feature_plan->reads_colors);
 		}
-		if (rot_index > 0) {
-			rot_matrix.Rotate (image_matrix, 90.0 * rot_index);
-			rot_matrix_indx = rot_index;
-			rot_matrix_p = &rot_matrix;
-		} else {
-			rot_matrix_p = &image_matrix;
-			rot_matrix_indx = 0;
-		}
-		if (tiles != 1) {
-			long tile_x_size;
-			long tile_y_size;
-			if (rot_index == 1 || rot_index == 3) {
-				tile_y_size=(long)(rot_matrix_p->width/tiles_x);
-				tile_x_size=(long)(rot_matrix_p->height/tiles_y);
-			} else {
-				tile_x_size=(long)(rot_matrix_p->width/tiles_x);
-				tile_y_size=(long)(rot_matrix_p->height/tiles_y);
-			}
-			tile_matrix.submatrix (*rot_matrix_p,
-				tile_index_x*tile_x_size,tile_index_y*tile_y_size,
-				(tile_index_x+1)*tile_x_size-1,(tile_index_y+1)*tile_y_size-1);
-			tile_matrix_p = &tile_matrix;
-		} else {
-			tile_matrix_p = rot_matrix_p;
+		if ( (res = page_res[matrix_index]) < 1) {
+			if (n_pages > 1) catError ("Could not read page %d of image file '%s' to recalculate sigs.\n",page,filename);
+			else catError ("Could not read image file '%s' to recalculate sigs.\n",filename);
+			res = -1; // make sure its negative for cleanup below
+			break;
 		}
+
+		// The next page is read by a second thread, if there is one.
+		// Within a parallel LoadFromFilesDir, that needs nested parallelism (OMP_NESTED), otherwise the sections run one after the other.
+#pragma omp parallel sections num_threads(2) if(next_page >= 0)
+		{
+#pragma omp section
+			{
+				if (next_page >= 0) page_res[1 - matrix_index] = page_reader.read (page_matrices[1 - matrix_index], next_page,
+					preproc_opts->downsample,&(preproc_opts->bounding_rect),(double)preproc_opts->mean,(double)preproc_opts->stddev,feature_plan->reads_colors);
+			}
+#pragma omp section
+			for (sig_index = page_start; sig_index < page_end; sig_index++) {
+				ImageSignatures = our_sigs[sig_index].sig;
+				rot_index = our_sigs[sig_index].rot_index;
+				tile_index_x = our_sigs[sig_index].tile_index_x;
+				tile_index_y = our_sigs[sig_index].tile_index_y;
+				our_sigs[sig_index].saved = false; // don't unlink if true
+				our_sigs[sig_index].added = false; // don't delete if true
+				if (verbosity>=2) printf ("processing '%s' (index %d).\n",ImageSignatures->GetFileName(buffer),sig_index);
+
+				if (rot_index > 0) {
+					rot_matrix.Rotate (image_matrix, 90.0 * rot_index);
+					rot_matrix_indx = rot_index;
+					rot_matrix_p = &rot_matrix;
+				} else {
+					rot_matrix_p = &image_matrix;
+					rot_matrix_indx = 0;
+				}
+				if (tiles != 1) {
+					long tile_x_size;
+					long tile_y_size;
+					if (rot_index == 1 || rot_index == 3) {
+						tile_y_size=(long)(rot_matrix_p->width/tiles_x);
+						tile_x_size=(long)(rot_matrix_p->height/tiles_y);
+					} else {
+						tile_x_size=(long)(rot_matrix_p->width/tiles_x);
+						tile_y_size=(long)(rot_matrix_p->height/tiles_y);
+					}
+					// the tiles are views into the (rotated) image rather than copies
+					tile_matrix.submatrix_view (*rot_matrix_p,
+						tile_index_x*tile_x_size,tile_index_y*tile_y_size,
+						(tile_index_x+1)*tile_x_size-1,(tile_index_y+1)*tile_y_size-1);
+					tile_matrix_p = &tile_matrix;
+				} else {
+					tile_matrix_p = rot_matrix_p;
+				}
 // 
 // 		// Dump the sample as a tiff
 // 		{
@@ -1468,41 +1701,49 @@ int TrainingSet::AddImageFile(char *filename, unsigned short sample_class, doubl
 // 		tile_matrix_p->SaveTiff (foo_path);
 // 		}
 // 
-	// last ditch effort to avoid re-computing all sigs: see if an old-style sig file exists, and has
-	// a set of sigs that matches a small subset of re-computed sigs.
-		char old_sig_filename[IMAGE_PATH_LENGTH+SAMPLE_NAME_LENGTH+1], *char_p;
-		strcpy (old_sig_filename,ImageSignatures->full_path);
-		if ( (char_p = strrchr (old_sig_filename,'.')) ) *char_p = '\0';
-		else char_p = old_sig_filename+strlen(old_sig_filename);
-		sprintf (char_p,"_%d_%d.sig",tile_index_x,tile_index_y);
-		if( skip_sig_comparison_check || (res=ImageSignatures->CompareToFile(*tile_matrix_p,old_sig_filename,feature_opts->compute_colors,feature_opts->large_set)) ) {
-			ImageSignatures->LoadFromFile (old_sig_filename);
-			if (ImageSignatures->count < 1) {
-				catError ("Error converting old sig file '%s' to '%s'. No samples in file.\n",old_sig_filename,ImageSignatures->GetFileName(buffer));
-				res=0;
-			} else {
-				catError ("Old signature file '%s' converted to '%s' with %d features.\n",old_sig_filename,ImageSignatures->GetFileName(buffer),ImageSignatures->count);
-				strcpy(ImageSignatures->full_path,filename);
-				ImageSignatures->sample_class=sample_class;
-				ImageSignatures->sample_value=sample_value;
+			// last ditch effort to avoid re-computing all sigs: see if an old-style sig file exists, and has
+			// a set of sigs that matches a small subset of re-computed sigs.
+				char old_sig_filename[IMAGE_PATH_LENGTH+SAMPLE_NAME_LENGTH+1], *char_p;
+				strcpy (old_sig_filename,ImageSignatures->full_path);
+				if ( (char_p = strrchr (old_sig_filename,'.')) ) *char_p = '\0';
+				else char_p = old_sig_filename+strlen(old_sig_filename);
+				sprintf (char_p,"_%d_%d.sig",tile_index_x,tile_index_y);
+				if( skip_sig_comparison_check || (res=ImageSignatures->CompareToFile(*tile_matrix_p,old_sig_filename,feature_opts->compute_colors,feature_opts->large_set)) ) {
+					ImageSignatures->LoadFromFile (old_sig_filename);
+					if (ImageSignatures->count < 1) {
+						catError ("Error converting old sig file '%s' to '%s'. No samples in file.\n",old_sig_filename,ImageSignatures->GetFileName(buffer));
+						res=0;
+					} else {
+						catError ("Old signature file '%s' converted to '%s' with %d features.\n",old_sig_filename,ImageSignatures->GetFileName(buffer),ImageSignatures->count);
+						strcpy(ImageSignatures->full_path,filename);
+						ImageSignatures->sample_class=sample_class;
+						ImageSignatures->sample_value=sample_value;
 
-				unlink (old_sig_filename);
-			}
-		}
+						unlink (old_sig_filename);
+					}
+				}
 
-	// all hope is lost - compute sigs.
-		if (!res) {
-			ImageSignatures->compute_plan (*tile_matrix_p, feature_plan);
-		}
-	// we're saving sigs always now...
-	// But we're not releasing the lock yet - we'll release all the locks for the whole image later.
-	// This doesn't call close on our file, which would release the lock.
-		ImageSignatures->SaveToFile (1);
-		our_sigs[sig_index].saved = true;
-		if ( (res=AddSample(ImageSignatures)) < 0) {
-			break;
+			// all hope is lost - compute sigs.
+				if (!res) {
+					ImageSignatures->compute_plan (*tile_matrix_p, feature_plan);
+				}
+			// we're saving sigs always now...
+			// But we're not releasing the lock yet - we'll release all the locks for the whole image later.
+			// This doesn't call close on our file, which would release the lock.
+				ImageSignatures->SaveToFile (1);
+				our_sigs[sig_index].saved = true;
+				// let go of the mapped pages this tile used
+				if (tiles != 1) {
+					image_matrix.page_out();
+					rot_matrix.page_out();
+				}
+				computed_sample.sig = ImageSignatures;
+				image_samples.push_back (computed_sample);
+				res = 1;
+				our_sigs[sig_index].added = true;
+			}
 		}
-		our_sigs[sig_index].added = true;
+		matrix_index = 1 - matrix_index;
 	}
 	
 // don't release any locks until we're done with this image
@@ -1510,7 +1751,8 @@ int TrainingSet::AddImageFile(char *filename, unsigned short sample_class, doubl
 	for (sig_index = 0; sig_index < n_sigs; sig_index++) {
 		if (our_sigs[sig_index].sig) {
 			our_sigs[sig_index].sig->FileClose ();
-			our_sigs[sig_index].sig->Clear ();
+			// added sigs are cleared by AddImageSamples, after they're added
+			if (!our_sigs[sig_index].added) our_sigs[sig_index].sig->Clear ();
 			if (!our_sigs[sig_index].saved) {
 				unlink (our_sigs[sig_index].sig->GetFileName(buffer));
 			}
@@ -1524,24 +1766,58 @@ int TrainingSet::AddImageFile(char *filename, unsigned short sample_class, doubl
 }
 
 
+/* append_printf
+   printf to the end of a string, for output that is printed later
+*/
+static void append_printf (std::string &out, const char *fmt, ...) {
+	char buffer[512];
+	va_list ap;
+	va_start (ap, fmt);
+	int len = vsnprintf (buffer, sizeof (buffer), fmt, ap);
+	va_end (ap);
+	if (len < (int)sizeof (buffer)) {
+		out.append (buffer);
+	} else if (len > 0) {
+		std::vector<char> long_buffer (len + 1);
+		va_start (ap, fmt);
+		vsnprintf (&(long_buffer[0]), long_buffer.size(), fmt, ap);
+		va_end (ap);
+		out.append (&(long_buffer[0]));
+	}
+}
+
 /* Classify 
    Classify a test sample.
    TestSet -TrainingSet *- one or more tiles of one or more test image
    test_sample_index -int- the index of the image in TestSet that should be tested. if tiles, then the first tile.
    max_tile -int- just use the most similar tile instead of averaging all times
+   distances -const double *- the squared weighted distances of each tile to the samples of this set (one row of count values per tile, see WeightedDistances).
+     ignored if NULL, which is also the only valid value with tile_areas.
    returned value can be either a class index, or if is_continuous a contiouos value
 */
 
-double TrainingSet::ClassifyImage(TrainingSet *TestSet, int test_sample_index,int method, int tiles, int tile_areas, TrainingSet *TilesTrainingSets[], int max_tile, int rank, data_split *split, double *similarities)
+double TrainingSet::ClassifyImage(TrainingSet *TestSet, int test_sample_index,int method, int tiles, int tile_areas, TrainingSet *TilesTrainingSets[], int max_tile, int rank, data_split *split, double *similarities, const double *distances)
+{
+	image_prediction_t prediction;
+	PredictImage (TestSet, test_sample_index, method, tiles, tile_areas, TilesTrainingSets, max_tile, rank, split, distances, prediction);
+	return (ReportImage (TestSet, test_sample_index, tiles, split, similarities, prediction));
+}
+
+/* PredictImage
+   The first half of ClassifyImage: classify the tiles of a test image and combine their marginal probabilities.
+   It only changes the image's own cells in split->image_similarities and its own interpolated_value in TestSet,
+   so different images can be predicted concurrently.  Everything else is left to ReportImage.
+   prediction -image_prediction_t &- returned with the prediction and the per-tile output.
+*/
+void TrainingSet::PredictImage(TrainingSet *TestSet, int test_sample_index,int method, int tiles, int tile_areas, TrainingSet *TilesTrainingSets[], int max_tile, int rank, data_split *split, const double *distances, image_prediction_t &prediction)
 {  int predicted_class=0,tile_index,class_index,cand,sample_class,test_tile_index,interpolate=1;
    double probabilities[MAX_CLASS_NUM],probabilities_sum[MAX_CLASS_NUM],normalization_factor,normalization_factor_avg=0;
    signatures *closest_sample=NULL, *tile_closest_sample=NULL,*test_signature;
-   char interpolated_value[128],last_path[IMAGE_PATH_LENGTH];
+   char last_path[IMAGE_PATH_LENGTH];
    TrainingSet *ts_selector;
    int most_similar_tile=1,most_similar_predicted_class=0;
    double val=0.0,sum_prob=0.0,dist,value=0.0,most_similar_value=0.0,closest_value_dist=INF,max_tile_similarity=0.0;
-   int do_html=0;
-   char buffer[512],closest_image[512],color[128],one_image_string[MAX_CLASS_NUM*15];
+   std::string &tiles_output = prediction.tiles_output;
 
    // interpolate only if all class labels are values
 	interpolate=is_numeric;
@@ -1559,8 +1835,10 @@ double TrainingSet::ClassifyImage(TrainingSet *TestSet, int test_sample_index,in
 	}
 
 	for (tile_index=test_sample_index;tile_index<test_sample_index+tiles;tile_index++) {
+		const double *tile_distances = NULL;
+		if (distances) tile_distances = distances + (size_t)(tile_index - test_sample_index) * count;
 		if (verbosity>=2 && tiles>1)
-			printf("%s (%d/%d)\t",TestSet->samples[tile_index]->full_path,1+tile_index-test_sample_index,tiles);
+			append_printf(tiles_output, "%s (%d/%d)\t",TestSet->samples[tile_index]->full_path,1+tile_index-test_sample_index,tiles);
 		test_signature = TestSet->samples[ tile_index ]->duplicate();
 		if (tile_areas==0 || tiles==1)
 			ts_selector=this;
@@ -1581,21 +1859,21 @@ double TrainingSet::ClassifyImage(TrainingSet *TestSet, int test_sample_index,in
 
 		if( is_continuous )
 		{ //interpolate the value here 
-			val = ts_selector->InterpolateValue( test_signature, method, rank, &closest_sample, &dist );
+			val = ts_selector->InterpolateValue( test_signature, method, rank, &closest_sample, &dist, tile_distances );
 			value = value + val / ( double ) tiles;
 			if( verbosity>=2 && tiles > 1 ) {
 				if( sample_class )
-					printf( "%.3g\t%.3g\n", TestSet->samples[ test_sample_index ]->sample_value, val );
+					append_printf( tiles_output, "%.3g\t%.3g\n", TestSet->samples[ test_sample_index ]->sample_value, val );
 				else
-					printf( "N/A\t%.3g\n", val );
+					append_printf( tiles_output, "N/A\t%.3g\n", val );
 			}
 		}
 		else
 		{
 			if( method == WNN )
-				predicted_class = ts_selector->WNNclassify( test_signature, probabilities, &normalization_factor, &closest_sample );
+				predicted_class = ts_selector->WNNclassify( test_signature, probabilities, &normalization_factor, &closest_sample, tile_distances );
 			if( method == WND )
-				predicted_class = ts_selector->classify2( TestSet->samples[ test_sample_index ]->full_path, test_sample_index, test_signature, probabilities, &normalization_factor );
+				predicted_class = ts_selector->classify2( TestSet->samples[ test_sample_index ]->full_path, test_sample_index, test_signature, probabilities, &normalization_factor, tile_distances );
 			//if (method==WND) predicted_class=this->classify3(test_signature, probabilities, &normalization_factor);
 			if (predicted_class < 1) {
 				// This should not really happen...
@@ -1603,22 +1881,22 @@ double TrainingSet::ClassifyImage(TrainingSet *TestSet, int test_sample_index,in
 			}
 
 			if( verbosity>=2 && tiles>1) {
-				printf( "%.3g\t", normalization_factor );
+				append_printf( tiles_output, "%.3g\t", normalization_factor );
 				for( class_index = 1; class_index <= class_num; class_index++)
-					printf( "%.3f\t", probabilities[ class_index ] );
+					append_printf( tiles_output, "%.3f\t", probabilities[ class_index ] );
 				if( sample_class )
-					printf( "%s\t%s", class_labels[ sample_class ], class_labels[ predicted_class ] );
+					append_printf( tiles_output, "%s\t%s", class_labels[ sample_class ], class_labels[ predicted_class ] );
 				else
-					printf( "%s*\t%s", TestSet->class_labels[TestSet->samples[ test_sample_index ]->sample_class], class_labels[ predicted_class ] );
+					append_printf( tiles_output, "%s*\t%s", TestSet->class_labels[TestSet->samples[ test_sample_index ]->sample_class], class_labels[ predicted_class ] );
 
 				if (interpolate) {
 					TestSet->samples[ test_sample_index ]->interpolated_value = 0;
 					for( class_index = 1; class_index <= class_num; class_index++ )
 						TestSet->samples[ test_sample_index ]->interpolated_value += 
 							probabilities[ class_index ] * atof (TestSet->class_labels [class_index]) ;
-					printf ("\t%.3f",TestSet->samples[ test_sample_index ]->interpolated_value);
+					append_printf( tiles_output, "\t%.3f",TestSet->samples[ test_sample_index ]->interpolated_value);
 				}
-				printf( "\n" );
+				append_printf( tiles_output, "\n" );
 			}
 		}
 
@@ -1669,7 +1947,7 @@ double TrainingSet::ClassifyImage(TrainingSet *TestSet, int test_sample_index,in
 		}
 		  
 		if( ( strcmp( last_path, test_signature->full_path ) != 0 ) )
-			printf( "inconsistent tile %d of image '%s' \n", tile_index-test_sample_index, test_signature->full_path );
+			append_printf( tiles_output, "inconsistent tile %d of image '%s' \n", tile_index-test_sample_index, test_signature->full_path );
 
 		for( class_index = 1; class_index <= class_num; class_index++ )
 		{
@@ -1683,8 +1961,7 @@ double TrainingSet::ClassifyImage(TrainingSet *TestSet, int test_sample_index,in
 
 		normalization_factor_avg += normalization_factor;
 
-		if( split && split->tile_area_accuracy )
-			split->tile_area_accuracy[ tile_index - test_sample_index ] += ( ( double )( predicted_class == sample_class ) ) / ( ( double ) TestSet->count / ( double ) tiles ); 
+		prediction.tile_classes.push_back( predicted_class );
 		delete test_signature;
 	} // END iterating over all tiles
 
@@ -1719,6 +1996,38 @@ double TrainingSet::ClassifyImage(TrainingSet *TestSet, int test_sample_index,in
 		}
 	}
 
+	prediction.sample_class = sample_class;
+	prediction.predicted_class = predicted_class;
+	prediction.value = value;
+	prediction.normalization_factor_avg = normalization_factor_avg;
+	prediction.closest_sample = closest_sample;
+	prediction.probabilities_sum.assign( probabilities_sum, probabilities_sum + class_num + 1 );
+}
+
+/* ReportImage
+   The second half of ClassifyImage: add the prediction of a test image made by PredictImage to the split, and print it.
+   With more than one image, this has to be done in image order.
+   returned value can be either a class index, or if is_continuous a contiouos value
+*/
+double TrainingSet::ReportImage(TrainingSet *TestSet, int test_sample_index, int tiles, data_split *split, double *similarities, image_prediction_t &prediction)
+{  int class_index,tile_index,interpolate=is_numeric;
+   int sample_class = prediction.sample_class, predicted_class = prediction.predicted_class;
+   double value = prediction.value, normalization_factor_avg = prediction.normalization_factor_avg;
+   double *probabilities_sum = &(prediction.probabilities_sum[0]);
+   signatures *closest_sample = prediction.closest_sample;
+   char interpolated_value[128];
+   int do_html=0;
+   char buffer[512],closest_image[512],color[128],one_image_string[MAX_CLASS_NUM*15];
+
+	FILE *output = (split && split->output ? split->output : stdout);
+
+	if (tiles<=0) tiles=1;   // make sure the number of tiles is valid
+	fputs (prediction.tiles_output.c_str(), output);
+
+	if( split && split->tile_area_accuracy )
+		for( tile_index = 0; tile_index < (int)prediction.tile_classes.size(); tile_index++ )
+			split->tile_area_accuracy[ tile_index ] += ( ( double )( prediction.tile_classes[ tile_index ] == sample_class ) ) / ( ( double ) TestSet->count / ( double ) tiles ); 
+
 	// update the split confusion and similarity matrices
 	if( split && split->confusion_matrix )
 		split->confusion_matrix[ class_num * sample_class + predicted_class ]++;
@@ -1752,9 +2061,9 @@ double TrainingSet::ClassifyImage(TrainingSet *TestSet, int test_sample_index,in
 
 	// Name
 	if (verbosity>=1) {
-		printf("%s",TestSet->samples[test_sample_index]->full_path);
-		if (tiles > 1) printf(" (AVG)");
-		printf ("\t");
+		fprintf(output, "%s",TestSet->samples[test_sample_index]->full_path);
+		if (tiles > 1) fprintf(output, " (AVG)");
+		fprintf (output, "\t");
 	}
 
 	// Normalization Factor
@@ -1763,7 +2072,7 @@ double TrainingSet::ClassifyImage(TrainingSet *TestSet, int test_sample_index,in
 			sprintf( buffer,"<td>%.3g</td>", normalization_factor_avg );
 			strcat(one_image_string, buffer);
 		}
-		if (verbosity>=1) printf ("%.3g\t",normalization_factor_avg);
+		if (verbosity>=1) fprintf (output, "%.3g\t",normalization_factor_avg);
 	}
 
 	// Marginal Probabilities
@@ -1781,7 +2090,7 @@ double TrainingSet::ClassifyImage(TrainingSet *TestSet, int test_sample_index,in
 				strcat(one_image_string,buffer);
 			}
 			if( verbosity >= 1 )
-				printf ("%.3f\t",probabilities_sum[class_index]);
+				fprintf (output, "%.3f\t",probabilities_sum[class_index]);
 		}
 		if( do_html )
 		{
@@ -1831,7 +2140,7 @@ double TrainingSet::ClassifyImage(TrainingSet *TestSet, int test_sample_index,in
 			if (do_html) sprintf(buffer,"<td></td><td>%.3g</td><td>%.3f</td>",TestSet->samples[test_sample_index]->sample_value,TestSet->samples[test_sample_index]->interpolated_value);
 			// if a known class, print actual value,predicted value, percent error(abs((actual-predicted)/actual)).
 			if (verbosity>=1)
-				printf("%f\t%f\t%f\n",TestSet->samples[test_sample_index]->sample_value,
+				fprintf(output, "%f\t%f\t%f\n",TestSet->samples[test_sample_index]->sample_value,
 					TestSet->samples[test_sample_index]->interpolated_value,
 					fabs((TestSet->samples[test_sample_index]->sample_value-TestSet->samples[test_sample_index]->interpolated_value)/TestSet->samples[test_sample_index]->sample_value));
 		}
@@ -1840,7 +2149,7 @@ double TrainingSet::ClassifyImage(TrainingSet *TestSet, int test_sample_index,in
 			if (do_html) sprintf(buffer,"<td></td><td>UNKNOWN</td><td>%.3g</td>",TestSet->samples[test_sample_index]->interpolated_value);
 			// if a known class, print actual value,predicted value, percent error(abs((actual-predicted)/actual)).  Otherwise just predicted value.
 			if (verbosity>=1)
-				printf("N/A\t%f\n",TestSet->samples[test_sample_index]->interpolated_value);
+				fprintf(output, "N/A\t%f\n",TestSet->samples[test_sample_index]->interpolated_value);
 		}
 	}
 	else
@@ -1848,16 +2157,16 @@ double TrainingSet::ClassifyImage(TrainingSet *TestSet, int test_sample_index,in
 	// if a known class, print actual class,predicted class.  Otherwise just predicted value.
 		if (sample_class) { // known class
 			if (verbosity>=1) {
-				printf("%s\t%s",class_labels[sample_class],class_labels[predicted_class]);
-				if (interpolate) printf ("\t%.3f",TestSet->samples[ test_sample_index ]->interpolated_value);
-				printf("\n");
+				fprintf(output, "%s\t%s",class_labels[sample_class],class_labels[predicted_class]);
+				if (interpolate) fprintf (output, "\t%.3f",TestSet->samples[ test_sample_index ]->interpolated_value);
+				fprintf(output, "\n");
 			}
 			if (do_html) sprintf(buffer,"<td></td><td>%s</td><td>%s</td><td>%s</td>%s",class_labels[sample_class],class_labels[predicted_class],color,interpolated_value);
 		} else {
 			if (verbosity>=1) {
-				printf( "%s*\t%s", TestSet->class_labels[TestSet->samples[ test_sample_index ]->sample_class], class_labels[ predicted_class ] );
-				if (interpolate) printf ("\t%.3f",TestSet->samples[ test_sample_index ]->interpolated_value);
-				printf("\n");
+				fprintf(output, "%s*\t%s", TestSet->class_labels[TestSet->samples[ test_sample_index ]->sample_class], class_labels[ predicted_class ] );
+				if (interpolate) fprintf (output, "\t%.3f",TestSet->samples[ test_sample_index ]->interpolated_value);
+				fprintf(output, "\n");
 			}
 			if (do_html) sprintf(buffer,"<td></td><td>%s*</td><td>%s</td><td>%s</td>%s",TestSet->class_labels[TestSet->samples[ test_sample_index ]->sample_class],class_labels[predicted_class],color,interpolated_value);
 		}
@@ -1930,22 +2239,60 @@ double TrainingSet::Test(TrainingSet *TestSet, int method, int tiles, int tile_a
 	 }
 #endif
 
-	 for( test_sample_index = 0; test_sample_index < TestSet->count; test_sample_index += tiles )
-	 {
-		 if( is_continuous )
-			 value = ClassifyImage(TestSet,test_sample_index,method,tiles,tile_areas,TilesTrainingSets,max_tile,rank,split,NULL);
-		   //FIXME: do what with the value in "value"?
-		 else 
-		 {
-			 predicted_class = int( ClassifyImage( TestSet, test_sample_index, method, tiles, tile_areas, TilesTrainingSets, max_tile, rank, split, NULL ) );
-			 if( TestSet->samples[ test_sample_index ]->sample_class )
-			 {
-				 known_images++;
-				 if( predicted_class == TestSet->samples[ test_sample_index ]->sample_class )
-					 accurate_prediction++;
-			 }
-		 }
-	 }
+	// The images are classified concurrently, one block of test samples at a time.
+	// With batch distances, the distances of all the samples in a block (all their tiles) to the training samples are computed together first,
+	// otherwise the block is the whole test set.
+	// The predictions are reported in image order in the ordered section, so the output and the split are the same as when classifying one image at a time.
+	// The interpolated values of continuous sets use the WNN distances.
+	bool batch = BatchDistances() && (is_continuous || method == WND || method == WNN) && (tile_areas == 0 || tiles == 1);
+	int batch_method = ( is_continuous ? WNN : method );
+
+	// The weighted features have to be packed (and the WNN index built) before the threads use them
+	if( method == WND && !is_continuous ) {
+		PrepareWND();
+		if( tile_areas && tiles > 1 )
+			for( b = 0; b < tiles; b++ ) TilesTrainingSets[ b ]->PrepareWND();
+	}
+	if( method == WNN && !is_continuous && UseWNNIndex() && !batch ) {
+		PrepareWNN();
+		if( tile_areas && tiles > 1 )
+			for( b = 0; b < tiles; b++ ) TilesTrainingSets[ b ]->PrepareWNN();
+	}
+	// and the scaled training values of the batch distances are made once for all the blocks
+	if( batch ) PrepareBatchDistances( batch_method );
+
+	long block_samples = ( batch ? tiles * ( (BATCH_DISTANCES_BLOCK + tiles - 1) / tiles ) : TestSet->count ), block_start, block_end;
+	FeatureMatrix block_distances;
+
+	for( block_start = 0; block_start < TestSet->count; block_start += block_samples )
+	{
+		block_end = std::min( block_start + block_samples, TestSet->count );
+		if( batch ) WeightedDistances( TestSet, block_start, block_end - block_start, batch_method, block_distances );
+#pragma omp parallel for ordered schedule(dynamic,1)
+		for( test_sample_index = block_start; test_sample_index < block_end; test_sample_index += tiles )
+		{
+			image_prediction_t prediction;
+			const double *distances = ( batch ? block_distances.row( test_sample_index - block_start ).data() : NULL );
+
+			PredictImage( TestSet, test_sample_index, method, tiles, tile_areas, TilesTrainingSets, max_tile, rank, split, distances, prediction );
+#pragma omp ordered
+			{
+				if( is_continuous )
+					value = ReportImage( TestSet, test_sample_index, tiles, split, NULL, prediction );
+				  //FIXME: do what with the value in "value"?
+				else 
+				{
+					predicted_class = int( ReportImage( TestSet, test_sample_index, tiles, split, NULL, prediction ) );
+					if( TestSet->samples[ test_sample_index ]->sample_class )
+					{
+						known_images++;
+						if( predicted_class == TestSet->samples[ test_sample_index ]->sample_class )
+							accurate_prediction++;
+					}
+				}
+			}
+		}
+	}
 /*
   normalize the similarity matrix
   Method: The similarity matrix now contains the sum of marginal probabilities for each class.
@@ -2021,39 +2368,177 @@ double TrainingSet::Test(TrainingSet *TestSet, int method, int tiles, int tile_a
 
 void TrainingSet::normalize() {  
 	int sig_index, samp_index;
+	double *sample_values;
 
 	double sig_val, sig_min, sig_max;
 
+	PackSamples ();
+	wnd_features.valid = false;
+	wnn_index.valid = false;
+	batch_features.valid = false;
+
+	// Get the range of each feature across the entire training set, one sample (row) at a time
+	// these values of min and max can be used for normalizing a test vector
 	for( sig_index = 0; sig_index < signature_count; sig_index++ ) {  
-    // Get the values for this particular feature across entire training set
-    	sig_min = MAX_SIG_VAL;
-    	sig_max = MIN_SIG_VAL;
-		for( samp_index = 0; samp_index < count; samp_index++ ) {
-			sig_val = samples[ samp_index ]->data[ sig_index ];
+		SignatureMins[ sig_index ] = MAX_SIG_VAL;
+		SignatureMaxes[ sig_index ] = MIN_SIG_VAL;
+	}
+	for( samp_index = 0; samp_index < count; samp_index++ ) {
+		sample_values = feature_matrix.row( samp_index ).data();
+		for( sig_index = 0; sig_index < signature_count; sig_index++ ) {  
+			sig_val = sample_values[ sig_index ];
 			// ignore out of bounds sig values for determining minimum and maximum: They will be clipped later
 			if (std::isnan (sig_val) || sig_val > MAX_SIG_VAL || sig_val < MIN_SIG_VAL) continue;
 
-			if (sig_val > sig_max) sig_max = sig_val;
-			if (sig_val < sig_min) sig_min = sig_val;
+			if (sig_val > SignatureMaxes[ sig_index ]) SignatureMaxes[ sig_index ] = sig_val;
+			if (sig_val < SignatureMins[ sig_index ]) SignatureMins[ sig_index ] = sig_val;
 		}
+	}
 
-		/* these values of min and max can be used for normalizing a test vector */
-		SignatureMaxes[ sig_index ] = sig_max;
-		SignatureMins[ sig_index ] = sig_min;
-
-		for( samp_index = 0; samp_index < count; samp_index++ ) {
-			sig_val = samples[ samp_index ]->data[ sig_index ];
+	for( samp_index = 0; samp_index < count; samp_index++ ) {
+		sample_values = feature_matrix.row( samp_index ).data();
+		for( sig_index = 0; sig_index < signature_count; sig_index++ ) {  
+			sig_val = sample_values[ sig_index ];
+			sig_min = SignatureMins[ sig_index ];
+			sig_max = SignatureMaxes[ sig_index ];
 
 			if (std::isnan (sig_val) || sig_val < sig_min || (sig_max - sig_min) < DBL_EPSILON) sig_val = 0; 
 			else if( sig_val > sig_max )
 				sig_val = 100;
 			else
 				sig_val = 100 * ( (sig_val - sig_min) / (sig_max - sig_min) );
-			samples[ samp_index ]->data[ sig_index ] = sig_val;
+			sample_values[ sig_index ] = sig_val;
+		}
+	}
+}
+
+
+/* mutual_information
+   The mutual information (in bits) of two discrete variables, computed as by the mRMR tool from their joint probabilities.
+   states1, states2 -const int *- the state of each variable in each of n samples, from 0 to n_states1-1 and n_states2-1
+*/
+static double mutual_information (const int *states1, int n_states1, const int *states2, int n_states2, long n)
+{	int state1, state2;
+	long sample_index;
+	std::vector<double> joint ((size_t)n_states1 * n_states2, 0.0), p1 (n_states1, 0.0), p2 (n_states2, 0.0);
+	double mi = 0.0, p12;
+
+	for (sample_index = 0; sample_index < n; sample_index++)
+		joint[ (size_t)states1[ sample_index ] * n_states2 + states2[ sample_index ] ] += 1.0;
+	for (state1 = 0; state1 < n_states1; state1++)
+		for (state2 = 0; state2 < n_states2; state2++) {
+			joint[ (size_t)state1 * n_states2 + state2 ] /= n;
+			p1[ state1 ] += joint[ (size_t)state1 * n_states2 + state2 ];
+			p2[ state2 ] += joint[ (size_t)state1 * n_states2 + state2 ];
 		}
+	for (state2 = 0; state2 < n_states2; state2++)
+		for (state1 = 0; state1 < n_states1; state1++) {
+			p12 = joint[ (size_t)state1 * n_states2 + state2 ];
+			if (p12 != 0 && p1[ state1 ] != 0 && p2[ state2 ] != 0)
+				mi += p12 * log (p12 / p1[ state1 ] / p2[ state2 ]);
+		}
+	return (mi / log (2.0));
+}
+
+/* discretize_states
+   Round values to integer states that start at 0, the way the mRMR tool reads its (undiscretized) input.
+   returned value -int- the number of states
+*/
+static int discretize_states (const std::vector<double> &values, int *states)
+{	long n = values.size(), index;
+	int min_state = 0, max_state = 0;
+	for (index = 0; index < n; index++) {
+		states[ index ] = (int)nearbyint (values[ index ]);
+		if (index == 0 || states[ index ] < min_state) min_state = states[ index ];
+		if (index == 0 || states[ index ] > max_state) max_state = states[ index ];
 	}
+	for (index = 0; index < n; index++) states[ index ] -= min_state;
+	return (max_state - min_state + 1);
 }
 
+/* SetmRMRScores
+   Select the features by minimum redundancy - maximum relevance (mRMR, the MID criterion of Peng et al.) among the ones with non-zero weights.
+   The weights of the selected features are set to their mRMR scores, and all other weights are set to 0.
+   The values are normalized to [0,100], and are rounded to integer states as they were for the external mRMR tool this replaces.
+   The selection follows the tool's algorithm, but has not been compared to the tool's own output.
+   A feature's relevance is its mutual information with the sample classes, and its redundancy is its average mutual information with the features
+   selected before it.  The first feature is the most relevant one, and each next one is the one whose relevance minus its redundancy is highest
+   among the MRMR_POOL_SIZE most relevant features.  The redundancies are updated with the last selected feature only, in parallel.
+   used_signatures -double- the fraction of the features that the Fisher scores kept
+   used_mrmr -double- the fraction of those to select with mRMR
+*/
+void TrainingSet::SetmRMRScores(double used_signatures, double used_mrmr)
+{  int sig_index,sample_index;
+   long n_selected=(long)(used_mrmr*used_signatures*signature_count),pool_index,selected_index;
+   std::vector<int> candidates;   /* the features with non-zero weights */
+   std::vector<double> values(count);
+
+   for (sig_index=0;sig_index<signature_count;sig_index++)
+     if (SignatureWeights[sig_index]>0) candidates.push_back(sig_index);
+   long n_candidates=candidates.size(),candidate;
+   if (n_candidates<1 || n_selected<1 || count<1) return;
+
+   /* the states of the classes and of the candidate features, one feature after another */
+   std::vector<int> class_states(count),states((size_t)n_candidates*count),n_states(n_candidates);
+   for (sample_index=0;sample_index<count;sample_index++)
+     values[sample_index]=samples[sample_index]->sample_class;
+   int n_class_states=discretize_states(values,&(class_states[0]));
+   for (candidate=0;candidate<n_candidates;candidate++)
+   {  for (sample_index=0;sample_index<count;sample_index++)
+        values[sample_index]=samples[sample_index]->data[candidates[candidate]];
+      n_states[candidate]=discretize_states(values,&(states[(size_t)candidate*count]));
+   }
+
+   /* the relevance of each candidate, and the pool of the most relevant ones (most relevant first) */
+   std::vector<double> relevance(n_candidates);
+#pragma omp parallel for schedule(dynamic,16)
+   for (candidate=0;candidate<n_candidates;candidate++)
+     relevance[candidate]=mutual_information(&(class_states[0]),n_class_states,&(states[(size_t)candidate*count]),n_states[candidate],count);
+   std::vector< std::pair<double,long> > pool;
+   for (candidate=0;candidate<n_candidates;candidate++)
+     pool.push_back(std::make_pair(-relevance[candidate],candidate));
+   std::sort(pool.begin(),pool.end());
+   if (pool.size()>(size_t)MRMR_POOL_SIZE) pool.resize(MRMR_POOL_SIZE);
+   long pool_size=pool.size();
+   if (n_selected>pool_size) n_selected=pool_size;
+
+   /* select the features one at a time */
+   std::vector<long> selected;
+   std::vector<double> scores,redundancy(pool_size,0.0);
+   std::vector<bool> in_pool(pool_size,true);
+   selected.push_back(0);
+   scores.push_back(relevance[pool[0].second]);
+   in_pool[0]=false;
+   while ((long)selected.size()<n_selected)
+   {  long last=pool[selected.back()].second;
+#pragma omp parallel for schedule(dynamic,16)
+      for (pool_index=0;pool_index<pool_size;pool_index++)
+        if (in_pool[pool_index])
+          redundancy[pool_index]+=mutual_information(&(states[(size_t)last*count]),n_states[last],
+            &(states[(size_t)pool[pool_index].second*count]),n_states[pool[pool_index].second],count);
+      double best_score=0;
+      long best=-1;
+      for (pool_index=0;pool_index<pool_size;pool_index++)
+        if (in_pool[pool_index])
+        {  double score=relevance[pool[pool_index].second]-redundancy[pool_index]/selected.size();
+           if (best<0 || score>best_score)
+           {  best_score=score;
+              best=pool_index;
+           }
+        }
+      selected.push_back(best);
+      scores.push_back(best_score);
+      in_pool[best]=false;
+   }
+
+   /* the weights are the scores (to the 3 decimals that the tool reported them with), and features with scores that aren't positive are dropped */
+   for (sig_index=0;sig_index<signature_count;sig_index++)  /* first set all scores to zero */
+     SignatureWeights[sig_index]=0.0;
+   for (selected_index=0;selected_index<(long)selected.size();selected_index++)
+   {  double weight=floor(scores[selected_index]*1000.0+0.5)/1000.0;
+      if (weight>0) SignatureWeights[candidates[pool[selected[selected_index]].second]]=weight;
+   }
+}
 
 /* SetFisherScores
    Compute the fisher score of each signature
@@ -2061,63 +2546,10 @@ void TrainingSet::normalize() {
    sorted_feature_names -char *- a text of the names and scores of the features (NULL to ignore)
    int method - 0 for Fisher Scores. 1 for Pearson Correlation scores (with the ground truth).
 */
-
-void TrainingSet::SetmRMRScores(double used_signatures, double used_mrmr)
-{  FILE *mrmr_file;
-   char buffer[512],*p_buffer; 
-   int sig_index,sample_index;
-
-   /* use mRMR (if an executable file "mrmr" exists) */
-   if ( (mrmr_file=fopen("mrmr","r")) ) fclose(mrmr_file);
-   if (mrmr_file)  /* use mrmr */
-   {  /* first create a csv file for mrmr */
-      mrmr_file=fopen("mrmr_sigs.csv","w");
-      fprintf(mrmr_file,"class");
-	  for (sig_index=0;sig_index<signature_count;sig_index++)
-         if (SignatureWeights[sig_index]>0) fprintf(mrmr_file,",%d",sig_index);
-      fprintf(mrmr_file,"\n");
-      for (sample_index=0;sample_index<count;sample_index++)
-      {  fprintf(mrmr_file,"%d",samples[sample_index]->sample_class);
-	     for (sig_index=0;sig_index<signature_count;sig_index++)
-           if (SignatureWeights[sig_index]>0) fprintf(mrmr_file,",%.0f",samples[sample_index]->data[sig_index]);
-         fprintf(mrmr_file,"\n");
-      }
-	  fclose(mrmr_file);
-      sprintf(buffer,"./mrmr -i mrmr_sigs.csv -n %ld -s %ld -v %ld > mrmr_output",(long)(used_mrmr*used_signatures*signature_count),count,signature_count);
-      printf("%s\n",buffer);
-	  system(buffer);	  
-      remove("mrmr_sigs.csv");
-      /* now read the mRMR output file */
-	  for (sig_index=0;sig_index<signature_count;sig_index++)  /* first set all scores to zero */
-         SignatureWeights[sig_index]=0.0;	  
-      if (!(mrmr_file=fopen("mrmr_output","r"))) printf("Cannot open file 'mrmr_sigs.csv'\n");
-	  p_buffer=fgets(buffer,sizeof(buffer),mrmr_file); /* skip the first lines */
-      while (p_buffer && strstr(p_buffer,"mRMR")==NULL) p_buffer=fgets(buffer,sizeof(buffer),mrmr_file);
-      if (!p_buffer) printf("Cannot parse file 'mrmr_output'\n");	  
-	  p_buffer=fgets(buffer,sizeof(buffer),mrmr_file); /* skip the first line */	  
-	  p_buffer=fgets(buffer,sizeof(buffer),mrmr_file); /* skip the first line */	  	  
-      while(p_buffer && strlen(p_buffer)>8)
-	  {  long sig_num;
-         double weight;
-	     strtok(p_buffer," \t\n");
-         strtok(NULL," \t\n");		 
-         sig_num=atoi(strtok(NULL," \t\n"));
-        weight=atof(strtok(NULL," \t\n"));
-        if (weight<0) weight=0.0;   /* make sure the values are not negative */
-		if (weight>0) SignatureWeights[sig_num]=pow(weight,1);
-         p_buffer=fgets(buffer,sizeof(buffer),mrmr_file);	  
-	  }
-	  fclose(mrmr_file);
-      remove("mrmr_output");	 
-   }   
-}
-
 void TrainingSet::SetFisherScores(double used_signatures, double used_mrmr, data_split *split)
-{  int sample_index,sig_index,class_index;
-   double class_dev_from_mean,mean_inner_class_var;
+{  int sig_index;
    double threshold;   
-
-   Moments2 *class_stats = new Moments2 [class_num+1];
+   long n_blocks = (signature_count + FEATURE_SCORES_BLOCK - 1) / FEATURE_SCORES_BLOCK, block;
    
 // Make a featuregroup map and iterator
 	OUR_UNORDERED_MAP<std::string, featuregroup_stats_t> featuregroups;
@@ -2128,70 +2560,106 @@ void TrainingSet::SetFisherScores(double used_signatures, double used_mrmr, data
 // And an object instance of FeatureNames' FeatureInfo class, which has broken-down info about each feature type.
 	FeatureInfo const *featureinfo;
 
+	wnd_features.valid = false;
+	wnn_index.valid = false;
+	batch_features.valid = false;
 	if (split) {
 		split->feature_stats.clear();
 		split->featuregroups_stats.clear();
 	}
+
+	// The scores are computed from the rows of feature_matrix, one block of contiguous features at a time,
+	// with the blocks spread over the threads.  The samples are added to the stats of each feature in sample order,
+	// so the scores are the same as when the features are scored one at a time.
+	PackSamples ();
+	LookupFeatureInfos ();
+
+	/* the mean and stddev of the continuous values are the same for all the features */
+	double mean_ground=0,stddev_ground=0;
+	if (is_continuous)
+	{  int sample_index;
+	   for (sample_index=0;sample_index<count;sample_index++)  /* compute the mean of the continouos values */
+	     mean_ground+=(samples[sample_index]->sample_value/((double)count));
+	   for (sample_index=0;sample_index<count;sample_index++)  /* compute the stddev of the continouos values */
+	     stddev_ground+=pow(samples[sample_index]->sample_value-mean_ground,2);	  
+	   stddev_ground=sqrt(stddev_ground/count);
+	}
+
    /* use Fisher scores (for classes) or correlation scores (for correlations) */
-	for (sig_index=0;sig_index<signature_count;sig_index++) {
+#pragma omp parallel for schedule(dynamic,1)
+	for (block = 0; block < n_blocks; block++) {
+		int first_sig = block * FEATURE_SCORES_BLOCK, n_sigs = std::min ((long)FEATURE_SCORES_BLOCK, signature_count - first_sig);
+		int sample_index, feature_index, class_index;
+		const double *values;
+
 		// Fischer scores
 		if (class_num>0) {
-			Moments2 feature_stats;
-			double val;
-			// we're re-using the per-class stats class for each feature, so we have to reset them
-			for (class_index = 1; class_index <= class_num; class_index++)
-				class_stats[class_index].reset();
+			// the per-class stats of the features in the block, indexed by class_index * n_sigs + feature_index
+			std::vector<Moments2> all_stats (n_sigs), class_stats ( (class_num + 1) * n_sigs );
+			double class_dev_from_mean,mean_inner_class_var;
 			// collect per-class stats as well as feature stats.
 			for (sample_index = 0; sample_index < count; sample_index++) {
 				class_index = samples[sample_index]->sample_class;
 				if (class_index) {
-					val = samples[sample_index]->data[sig_index];
-					feature_stats.add (val);
-					class_stats[class_index].add (val);
+					values = feature_matrix.row( sample_index ).data() + first_sig;
+					Moments2 *sample_class_stats = &(class_stats[ class_index * n_sigs ]);
+					for (feature_index = 0; feature_index < n_sigs; feature_index++) {
+						all_stats[ feature_index ].add (values[ feature_index ]);
+						sample_class_stats[ feature_index ].add (values[ feature_index ]);
+					}
 				}
 			}
 			// compute fisher score
-			class_dev_from_mean=0;
-         	mean_inner_class_var=0;
-			for (class_index = 1; class_index <= class_num; class_index++) {
-				class_dev_from_mean  += pow(class_stats[class_index].mean() - feature_stats.mean(),2);
-				mean_inner_class_var += class_stats[class_index].var();
-			}
-			if (class_num > 1) {
-				class_dev_from_mean /= (class_num-1);
-				mean_inner_class_var /= class_num;
-			} else {
+			for (feature_index = 0; feature_index < n_sigs; feature_index++) {
 				class_dev_from_mean=0;
+				mean_inner_class_var=0;
+				for (class_index = 1; class_index <= class_num; class_index++) {
+					class_dev_from_mean  += pow(class_stats[ class_index * n_sigs + feature_index ].mean() - all_stats[ feature_index ].mean(),2);
+					mean_inner_class_var += class_stats[ class_index * n_sigs + feature_index ].var();
+				}
+				if (class_num > 1) {
+					class_dev_from_mean /= (class_num-1);
+					mean_inner_class_var /= class_num;
+				} else {
+					class_dev_from_mean=0;
+				}
+				// avoid division by zero for tiny mean_inner_class_var
+				if (mean_inner_class_var < 0.000001) mean_inner_class_var = 0.000001;
+
+				SignatureWeights[ first_sig + feature_index ]=class_dev_from_mean/mean_inner_class_var;
 			}
-			// avoid division by zero for tiny mean_inner_class_var
-			if (mean_inner_class_var < 0.000001) mean_inner_class_var = 0.000001;
-
-			SignatureWeights[sig_index]=class_dev_from_mean/mean_inner_class_var;
-
-      }  /* end of method 0 (Fisher Scores) */
-
-      /* Pearson Correlation scores */
-      if (is_continuous)
-      {  double mean_ground=0,stddev_ground=0,mean=0,stddev=0,z_score_sum=0;
-         for (sample_index=0;sample_index<count;sample_index++)  /* compute the mean of the continouos values */
-           mean_ground+=(samples[sample_index]->sample_value/((double)count));
-         for (sample_index=0;sample_index<count;sample_index++)  /* compute the stddev of the continouos values */
-           stddev_ground+=pow(samples[sample_index]->sample_value-mean_ground,2);	  
-         stddev_ground=sqrt(stddev_ground/count);
-         for (sample_index=0;sample_index<count;sample_index++)
-           mean+=(samples[sample_index]->data[sig_index]/((double)count));
-         for (sample_index=0;sample_index<count;sample_index++)  /* compute the stddev of the continouos values */
-           stddev+=pow(samples[sample_index]->data[sig_index]-mean,2);	  
-         stddev=sqrt(stddev/count);	
-         for (sample_index=0;sample_index<count;sample_index++)
-           if (stddev>0 && stddev_ground>0) z_score_sum+=((samples[sample_index]->sample_value-mean_ground)/stddev_ground)*((samples[sample_index]->data[sig_index]-mean)/stddev);
-         SignatureWeights[sig_index]=pow(fabs(z_score_sum/count),1);
-//printf("%d Fisher Score: %f\n",class_num,SignatureWeights[sig_index]);		 
-	  } /* end of method 1 (Pearson Correlation) */
-	  
+		}  /* end of method 0 (Fisher Scores) */
+
+		/* Pearson Correlation scores */
+		if (is_continuous)
+		{  std::vector<double> mean (n_sigs, 0.0), stddev (n_sigs, 0.0), z_score_sum (n_sigs, 0.0);
+		   for (sample_index=0;sample_index<count;sample_index++)
+		   {  values = feature_matrix.row( sample_index ).data() + first_sig;
+		      for (feature_index=0;feature_index<n_sigs;feature_index++)
+		        mean[feature_index]+=(values[feature_index]/((double)count));
+		   }
+		   for (sample_index=0;sample_index<count;sample_index++)  /* compute the stddev of the continouos values */
+		   {  values = feature_matrix.row( sample_index ).data() + first_sig;
+		      for (feature_index=0;feature_index<n_sigs;feature_index++)
+		        stddev[feature_index]+=pow(values[feature_index]-mean[feature_index],2);
+		   }
+		   for (feature_index=0;feature_index<n_sigs;feature_index++)
+		     stddev[feature_index]=sqrt(stddev[feature_index]/count);
+		   for (sample_index=0;sample_index<count;sample_index++)
+		   {  values = feature_matrix.row( sample_index ).data() + first_sig;
+		      for (feature_index=0;feature_index<n_sigs;feature_index++)
+		        if (stddev[feature_index]>0 && stddev_ground>0)
+		          z_score_sum[feature_index]+=((samples[sample_index]->sample_value-mean_ground)/stddev_ground)*((values[feature_index]-mean[feature_index])/stddev[feature_index]);
+		   }
+		   for (feature_index=0;feature_index<n_sigs;feature_index++)
+		     SignatureWeights[first_sig+feature_index]=pow(fabs(z_score_sum[feature_index]/count),1);
+		} /* end of method 1 (Pearson Correlation) */
+	}
+
+	for (sig_index=0;sig_index<signature_count;sig_index++) {
 	// add the sums of the scores of each group of features */
 	// Get feature information from the name and store the feature and group name in our maps
-		featureinfo = FeatureNames::getFeatureInfoByName ( SignatureNames[ sig_index ] );
+		featureinfo = feature_infos[ sig_index ];
 	// find it in our map by name
 		fg_it = featuregroups.find(featureinfo->group->name);
 	// if its a new feature group, initialize a stats structure, and add it to our map
@@ -2250,9 +2718,7 @@ void TrainingSet::SetFisherScores(double used_signatures, double used_mrmr, data
 	for (sig_index=0;sig_index<signature_count;sig_index++)
 		if (SignatureWeights[sig_index]<threshold) SignatureWeights[sig_index]=0.0;
 
-	if (used_mrmr>0) SetmRMRScores(used_signatures,used_mrmr);  /* filter the most informative features using mrmr */
-
-   delete [] class_stats;
+	if (used_mrmr>0) SetmRMRScores(used_signatures,used_mrmr);  /* filter the most informative features using mRMR */
 }
 
 
@@ -2275,6 +2741,9 @@ int TrainingSet::IgnoreFeatureGroup(long index,char *group_name)
 	  strcpy(last_name,current_name);
 	  if (group==index) 
 	  {  SignatureWeights[sig_index]=0;
+         wnd_features.valid = false;
+         wnn_index.valid = false;
+         batch_features.valid = false;
          if (group_name) strcpy(group_name,SignatureNames[sig_index]);   /* return the name of the group */	  
          for (char_index=0;char_index<strlen(group_name);char_index++) if (isdigit(group_name[char_index])) group_name[char_index]=' ';          
       }
@@ -2294,17 +2763,230 @@ double TrainingSet::distance(signatures *sample1, signatures *sample2, double po
     return(pow(dist,1/power));
 }
 
+/* PrepareBatchDistances
+   Scale the training samples' values of the weighted features for WeightedDistances, and compute their squared norms.
+   The features are scaled by the square root of their weights (WNN - the square of distance()) or by the weights (WND - the weighting of classify2).
+   Only the features with non-zero scales are kept (the same ones as PrepareWNN and PrepareWND), since the others add nothing to the distances.
+   This is done once for each method and set of weights: it does nothing if they haven't changed since the last call.
+*/
+void TrainingSet::PrepareBatchDistances(int method) {
+	int sig_index, feature_index;
+	long sample_index;
+
+	if (batch_features.valid && batch_features.method == method) return;
+
+	batch_features.method = method;
+	batch_features.features.clear();
+	for (sig_index = 0; sig_index < signature_count; sig_index++) {
+		if (method == WND ? SignatureWeights[ sig_index ] >= DBL_EPSILON : SignatureWeights[ sig_index ] > 0.0)
+			batch_features.features.push_back (sig_index);
+	}
+
+	int n_features = batch_features.features.size();
+	batch_features.scales.resize (n_features);
+	for (feature_index = 0; feature_index < n_features; feature_index++) {
+		double weight = SignatureWeights[ batch_features.features[ feature_index ] ];
+		batch_features.scales[ feature_index ] = (method == WND ? weight : sqrt( weight ));
+	}
+
+	batch_features.values.resize (count, n_features);
+	for (sample_index = 0; sample_index < count; sample_index++) {
+		const double *sample_values = samples[ sample_index ]->data;
+		double *scaled_values = batch_features.values.row( sample_index ).data();
+		for (feature_index = 0; feature_index < n_features; feature_index++)
+			scaled_values[ feature_index ] = sample_values[ batch_features.features[ feature_index ] ] * batch_features.scales[ feature_index ];
+	}
+	batch_features.norms = batch_features.values.rowwise().squaredNorm();
+	batch_features.valid = true;
+}
+
+/* WeightedDistances
+   Compute the squared weighted distances of a block of test samples to all the samples of this set at once.
+   The features are scaled as prepared by PrepareBatchDistances so that the distances are plain Euclidean,
+   and the cross terms of ||a||^2 + ||b||^2 - 2ab are all computed by one matrix product over the weighted features.
+   The results differ from the ones computed one pair of samples at a time by rounding: distances that are within rounding of 0 are set to 0,
+   and the WND differences smaller than DBL_EPSILON, which classify2 ignores, are included.
+   TestSet -TrainingSet *- the test samples, which are normalized to this set (the samples themselves are not changed)
+   first_sample, n_samples -long- the block of TestSet samples
+   method -int- WNN or WND
+   distances -FeatureMatrix &- returned with n_samples rows of count distances
+*/
+void TrainingSet::WeightedDistances(TrainingSet *TestSet, long first_sample, long n_samples, int method, FeatureMatrix &distances) {
+	long sample_index;
+	int feature_index;
+
+	PrepareBatchDistances (method);
+	int n_features = batch_features.features.size();
+	FeatureMatrix test_values( n_samples, n_features );
+
+	for (sample_index = 0; sample_index < n_samples; sample_index++) {
+		signatures *test_signature = TestSet->samples[ first_sample + sample_index ]->duplicate();
+		test_signature->normalize( this );
+		double *scaled_values = test_values.row( sample_index ).data();
+		for (feature_index = 0; feature_index < n_features; feature_index++)
+			scaled_values[ feature_index ] = test_signature->data[ batch_features.features[ feature_index ] ] * batch_features.scales[ feature_index ];
+		delete test_signature;
+	}
+
+	const Eigen::VectorXd &train_norms = batch_features.norms;
+	Eigen::VectorXd test_norms = test_values.rowwise().squaredNorm();
+	distances.noalias() = -2.0 * test_values * batch_features.values.transpose();
+	distances.colwise() += test_norms;
+	distances.rowwise() += train_norms.transpose();
+
+	// identical samples must come out as 0 to be recognized by the classifiers
+	double *dists;
+	long train_index;
+	for (sample_index = 0; sample_index < n_samples; sample_index++) {
+		dists = distances.row( sample_index ).data();
+		for (train_index = 0; train_index < count; train_index++)
+			if (dists[ train_index ] < 64.0 * DBL_EPSILON * (test_norms[ sample_index ] + train_norms[ train_index ])) dists[ train_index ] = 0.0;
+	}
+}
+
+// The tolerance of the distances computed with a wnn_index_t, relative to the ones computed by distance()
+#define WNN_INDEX_TOLERANCE 1e-9
+
+/* The weighted Euclidean distance of two samples' values in a wnn_index_t.
+   This may differ from distance() by rounding, because distance() raises to the power with pow().
+*/
+static double wnn_index_distance (const wnn_index_t &index, const double *values1, const double *values2) {
+	double dist = 0;
+	int n_features = index.features.size();
+	for (int feature_index = 0; feature_index < n_features; feature_index++)
+		dist = dist + index.feature_weights[ feature_index ] * pow( values1[ feature_index ] - values2[ feature_index ], 2 );
+	return (sqrt (dist));
+}
+
+/* build_vp_tree
+   Build the vantage-point tree of the samples in items [first, last) of a wnn_index_t.
+   The first sample is the vantage point, and the rest are split at the median of their distances to it.
+   items -vector of (distance, sample index)- the samples. They are reordered, and their distances are overwritten.
+   returned value -long- the root node of the tree (-1 if there are no samples)
+*/
+static long build_vp_tree (wnn_index_t &index, std::vector< std::pair<double, long> > &items, long first, long last) {
+	if (first >= last) return (-1);
+
+	long node_index = index.nodes.size(), median, item_index;
+	vp_node_t node;
+	node.sample = items[ first ].second;
+	node.radius = 0;
+	node.inside = node.outside = -1;
+	index.nodes.push_back (node);
+	if (last - first == 1) return (node_index);
+
+	const double *vp_values = index.values.row( node.sample ).data();
+	for (item_index = first + 1; item_index < last; item_index++)
+		items[ item_index ].first = wnn_index_distance (index, vp_values, index.values.row( items[ item_index ].second ).data());
+	// the samples before the median are within the radius, the ones from the median on are at the radius or beyond
+	median = first + 1 + (last - first - 1) / 2;
+	std::nth_element (items.begin() + first + 1, items.begin() + median, items.begin() + last);
+	index.nodes[ node_index ].radius = items[ median ].first;
+	// N.B.: the nodes may be reallocated by the recursion, so they are only referred to by index
+	long inside = build_vp_tree (index, items, first + 1, median);
+	index.nodes[ node_index ].inside = inside;
+	long outside = build_vp_tree (index, items, median, last);
+	index.nodes[ node_index ].outside = outside;
+	return (node_index);
+}
+
+// The state of a search for the nearest samples in a tree of a wnn_index_t
+typedef struct {
+	const wnn_index_t *index;
+	signatures **samples;           // the samples of the TrainingSet
+	const double *query;            // the test sample's values of the index features
+	const char *query_path;         // and its full_path
+	double nearest_dist;            // the distance of the nearest sample found so far (INF if none)
+	std::vector< std::pair<double, long> > candidates;  // (distance, sample) of the samples found within tolerance of the nearest one
+} vp_search_t;
+
+/* search_vp_tree
+   Search a tree of a wnn_index_t for the samples nearest to the query, adding them to the search's candidates.
+   Samples at a distance of 0 and samples with the query's full_path are skipped, as in WNNclassify.
+   The samples that are within tolerance of the nearest one are all candidates, so that WNNclassify can pick the nearest one with distance().
+   A subtree is skipped when the triangle inequality puts all of its samples beyond that tolerance.
+*/
+static void search_vp_tree (vp_search_t &search, long node_index) {
+	if (node_index < 0) return;
+
+	const vp_node_t &node = search.index->nodes[ node_index ];
+	double dist = wnn_index_distance (*search.index, search.query, search.index->values.row( node.sample ).data());
+	if (!(dist < 1/INF) && dist <= search.nearest_dist * (1 + WNN_INDEX_TOLERANCE) &&
+		strcmp (search.samples[ node.sample ]->full_path, search.query_path) != 0) {
+			search.candidates.push_back (std::make_pair (dist, node.sample));
+			if (dist < search.nearest_dist) search.nearest_dist = dist;
+	}
+
+	double bound = search.nearest_dist * (1 + WNN_INDEX_TOLERANCE) + WNN_INDEX_TOLERANCE * (dist + node.radius);
+	if (dist < node.radius) {
+		search_vp_tree (search, node.inside);
+		if (node.radius - dist <= bound) search_vp_tree (search, node.outside);
+	} else {
+		search_vp_tree (search, node.outside);
+		if (dist - node.radius <= bound) search_vp_tree (search, node.inside);
+	}
+}
+
+/* PrepareWNN
+   Build the nearest neighbour index for WNNclassify: the training samples' values of the features with positive weights are packed along with the weights,
+   and the samples of each class are indexed by a vantage-point tree, in which the nearest sample is found exactly, comparing to only part of the samples.
+   Features with zero weights add nothing to the distances, so leaving them out doesn't change them.
+   Negative weights don't make a metric, so the index isn't usable with them.
+   This is done once for each set of weights and sample classes: it does nothing until wnn_index.valid is cleared by a change of the samples,
+   their classes or the weights.  Note that it must be called before WNNclassify is called from more than one thread.
+*/
+void TrainingSet::PrepareWNN() {
+	int sig_index, feature_index, sample_index, class_index;
+
+	if (wnn_index.valid) return;
+
+	wnn_index.usable = true;
+	wnn_index.features.clear();
+	for (sig_index = 0; sig_index < signature_count; sig_index++) {
+		if (SignatureWeights[ sig_index ] < 0) wnn_index.usable = false;
+		else if (SignatureWeights[ sig_index ] > 0) wnn_index.features.push_back (sig_index);
+	}
+
+	int n_features = wnn_index.features.size();
+	wnn_index.feature_weights.resize (n_features);
+	for (feature_index = 0; feature_index < n_features; feature_index++)
+		wnn_index.feature_weights[ feature_index ] = SignatureWeights[ wnn_index.features[ feature_index ] ];
+
+	wnn_index.values.resize (count, n_features);
+	for (sample_index = 0; sample_index < count; sample_index++) {
+		const double *sample_values = samples[ sample_index ]->data;
+		double *packed_values = wnn_index.values.row( sample_index ).data();
+		for (feature_index = 0; feature_index < n_features; feature_index++)
+			packed_values[ feature_index ] = sample_values[ wnn_index.features[ feature_index ] ];
+	}
+
+	wnn_index.nodes.clear();
+	wnn_index.roots.assign (class_num + 1, -1);
+	wnn_index.valid = true;
+	if (!wnn_index.usable) return;
+	wnn_index.nodes.reserve (count);
+	std::vector< std::pair<double, long> > items;
+	for (class_index = 0; class_index <= class_num; class_index++) {
+		items.clear();
+		for (sample_index = 0; sample_index < count; sample_index++)
+			if (samples[ sample_index ]->sample_class == class_index) items.push_back (std::make_pair (0.0, (long)sample_index));
+		wnn_index.roots[ class_index ] = build_vp_tree (wnn_index, items, 0, items.size());
+	}
+}
+
 /* WNNclassify
    classify a given sample using weighted nearest neioghbor
    test_sample -signature *- a given sample to classify
    probabilities -array of double- an array (size num_classes) marginal probabilities of the given sample from each class. (ignored if NULL).
    normalization_factor -double *- the normalization factor used to compute the marginal probabilities from the distances normalization_factor=1/(sum_dist*marginal_prob). ignored if NULL.
    closest_sample -signatures **- a pointer to the closest sample found. (ignored if NULL).
+   distances -const double *- the squared distances of the test sample to the samples of this set, computed by WeightedDistances. computed here if NULL.
    returned value -long- the predicted class of the sample
 
    comment: must set weights before calling to this function
+   With UseWNNIndex(), the distances are not all computed: the nearest samples are found with the index built by PrepareWNN, with the same results.
 */
-long TrainingSet::WNNclassify(signatures *test_sample, double *probabilities, double *normalization_factor,signatures **closest_sample)
+long TrainingSet::WNNclassify(signatures *test_sample, double *probabilities, double *normalization_factor,signatures **closest_sample, const double *distances)
 {  int class_index,sample_index;
    long most_probable_class=0;
    double closest_dist=INF;
@@ -2316,8 +2998,50 @@ long TrainingSet::WNNclassify(signatures *test_sample, double *probabilities, do
 
    /* normalize the test sample */
    test_sample->normalize(this);
-   for (sample_index=0;sample_index<count;sample_index++)
-   {  double dist=distance(test_sample,samples[sample_index],2.0);
+
+   /* with the index, the nearest samples of each class are searched for in its tree */
+   if (!distances && UseWNNIndex() && !wnn_index.valid) PrepareWNN();
+   if (!distances && UseWNNIndex() && wnn_index.usable)
+   {  int n_features=wnn_index.features.size();
+      long closest_index=-1;
+      Eigen::ArrayXd test_values(n_features);
+      for (int feature_index=0;feature_index<n_features;feature_index++)
+        test_values[feature_index]=test_sample->data[wnn_index.features[feature_index]];
+      vp_search_t search;
+      search.index=&wnn_index;
+      search.samples=samples;
+      search.query=test_values.data();
+      search.query_path=test_sample->full_path;
+      for (class_index=0;class_index<=class_num;class_index++)
+      {  double class_dist=INF;
+         long class_nearest=-1;
+         search.nearest_dist=INF;
+         search.candidates.clear();
+         search_vp_tree(search,wnn_index.roots[class_index]);
+         /* the distances of the candidates are computed the same way as when comparing to every sample, and ties go to the first sample */
+         for (size_t candidate=0;candidate<search.candidates.size();candidate++)
+         {  if (search.candidates[candidate].first>search.nearest_dist*(1+WNN_INDEX_TOLERANCE)) continue;
+            sample_index=search.candidates[candidate].second;
+            double dist=distance(test_sample,samples[sample_index],2.0);
+            if (dist<1/INF) continue;
+            if (dist<class_dist || (dist==class_dist && sample_index<class_nearest))
+            {  class_dist=dist;
+               class_nearest=sample_index;
+            }
+         }
+         if (class_nearest>=0 && (class_dist<closest_dist || (class_dist==closest_dist && class_nearest<closest_index)))
+         {  closest_dist=class_dist;
+            closest_index=class_nearest;
+         }
+         if (probabilities) probabilities[class_index]=class_dist;
+      }
+      if (closest_index>=0)
+      {  most_probable_class=samples[closest_index]->sample_class;
+         if (closest_sample) *closest_sample=samples[closest_index];
+      }
+   }
+   else for (sample_index=0;sample_index<count;sample_index++)
+   {  double dist=(distances ? sqrt(distances[sample_index]) : distance(test_sample,samples[sample_index],2.0));
       if ((dist<1/INF) || (strcmp(samples[sample_index]->full_path,test_sample->full_path)==0)) dist=INF;    /* ignore images that are 100% identical */
 //if (strstr(samples[sample_index]->full_path,"1948")==NULL) dist=INF;	  
       if (dist<closest_dist)
@@ -2349,16 +3073,49 @@ long TrainingSet::WNNclassify(signatures *test_sample, double *probabilities, do
 }
 
 
+/* PrepareWND
+   Pack the training samples' values of the features with non-zero weights for classify2, along with the squared weights.
+   This is done once for each set of weights: it does nothing if the weights haven't changed since the last call.
+   Note that it must be called before classify2 is called from more than one thread.
+*/
+void TrainingSet::PrepareWND() {
+	int sig_index, feature_index, sample_index;
+
+	if (wnd_features.valid && wnd_features.weights.size() == (size_t)signature_count &&
+		wnd_features.values.rows() == count &&
+		std::equal (wnd_features.weights.begin(), wnd_features.weights.end(), SignatureWeights)) return;
+
+	wnd_features.weights.assign (SignatureWeights, SignatureWeights + signature_count);
+	wnd_features.features.clear();
+	for (sig_index = 0; sig_index < signature_count; sig_index++)
+		if (SignatureWeights[ sig_index ] >= DBL_EPSILON) wnd_features.features.push_back (sig_index);
+
+	int n_features = wnd_features.features.size();
+	wnd_features.weights2.resize (n_features);
+	for (feature_index = 0; feature_index < n_features; feature_index++)
+		wnd_features.weights2[ feature_index ] = pow( SignatureWeights[ wnd_features.features[ feature_index ] ], 2 );
+
+	wnd_features.values.resize (count, n_features);
+	for (sample_index = 0; sample_index < count; sample_index++) {
+		const double *sample_values = samples[ sample_index ]->data;
+		double *packed_values = wnd_features.values.row( sample_index ).data();
+		for (feature_index = 0; feature_index < n_features; feature_index++)
+			packed_values[ feature_index ] = sample_values[ wnd_features.features[ feature_index ] ];
+	}
+	wnd_features.valid = true;
+}
+
 /* classify2
    classify a given sample
    test_sample -signature *- a given sample to classify
    probabilities -array of double- an array (size num_classes) marginal probabilities of the given sample from each class. (ignored if NULL).
    normalization_factor -double *- the normalization factor used to compute the marginal probabilities from the distances normalization_factor=1/(dist*marginal_prob). Ignored if NULL.   
+   distances -const double *- the squared weighted distances of the test sample to the samples of this set, computed by WeightedDistances. computed here if NULL.
    returned value -long- the predicted class of the sample
 
    comment: must set weights before calling to this function
 */
-long TrainingSet::classify2( char* name, int test_sample_index, signatures *test_sample, double *probabilities, double *normalization_factor)
+long TrainingSet::classify2( char* name, int test_sample_index, signatures *test_sample, double *probabilities, double *normalization_factor, const double *distances)
 { 
 	using namespace std;
 	vector<int> num_samples_per_class( class_num + 1, 0 ); 
@@ -2373,39 +3130,35 @@ long TrainingSet::classify2( char* name, int test_sample_index, signatures *test
   test_sample->normalize(this);
 
   int sample_index;
-  int sig_index;
-  double dist;
+  int feature_index;
 	double dist_sum;
   double similarity;
 
+	// Only the features with non-zero weights are used.  The test sample's values of them are gathered the same way as the training samples'.
+	int n_features = 0;
+	if( !distances ) {
+		PrepareWND();
+		n_features = wnd_features.features.size();
+	}
+	Eigen::ArrayXd test_values( n_features ), terms( n_features );
+	for( feature_index = 0; feature_index < n_features; feature_index++ )
+		test_values[ feature_index ] = test_sample->data[ wnd_features.features[ feature_index ] ];
+
 	// iterate over all images in training set
   for( sample_index = 0; sample_index < count; sample_index++ )
 	{
-    dist_sum = 0.0;
-		// iterate over all features
-    for( sig_index = 0; sig_index < signature_count; sig_index++ )
-		{
-			// if the feature weight for this feature == 0, skip to next feature
-			if (SignatureWeights[ sig_index ] < DBL_EPSILON) continue;
-			dist = fabs( test_sample->data[ sig_index ] - samples[ sample_index ]->data[ sig_index ] );
-			if( dist < DBL_EPSILON )
-			//if( FLOAT_EQ( test_sample->data[ sig_index ], samples[ sample_index ]->data[ sig_index ], 100000000 ) )
-			{
-				
-			  //if( !( FLOAT_EQ( test_sample->data[ sig_index ], 0.0, 1) && FLOAT_EQ( samples[ sample_index ]->data[ sig_index ], 0, 1) ) )
-				/*	cout << "--- Test img " << test_sample_index << ": Train img " << sample_index << " sig_index " 
-						   << sig_index << " dist " << dist << "\t test sig val " <<  test_sample->data[ sig_index ]
-							 << "\t train sig val " << samples[ sample_index ]->data[ sig_index ] << endl;
-				*/
-				continue;
-			}
-			else
-			{
-				/*	cout << "### Test img " << test_sample_index << ": Train img " << sample_index << " sig_index " 
-						   << sig_index << " dist " << dist << "\t test sig val " <<  test_sample->data[ sig_index ]
-							 << "\t train sig val " << samples[ sample_index ]->data[ sig_index ] << endl; */
-				dist_sum += pow( SignatureWeights[ sig_index ], 2 ) * pow( dist, 2 );
-			}
+		if( distances ) {
+			dist_sum = distances[ sample_index ];
+		} else {
+			// The weighted squared differences of all the features are computed together (vectorized).
+			// Differences smaller than DBL_EPSILON are ignored.
+			Eigen::Map<const Eigen::ArrayXd> train_values( wnd_features.values.row( sample_index ).data(), n_features );
+			terms = test_values - train_values;
+			terms = ( terms.abs() < DBL_EPSILON ).select( 0.0, wnd_features.weights2 * terms.square() );
+			// They're summed in feature order, so the distances are the same as when the features were summed one at a time
+			dist_sum = 0.0;
+			for( feature_index = 0; feature_index < n_features; feature_index++ )
+				dist_sum += terms[ feature_index ];
 		}
 
     if( dist_sum < DBL_EPSILON ) {
@@ -2523,49 +3276,48 @@ long TrainingSet::classify2( char* name, int test_sample_index, signatures *test
    method -int- 0 for nearest neighbors, 1 for two closest samples
    N -int- number of neighbors to use
    closest_dist -double *- if not NULL holds the distance to the closest sample
+   distances -const double *- the squared distances of the test sample to the samples of this set, computed by WeightedDistances. computed here if NULL.
 */
-double TrainingSet::InterpolateValue(signatures *test_sample, int method, int N, signatures **closest_sample, double *closest_dist)
+double TrainingSet::InterpolateValue(signatures *test_sample, int method, int N, signatures **closest_sample, double *closest_dist, const double *distances)
 {  int sample_index,close_index;
-   double *min_dists,*min_dists_values,val=0.0,sum=0.0;
+   double val=0.0,sum=0.0;
 // double min_dist_up=INF,min_dist_down=-INF,min_val_up,min_val_down;
 
    /* normalize the test sample */
    test_sample->normalize(this);
       
 //   if (method==0)
-   {  min_dists=new double[N];
-      min_dists_values=new double[N];
-      for (close_index=0;close_index<N;close_index++)
-        min_dists[close_index]=INF;
-
-      /* find the closest samples */
+   {  /* find the closest samples.
+         The N closest (distance, sample index) pairs are kept in a max-heap, so the farthest of them is the one to replace.
+         Of samples at the same distance, the first ones are kept */
+      std::vector< std::pair<double,long> > closest;
+      closest.reserve(N);
       for (sample_index=0;sample_index<count;sample_index++)
-      {  double dist=distance(test_sample,samples[sample_index],2.0);
-//printf("dist: %f   %f\n",dist,samples[sample_index]->sample_value);	  
-         if (closest_sample && dist<min_dists[0]) *closest_sample=samples[sample_index];  /* for returning the closest sample */	  
-         if (closest_dist && dist<min_dists[0]) *closest_dist=dist;                       /* for returning the distanmce to the closest sample */	  		 
-         for (close_index=0;close_index<N;close_index++)
-         if (dist<min_dists[close_index])
-         {  memmove(&(min_dists[close_index+1]),&(min_dists[close_index]),sizeof(double)*(N-1-close_index));
-            memmove(&(min_dists_values[close_index+1]),&(min_dists_values[close_index]),sizeof(long)*(N-1-close_index));
-            min_dists[close_index]=dist;
-            min_dists_values[close_index]=samples[sample_index]->sample_value;
-//printf("%d %f %f %f %f\n",N,min_dists_values[0],min_dists[0],min_dists_values[1],min_dists[1]);				
-            break;
+      {  double dist=(distances ? sqrt(distances[sample_index]) : distance(test_sample,samples[sample_index],2.0));
+         if (!(dist<INF) || N<1) continue;
+         std::pair<double,long> neighbor(dist,sample_index);
+         if ((int)closest.size()<N)
+         {  closest.push_back(neighbor);
+            std::push_heap(closest.begin(),closest.end());
+         }
+         else if (neighbor<closest.front())
+         {  std::pop_heap(closest.begin(),closest.end());
+            closest.back()=neighbor;
+            std::push_heap(closest.begin(),closest.end());
          }
       }
+      std::sort_heap(closest.begin(),closest.end());   /* nearest first */
+
+      if (!closest.empty())
+      {  if (closest_sample) *closest_sample=samples[closest[0].second];  /* for returning the closest sample */
+         if (closest_dist) *closest_dist=closest[0].first;                 /* for returning the distanmce to the closest sample */
+      }
 
       /* compute the weighted average value */
-      for (close_index=0;close_index<N;close_index++)   
-        if (min_dists[close_index]<INF)
-        {  val+=min_dists_values[close_index]*(1/min_dists[close_index]);
-           sum+=(1/min_dists[close_index]);
-//printf("%d %f %f\n",close_index,min_dists_values[close_index],min_dists[close_index]);		   
-        }
-//printf("%d %f %f %f %f\n",N,min_dists_values[0],min_dists[0],min_dists_values[1],min_dists[1]);		
-      delete [] min_dists;
-      delete [] min_dists_values;
-//printf("%f %f %f\n",val,sum,val/sum);	  		
+      for (close_index=0;close_index<(int)closest.size();close_index++)
+      {  val+=samples[closest[close_index].second]->sample_value*(1/closest[close_index].first);
+         sum+=(1/closest[close_index].first);
+      }
       return(val/sum);
    }
 //   if (method==1)
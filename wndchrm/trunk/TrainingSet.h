@@ -46,6 +46,13 @@
 #define WNN 0
 #define WND 1
 
+// the number of test samples whose distances are computed together with batch distances (see TrainingSet::WeightedDistances)
+#define BATCH_DISTANCES_BLOCK 256
+// the number of features scored together by each thread in TrainingSet::SetFisherScores
+#define FEATURE_SCORES_BLOCK 64
+// the number of most relevant features that TrainingSet::SetmRMRScores selects from (as in the mRMR tool)
+#define MRMR_POOL_SIZE 500
+
 // N.B.: There is almost certainly code to fix if this is other than 1
 #define CONTINUOUS_CLASS_LABEL ""
 #define CONTINUOUS_CLASS_INDEX 1
@@ -81,6 +88,7 @@ typedef struct {
 	char tile_base[16]; // CLI option+params
 	int tiles_x;
 	int tiles_y;
+	char page_base[16]; // sample name prefix for the pages of multi-page TIFFs
 } sampling_opts_t;
 
 typedef struct {
@@ -139,6 +147,7 @@ typedef struct sort_by_weight_t {
 
 typedef struct {
 	signatures *sig;
+	int page;
 	int rot_index;
 	int tile_index_x;
 	int tile_index_y;
@@ -146,8 +155,67 @@ typedef struct {
 	bool added;
 } feature_vec_info_t;
 
+// A sample gathered by TrainingSet::ComputeImageSamples, to be added to the training set by AddImageSamples
+typedef struct {
+	signatures *sig;
+	bool clear;    // clear the sig's values once it is added (they were computed and saved in its .sig file)
+} image_sample_t;
+
 typedef std::vector<feature_stats_t> features_t;
 
+// The sample values of a TrainingSet, one row per sample (see TrainingSet::PackSamples)
+typedef Eigen::Matrix<double, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor> FeatureMatrix;
+
+// The features used by WND (the ones with non-zero weights), and the training samples' values of them packed together (see TrainingSet::PrepareWND)
+typedef struct {
+	std::vector<double> weights;    // the SignatureWeights the features were selected with
+	std::vector<int> features;      // indexes of the features with non-zero weights, in order
+	Eigen::ArrayXd weights2;        // their squared weights
+	FeatureMatrix values;           // one row per training sample, one column per selected feature
+	bool valid;                     // set by PrepareWND, cleared when the samples or the weights change
+} wnd_features_t;
+
+// The training samples' values of the weighted features, scaled for the batch distances of one method (see TrainingSet::PrepareBatchDistances)
+typedef struct {
+	int method;                     // WNN or WND
+	std::vector<int> features;      // indexes of the features with non-zero scales, in order
+	Eigen::ArrayXd scales;          // their scales
+	FeatureMatrix values;           // one row per training sample, one column per selected feature, scaled
+	Eigen::VectorXd norms;          // the squared norm of each row
+	bool valid;                     // set by PrepareBatchDistances, cleared when the samples or the weights change
+} batch_features_t;
+
+// A node of the vantage-point trees of wnn_index_t.  The samples under it are its vantage point,
+// the ones within radius of it (the inside subtree), and the ones at radius or beyond (the outside subtree).
+typedef struct {
+	long sample;                    // the vantage point
+	double radius;
+	long inside, outside;           // the nodes of the subtrees (-1 if empty)
+} vp_node_t;
+
+// An exact nearest-neighbour index of the training samples for WNNclassify (see TrainingSet::PrepareWNN):
+// the samples' values of the features with positive weights, and a vantage-point tree of the samples of each class over them
+typedef struct {
+	std::vector<int> features;      // indexes of the features with positive weights, in order
+	Eigen::ArrayXd feature_weights; // their weights
+	FeatureMatrix values;           // one row per training sample, one column per selected feature
+	std::vector<vp_node_t> nodes;   // the nodes of all the trees
+	std::vector<long> roots;        // the root node of each class's tree, indexed by class (-1 if the class has no samples)
+	bool usable;                    // false if there are negative weights, which don't make a metric
+	bool valid;                     // set by PrepareWNN, cleared when the samples, their classes or the weights change
+} wnn_index_t;
+
+// The prediction for one test image made by TrainingSet::PredictImage, which TrainingSet::ReportImage adds to the split
+typedef struct {
+	int sample_class;                        // the ground truth class of the image
+	int predicted_class;
+	double value;                            // the interpolated value, if is_continuous
+	double normalization_factor_avg;
+	signatures *closest_sample;
+	std::vector<double> probabilities_sum;   // the marginal probabilities of the image, indexed by class
+	std::vector<int> tile_classes;           // the class predicted for each of its tiles
+	std::string tiles_output;                // the per-tile lines to print before the image's own
+} image_prediction_t;
 
 typedef struct {
 	double accuracy;
@@ -169,6 +237,7 @@ typedef struct {
    featuregroups_t featuregroups_stats;
    double feature_weight_distance;
    char *individual_images;                /* a string of the individual image predictions. used for the report */
+   FILE *output;                           /* where the individual image predictions are printed (stdout if NULL) */
    unsigned short method; 
    double pearson_coefficient;             /* pearson correlation between the predicted and actual value        */
    double avg_abs_dif;                     /* average absolute difference between the actual and the predicted values */
@@ -184,7 +253,12 @@ public:
 	char source_path[256];                       /* Path we read this set from     */
 	int feature_vec_version, feature_vec_type; // from the signatures class
    signatures **samples;                                           /* samples data                              */
+   FeatureMatrix feature_matrix;                                   /* the values of the samples, which are views of its rows once packed */
+   wnd_features_t wnd_features;                                    /* the weighted features, packed for classify2 */
+   wnn_index_t wnn_index;                                          /* the nearest neighbour index for WNNclassify */
+   batch_features_t batch_features;                                /* the scaled weighted features for WeightedDistances */
    char SignatureNames[MAX_SIGNATURE_NUM][SIGNATURE_NAME_LENGTH];  /* names of the signatures (e.g. "MultiScale Histogram bin 3) */
+   std::vector<const FeatureInfo *> feature_infos;                 /* the FeatureNames info of the signatures (see LookupFeatureInfos) */
    double SignatureWeights[MAX_SIGNATURE_NUM];                     /* weights of the samples                    */
    double SignatureMins[MAX_SIGNATURE_NUM];                        /* minimum value of each signature           */
    double SignatureMaxes[MAX_SIGNATURE_NUM];                       /* maximum value of each signature           */
@@ -204,16 +278,22 @@ public:
    ~TrainingSet();                                                 /* destructor                                */
    int AddAllSignatures();                                         /* load the sample feature values from corresponding files */
 	int AddImageFile(char *filename, unsigned short sample_class, double sample_value, int save_sigs, featureset_t *featureset, int skip_sig_comparison_check = 0);
+	int ComputeImageSamples(char *filename, unsigned short sample_class, double sample_value, featureset_t *featureset, int skip_sig_comparison_check,
+		std::vector<image_sample_t> &image_samples);
+	int AddImageSamples (std::vector<image_sample_t> &image_samples, int res);
 	int LoadFromFilesDir(char *path, unsigned short sample_class, double sample_value, int save_sigs, featureset_t *featureset, int skip_sig_comparison_check = 0);
 	int LoadFromPath(char *path, int save_sigs, featureset_t *featureset, int make_continuous, int skip_sig_comparison_check = 0);
-   double ClassifyImage(TrainingSet *TestSet, int test_sample_index,int method, int tiles, int tile_areas, TrainingSet *TilesTrainingSets[], int max_tile,int rank, data_split *split, double *similarities);  /* classify one or more images */
+   double ClassifyImage(TrainingSet *TestSet, int test_sample_index,int method, int tiles, int tile_areas, TrainingSet *TilesTrainingSets[], int max_tile,int rank, data_split *split, double *similarities, const double *distances = NULL);  /* classify one or more images */
+   void PredictImage(TrainingSet *TestSet, int test_sample_index,int method, int tiles, int tile_areas, TrainingSet *TilesTrainingSets[], int max_tile,int rank, data_split *split, const double *distances, image_prediction_t &prediction);  /* classify the tiles of an image */
+   double ReportImage(TrainingSet *TestSet, int test_sample_index, int tiles, data_split *split, double *similarities, image_prediction_t &prediction);  /* add an image's prediction to the split */
    double Test(TrainingSet *TestSet, int method, int tiles, int tile_areas, TrainingSet *TilesTrainingSets[], int max_tile,long rank, data_split *split);     /* test      */
    int SaveToFile(char *filename);                                 /* save the training set values to a file    */
 	bool IsFitFile(char *filename);                                /* checks if its a proper fit file by making sure the first three lines are pure numeric */
    int ReadFromFile(char *filename);                               /* read the training set values from a file  */
-   int SaveWeightVector(char *filename);                           /* save the weights of the features into a file */
-   double LoadWeightVector(char *filename, double factor);         /* load the weights of the features from a file and assign them to the features of the training set */
+   int SaveWeightVector(char *filename, FILE *output_file = NULL);   /* save the weights of the features into a file */
+   double LoadWeightVector(char *filename, double factor, FILE *output_file = NULL);   /* load the weights of the features from a file and assign them to the features of the training set */
    void SetAttrib(TrainingSet *set);                               /* copy the attributes from one training set to another */   
+   void LookupFeatureInfos();                                      /* look up the FeatureNames info of the signatures once */
    int split(int randomize,double ratio,TrainingSet *TrainSet,TrainingSet *TestSet, unsigned short tiles, int train_samples, int test_samples, data_split *split); /* random split to train and test */
    int SplitAreas(long tiles_num, TrainingSet **TrainingSets);    /* split a tiled dataset into several datasets such that each dataset is one tile location */
    void RemoveClass(long class_index);                             /* remove a class                            */
@@ -222,20 +302,37 @@ public:
    int AddClass(char *label);                                      /* add a discrete class    */
    int AddContinuousClass (char *label);                           /* add a continuous class - not that only one can be added */
    int AddSample(signatures *new_sample);                          /* add signatures computed from one image    */
+   int AddSamplesFrom(TrainingSet *from, const std::vector<long> &sample_indexes, bool view); /* add samples of another set by index, without copying their values one by one */
+   void PackSamples();                                             /* move the sample values into the rows of feature_matrix */
+   void PrepareWND();                                              /* pack the values of the weighted features for classify2 */
+   void PrepareWNN();                                              /* build the nearest neighbour index for WNNclassify */
+   void PrepareBatchDistances(int method);                         /* scale and pack the values of the weighted features for WeightedDistances */
    void normalize();                                               /* normalize the values of the signatures to [0,100] */
-   void SetmRMRScores(double used_signatures,double used_mrmr);                     /* set mRMR scores to the features           */
+   void SetmRMRScores(double used_signatures,double used_mrmr);                     /* select features by mRMR and set their scores as weights */
    void SetFisherScores(double used_signatures, double used_mrmr, data_split *split);/* compute the fisher scores for the signatures  */
    int IgnoreFeatureGroup(long index,char *group_name);            /* set the Fisher Score of a group of image features to zero */
    double distance(signatures *sample1, signatures *sample2,double power);  /* Find the weighted Euclidean distance between two samples  */
-   long WNNclassify(signatures *test_sample, double *probabilities, double *normalization_factor, signatures **closest_sample);/* classify a sample using weighted nearest neighbor */
-   long classify2(char* name, int test_sample_index, signatures *test_sample, double *probabilities,double *normalization_factor); /* classify using -5                         */
-   double InterpolateValue(signatures *test_sample, int method, int N, signatures **closest_sample, double *closest_dist);  /* interpolate a value */
+   void WeightedDistances(TrainingSet *TestSet, long first_sample, long n_samples, int method, FeatureMatrix &distances); /* squared weighted distances of a block of test samples to all samples, as a matrix product */
+   long WNNclassify(signatures *test_sample, double *probabilities, double *normalization_factor, signatures **closest_sample, const double *distances = NULL);/* classify a sample using weighted nearest neighbor */
+   long classify2(char* name, int test_sample_index, signatures *test_sample, double *probabilities,double *normalization_factor, const double *distances = NULL); /* classify using -5                         */
+   double InterpolateValue(signatures *test_sample, int method, int N, signatures **closest_sample, double *closest_dist, const double *distances = NULL);  /* interpolate a value */
    long classify3(signatures *test_sample, double *probabilities,double *normalization_factor);
    double pearson(int tiles,double *avg_abs_dif,double *p_value);                  /* a pearson correlation of the interpolated and the class labels (if all labels are numeric) */
    long PrintConfusion(FILE *output_file, unsigned short *confusion_matrix, double *similarity_matrix);//, unsigned short dend_file, unsigned short method);  /* print a confusion or similarity matrix */
    long dendrogram(FILE *output_file, char *data_set_name, char *phylib_path, int nodes_num,double *similarity_matrix, char **labels,unsigned short sim_method,unsigned short phylip_algorithm);  /* create a dendrogram */
 	 long report(FILE *output_file, int argc, char **argv, char *output_file_name, std::vector<data_split> &splits, unsigned short split_num, featureset_t *featureset, int max_train_images,char *phylib_path, int distance_method, int phylip_algorithm, int export_tsv, TrainingSet *testset, int image_similarities, bool use_err_bars);
    void Summarize(featureset_t *featureset);  /* class summary to stdout */
+
+/* class config */
+	// compute the distances of all the test samples in Test() in blocks, as matrix products (see WeightedDistances)
+	static void SetBatchDistances (bool batch) { batch_distances = batch; };
+	static bool BatchDistances () { return (batch_distances); };
+	// find the nearest samples of each class in WNNclassify with the index built by PrepareWNN instead of comparing to every sample
+	static void SetWNNIndex (bool use) { use_wnn_index = use; };
+	static bool UseWNNIndex () { return (use_wnn_index); };
+private:
+	static bool batch_distances;
+	static bool use_wnn_index;
 };
 
 int check_numeric (char *s, double *samp_val);
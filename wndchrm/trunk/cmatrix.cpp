@@ -31,14 +31,14 @@
 #include <math.h>
 #include <stdio.h>
 #include "cmatrix.h"
+#include "PlanePool.h"
+#include "wndchrm_error.h"
 #include "ImageTransforms.h"
 #include "colors/FuzzyCalc.h"
 #include "transforms/fft/bcb_fftw3/fftw3.h"
 #include "transforms/chebyshev.h"
 #include "transforms/ChebyshevFourier.h"
 #include "transforms/wavelet/Symlet5.h"
-#include "transforms/wavelet/DataGrid2D.h"
-#include "transforms/wavelet/DataGrid3D.h"
 #include "transforms/radon.h"
 #include "statistics/CombFirst4Moments.h"
 #include "statistics/FeatureStatistics.h"
@@ -77,125 +77,226 @@ extern int verbosity;
 
 
 
+/* RGBConverter
+   Converts 8-bit RGB pixels to gray and HSV, giving the same results as RGB2GRAY and RGB2HSV.
+   The gray weights of each channel are looked up in per-channel tables (summed in the same order as RGB2GRAY),
+   and RGB2HSV results are kept in a direct-mapped cache keyed by the packed 24-bit color,
+   since the pixels of an image mostly repeat a comparatively small set of colors.
+*/
+#define RGB2HSV_CACHE_BITS 16
+class RGBConverter {
+	private:
+		double gray_r[256], gray_g[256], gray_b[256];
+		std::vector<unsigned int> hsv_keys;
+		std::vector<HSVcolor> hsv_values;
+	public:
+		RGBConverter () : hsv_keys (1 << RGB2HSV_CACHE_BITS, 0xFFFFFFFF), hsv_values (1 << RGB2HSV_CACHE_BITS) {
+			for (unsigned int i = 0; i < 256; i++) {
+				gray_r[i] = 0.2989*i;
+				gray_g[i] = 0.5870*i;
+				gray_b[i] = 0.1140*i;
+			}
+		}
+		inline double gray (const RGBcolor rgb) const {
+			return (gray_r[rgb.r] + gray_g[rgb.g] + gray_b[rgb.b]);
+		}
+		inline HSVcolor hsv (const RGBcolor rgb) {
+			unsigned int key = ((unsigned int)rgb.r << 16) | ((unsigned int)rgb.g << 8) | rgb.b;
+			unsigned int slot = (key * 2654435761U) >> (32 - RGB2HSV_CACHE_BITS);
+			if (hsv_keys[slot] != key) {
+				hsv_keys[slot] = key;
+				hsv_values[slot] = RGB2HSV (rgb);
+			}
+			return (hsv_values[slot]);
+		}
+};
+
+/* ReadTIFFChunk
+   Decode one strip (tiled = false) or tile of the image into chunk as interleaved samples,
+   spp samples per pixel, chunk_width pixels per row.
+   x0, y0 is any pixel within the strip or tile.
+   Separate sample planes are read one at a time into plane_buf and interleaved.
+   Returns false on a decoding error.
+*/
+static bool ReadTIFFChunk (TIFF *tif, bool tiled, bool separate, unsigned int x0, unsigned int y0,
+	unsigned short spp, size_t bytes_per_sample, size_t chunk_pixels, unsigned char *chunk, unsigned char *plane_buf) {
+	if (!separate) {
+		if (tiled) return (TIFFReadEncodedTile (tif, TIFFComputeTile (tif, x0, y0, 0, 0), chunk, (tsize_t)-1) >= 0);
+		else return (TIFFReadEncodedStrip (tif, TIFFComputeStrip (tif, y0, 0), chunk, (tsize_t)-1) >= 0);
+	}
+	for (unsigned short sample = 0; sample < spp; sample++) {
+		tsize_t res;
+		if (tiled) res = TIFFReadEncodedTile (tif, TIFFComputeTile (tif, x0, y0, 0, sample), plane_buf, (tsize_t)-1);
+		else res = TIFFReadEncodedStrip (tif, TIFFComputeStrip (tif, y0, sample), plane_buf, (tsize_t)-1);
+		if (res < 0) return (false);
+		for (size_t a = 0; a < chunk_pixels; a++)
+			memcpy (chunk + (a * spp + sample) * bytes_per_sample, plane_buf + a * bytes_per_sample, bytes_per_sample);
+	}
+	return (true);
+}
+
+/* StoreTIFFChunk
+   Store a decoded chunk of interleaved samples (chunk_width pixels per row) at x0, y0 in the planes:
+   - gray images (rgb is false) store the first sample of each pixel as is (the second one of gray+alpha images is the alpha).
+   - 8-bit RGB images store gray and HSV through the RGBConverter (HSV only if store_colors is true).
+   - 16-bit RGB images keep their samples in rgb16 (3 per pixel, row-major) and track their range in rgb16_min/max,
+     to be scaled to 8 bits once the whole image is read.
+   The fourth sample of RGBA images is the alpha, which is skipped.
+*/
+template <typename T> static void StoreTIFFChunk (const T *chunk, unsigned int chunk_width, unsigned short spp, bool rgb_samples,
+	unsigned int x0, unsigned int y0, unsigned int w, unsigned int h, unsigned int width,
+	writeablePixels pix_plane, writeableColors clr_plane, bool store_colors, RGBConverter &converter,
+	unsigned short *rgb16, double &rgb16_min, double &rgb16_max) {
+	unsigned int x, y;
+	unsigned short sample;
+	RGBcolor rgb;
+
+	for (y = 0; y < h; y++) {
+		const T *src = chunk + (size_t)y * chunk_width * spp;
+		if (!rgb_samples) {
+			for (x = 0; x < w; x++) pix_plane (y0 + y, x0 + x) = src[x * spp];
+		} else if (sizeof (T) == 1) {
+			for (x = 0; x < w; x++, src += spp) {
+				rgb.r = src[0];
+				rgb.g = src[1];
+				rgb.b = src[2];
+				pix_plane (y0 + y, x0 + x) = converter.gray (rgb);
+				if (store_colors) clr_plane (y0 + y, x0 + x) = converter.hsv (rgb);
+			}
+		} else {
+			unsigned short *dst = rgb16 + ((size_t)(y0 + y) * width + x0) * 3;
+			for (x = 0; x < w; x++, src += spp, dst += 3) {
+				for (sample = 0; sample < 3; sample++) {
+					dst[sample] = src[sample];
+					if (src[sample] < rgb16_min) rgb16_min = src[sample];
+					if (src[sample] > rgb16_max) rgb16_max = src[sample];
+				}
+			}
+		}
+	}
+}
+
 /* LoadTIFF
    filename -char *- full path to the image file
+   load_colors -bool- if false, RGB images are loaded as gray (cmGRAY) without converting to HSV or allocating the color plane.
+     Callers whose feature plan has no color features (see FeatureComputationPlan::reads_colors) use this to skip the color plane.
+   Multi-page TIFFs are not loaded here - their pages are read one at a time with a TIFFPageReader.
 */
-int ImageMatrix::LoadTIFF(char *filename) {
-	unsigned int h,w,x=0,y=0;
-	unsigned short int spp=0,bps=0;
+int ImageMatrix::LoadTIFF(char *filename, bool load_colors) {
 	TIFF *tif = NULL;
-	unsigned char *buf8;
-	unsigned short *buf16;
-	RGBcolor rgb = {0,0,0};
-	ImageMatrix R_matrix, G_matrix, B_matrix;
-	Moments2 R_stats, G_stats, B_stats;
+	int res;
 
 	TIFFSetWarningHandler(NULL);
 	if( (tif = TIFFOpen(filename, "r")) ) {
+		if ( TIFFNumberOfDirectories(tif) > 1) { TIFFClose(tif); return(0); }   /* get the number of slices (Zs) */
 		source = filename;
+		res = LoadTIFFPage (tif, load_colors);
+		TIFFClose(tif);
+		return (res);
+	} else return(0);
+}
 
-		TIFFGetField(tif, TIFFTAG_IMAGEWIDTH, &w);
-		width = w;
-		TIFFGetField(tif, TIFFTAG_IMAGELENGTH, &h);
-		height = h;
-		TIFFGetField(tif, TIFFTAG_BITSPERSAMPLE, &bps);
-		bits=bps;
-		if ( ! (bits == 8 || bits == 16) ) return (0); // only 8 and 16-bit images supported.
-		TIFFGetField(tif, TIFFTAG_SAMPLESPERPIXEL, &spp);
-		if (!spp) spp=1;  /* assume one sample per pixel if nothing is specified */
-		// regardless of how the image comes in, the stored mode is HSV
-		if (spp == 3) {
-			ColorMode = cmHSV;
-			// If the bits are > 8, we do the read into doubles so that later
-			// we can scale the image to its actual signal range.
-			if (bits > 8) {
-				R_matrix.ColorMode = cmGRAY;
-				R_matrix.allocate (width, height);
-				G_matrix.ColorMode = cmGRAY;
-				G_matrix.allocate (width, height);
-				B_matrix.ColorMode = cmGRAY;
-				B_matrix.allocate (width, height);
-			}
-		} else {
-			ColorMode = cmGRAY;
-		}
-		if ( TIFFNumberOfDirectories(tif) > 1) return(0);   /* get the number of slices (Zs) */
+/* LoadTIFFPage
+   tif -TIFF *- an open TIFF, positioned at the page (directory) to load
+   load_colors -bool- same as in LoadTIFF
+   The page is decoded a whole strip or tile at a time, and each one is converted straight into the planes.
+   The stats are computed in one row-major pass once all the pixels are stored.
+   The TIFF is left open.
+*/
+int ImageMatrix::LoadTIFFPage(TIFF *tif, bool load_colors) {
+	unsigned int h,w,x=0,y=0;
+	unsigned short int spp=0,bps=0,planar=PLANARCONFIG_CONTIG,photometric;
+	RGBcolor rgb = {0,0,0};
 
-		/* allocate the data */
-		allocate (width, height);
-		writeablePixels pix_plane = WriteablePixels();
-		writeableColors clr_plane = WriteableColors();
+	TIFFGetField(tif, TIFFTAG_IMAGEWIDTH, &w);
+	width = w;
+	TIFFGetField(tif, TIFFTAG_IMAGELENGTH, &h);
+	height = h;
+	TIFFGetField(tif, TIFFTAG_BITSPERSAMPLE, &bps);
+	bits=bps;
+	if ( ! (bits == 8 || bits == 16) ) return (0); // only 8 and 16-bit images supported.
+	TIFFGetField(tif, TIFFTAG_SAMPLESPERPIXEL, &spp);
+	if (!spp) spp=1;  /* assume one sample per pixel if nothing is specified */
+	TIFFGetFieldDefaulted(tif, TIFFTAG_PLANARCONFIG, &planar);
+	photometric = (spp >= 3 ? PHOTOMETRIC_RGB : PHOTOMETRIC_MINISBLACK);
+	TIFFGetField(tif, TIFFTAG_PHOTOMETRIC, &photometric);
+	// 1 sample is gray, 2 are gray+alpha, 3 are RGB and 4 are RGBA.  The alpha is ignored.
+	// Other layouts (e.g. CMYK, which also has 4 samples) aren't supported.
+	if (spp > 4 || (spp == 4 && photometric != PHOTOMETRIC_RGB)) {
+		catError ("TIFF images with %d samples per pixel (photometric interpretation %d) are not supported: only gray, gray+alpha, RGB and RGBA.\n",
+			(int)spp, (int)photometric);
+		return (0);
+	}
+	bool rgb_samples = (spp >= 3);
+	// regardless of how the image comes in, the stored mode is HSV
+	if (rgb_samples && load_colors) {
+		ColorMode = cmHSV;
+	} else {
+		ColorMode = cmGRAY;
+	}
 
-		/* read TIFF header and determine image size */
-		buf8 = (unsigned char *)_TIFFmalloc(TIFFScanlineSize(tif)*spp);
-		buf16 = (unsigned short *)_TIFFmalloc( (tsize_t)sizeof(unsigned short)*TIFFScanlineSize(tif)*spp );
-		for (y = 0; y < height; y++) {
-			int col;
-			if (bits==8) TIFFReadScanline(tif, buf8, y);
-			else TIFFReadScanline(tif, buf16, y);
-			x=0;col=0;
-			while (x<width) {
-				unsigned char byte_data;
-				unsigned short short_data;
-				double val=0;
-				int sample_index;
-				for (sample_index=0;sample_index<spp;sample_index++) {
-					byte_data=buf8[col+sample_index];
-					short_data=buf16[col+sample_index];
-					if (bits==8) val=(double)byte_data;
-					else val=(double)(short_data);
-					if (spp==3 && bits > 8) {  /* RGB image */
-						if (sample_index==0) R_matrix.WriteablePixels()(y,x) = R_stats.add (val);
-						if (sample_index==1) G_matrix.WriteablePixels()(y,x) = G_stats.add (val);
-						if (sample_index==2) B_matrix.WriteablePixels()(y,x) = B_stats.add (val);
-					} else if (spp == 3) {
-						if (sample_index==0) rgb.r = (unsigned char)(R_stats.add (val));
-						if (sample_index==1) rgb.g = (unsigned char)(G_stats.add (val));
-						if (sample_index==2) rgb.b = (unsigned char)(B_stats.add (val));
-					}
-				}
-				if (spp == 3 && bits == 8) {
-					pix_plane (y, x) = stats.add (RGB2GRAY (rgb));
-					clr_plane (y, x) = RGB2HSV(rgb);
-				} else if (spp == 1) {
-					pix_plane (y, x) = stats.add (val);
-				}
-				x++;
-				col+=spp;
-			}
+	/* allocate the data */
+	allocate (width, height);
+	writeablePixels pix_plane = WriteablePixels();
+	writeableColors clr_plane = WriteableColors();
+
+	// 16-bit RGB samples are kept until the whole image's range is known
+	RGBConverter converter;
+	std::vector<unsigned short> rgb16 (rgb_samples && bits > 8 ? (size_t)width * height * 3 : 0);
+	double RGB_min = INF, RGB_max = -INF;
+
+	/* the strip or tile layout */
+	bool tiled = TIFFIsTiled(tif), separate = (spp > 1 && planar == PLANARCONFIG_SEPARATE);
+	unsigned int chunk_width, chunk_height;
+	size_t bytes_per_sample = bits / 8;
+	if (tiled) {
+		TIFFGetField(tif, TIFFTAG_TILEWIDTH, &chunk_width);
+		TIFFGetField(tif, TIFFTAG_TILELENGTH, &chunk_height);
+	} else {
+		chunk_width = width;
+		TIFFGetFieldDefaulted(tif, TIFFTAG_ROWSPERSTRIP, &chunk_height);
+		if (chunk_height > height) chunk_height = height;
+	}
+	size_t chunk_pixels = (size_t)chunk_width * chunk_height;
+	unsigned char *chunk = (unsigned char *)_TIFFmalloc(chunk_pixels * spp * bytes_per_sample);
+	unsigned char *plane_buf = (separate ? (unsigned char *)_TIFFmalloc(chunk_pixels * bytes_per_sample) : NULL);
+
+	bool read_ok = (chunk && (plane_buf || !separate));
+	unsigned int x0, y0;
+	for (y0 = 0; read_ok && y0 < height; y0 += chunk_height) {
+		unsigned int chunk_h = (y0 + chunk_height > height ? height - y0 : chunk_height);
+		for (x0 = 0; read_ok && x0 < width; x0 += chunk_width) {
+			unsigned int chunk_w = (x0 + chunk_width > width ? width - x0 : chunk_width);
+			read_ok = ReadTIFFChunk (tif, tiled, separate, x0, y0, spp, bytes_per_sample, chunk_pixels, chunk, plane_buf);
+			if (!read_ok) break;
+			if (bits == 8) StoreTIFFChunk (chunk, chunk_width, spp, rgb_samples, x0, y0, chunk_w, chunk_h, width,
+				pix_plane, clr_plane, load_colors, converter, (rgb16.size() ? &(rgb16[0]) : NULL), RGB_min, RGB_max);
+			else StoreTIFFChunk ((unsigned short *)chunk, chunk_width, spp, rgb_samples, x0, y0, chunk_w, chunk_h, width,
+				pix_plane, clr_plane, load_colors, converter, (rgb16.size() ? &(rgb16[0]) : NULL), RGB_min, RGB_max);
 		}
-		// Do the conversion to unsigned chars based on the input signal range
-		// i.e. scale global RGB min-max to 0-255
-		if (spp == 3 && bits > 8) {
-			size_t a, num = width*height;
-			double RGB_min=0, RGB_max=0, RGB_scale=0;
-			R_matrix.finish();
-			G_matrix.finish();
-			B_matrix.finish();
-			// Get the min and max for all 3 channels
-			if (R_stats.min() <= G_stats.min() && R_stats.min() <= B_stats.min()) RGB_min = R_stats.min();
-			else if (G_stats.min() <= R_stats.min() && G_stats.min() <= B_stats.min()) RGB_min = G_stats.min();
-			else if (B_stats.min() <= R_stats.min() && B_stats.min() <= G_stats.min()) RGB_min = B_stats.min();
-			if (R_stats.max() >= G_stats.max() && R_stats.max() >= B_stats.max()) RGB_max = R_stats.max();
-			else if (G_stats.max() >= R_stats.max() && G_stats.max() >= B_stats.max()) RGB_max = G_stats.max();
-			else if (B_stats.max() >= R_stats.max() && B_stats.max() >= G_stats.max()) RGB_max = B_stats.max();
-			// Scale the clrData to the global min / max.
-			RGB_scale = (255.0/(RGB_max-RGB_min));
-			for (y = 0; y < height; y++) {
-				for (x = 0; x < width; x++) {
-					rgb.r = (unsigned char)( (R_matrix.ReadablePixels()(y,x) - RGB_min) * RGB_scale);
-					rgb.g = (unsigned char)( (G_matrix.ReadablePixels()(y,x) - RGB_min) * RGB_scale);
-					rgb.b = (unsigned char)( (B_matrix.ReadablePixels()(y,x) - RGB_min) * RGB_scale);
-					pix_plane (y, x) = stats.add (RGB2GRAY (rgb));
-					clr_plane (y, x) = RGB2HSV(rgb);
-				}
+	}
+	if (chunk) _TIFFfree(chunk);
+	if (plane_buf) _TIFFfree(plane_buf);
+	if (!read_ok) return (0);
+
+	// Do the conversion to unsigned chars based on the input signal range
+	// i.e. scale global RGB min-max to 0-255
+	if (rgb_samples && bits > 8) {
+		double RGB_scale = (255.0/(RGB_max-RGB_min));
+		const unsigned short *src = &(rgb16[0]);
+		for (y = 0; y < height; y++) {
+			for (x = 0; x < width; x++, src += 3) {
+				rgb.r = (unsigned char)( (src[0] - RGB_min) * RGB_scale);
+				rgb.g = (unsigned char)( (src[1] - RGB_min) * RGB_scale);
+				rgb.b = (unsigned char)( (src[2] - RGB_min) * RGB_scale);
+				pix_plane (y, x) = converter.gray (rgb);
+				if (load_colors) clr_plane (y, x) = converter.hsv (rgb);
 			}
 		}
-		_TIFFfree(buf8);
-		_TIFFfree(buf16);
-		TIFFClose(tif);
-
-	} else return(0);
+	}
+	UpdateStats();
+	// grayscale pixels are stored as read, so they are integer levels
+	if (!rgb_samples) has_int_levels = true;
 
 	return(1);
 }
@@ -247,30 +348,65 @@ int ImageMatrix::SaveTiff(char *filename) {
 	return(1);
 }
 
-int ImageMatrix::OpenImage(char *image_file_name, int downsample, rect *bounding_rect, double mean, double stddev) {  
+int ImageMatrix::OpenImage(char *image_file_name, int downsample, rect *bounding_rect, double mean, double stddev, bool load_colors) {  
 	int res=0;
 	if (strstr(image_file_name,".tif") || strstr(image_file_name,".TIF")) {  
-		res=LoadTIFF(image_file_name);
+		res=LoadTIFF(image_file_name, load_colors);
 	}
 
 	// add the image only if it was loaded properly
-	if (res) {
-		// compute features only from an area of the image
-		if (bounding_rect && bounding_rect->x >= 0) {
-			submatrix (*this, (unsigned int)bounding_rect->x, (unsigned int)bounding_rect->y,
-				(unsigned int)bounding_rect->x+bounding_rect->w-1, (unsigned int)bounding_rect->y+bounding_rect->h-1
-			);
-		}
-		if (downsample>0 && downsample<100)  /* downsample by a given factor */
-			Downsample(*this, ((double)downsample)/100.0,((double)downsample)/100.0);   /* downsample the image */
-		if (mean>0)  /* normalize to a given mean and standard deviation */
-			normalize(-1,-1,-1,mean,stddev);
-	}
+	if (res) preprocess (downsample, bounding_rect, mean, stddev);
 	if (! source.length() ) source = image_file_name;
 	finish();
 	return(res);
 }
 
+// The pre-processing done by OpenImage once an image is loaded
+void ImageMatrix::preprocess(int downsample, rect *bounding_rect, double mean, double stddev) {
+	// compute features only from an area of the image
+	if (bounding_rect && bounding_rect->x >= 0) {
+		submatrix (*this, (unsigned int)bounding_rect->x, (unsigned int)bounding_rect->y,
+			(unsigned int)bounding_rect->x+bounding_rect->w-1, (unsigned int)bounding_rect->y+bounding_rect->h-1
+		);
+	}
+	if (downsample>0 && downsample<100)  /* downsample by a given factor */
+		Downsample(*this, ((double)downsample)/100.0,((double)downsample)/100.0);   /* downsample the image */
+	if (mean>0)  /* normalize to a given mean and standard deviation */
+		normalize(-1,-1,-1,mean,stddev);
+}
+
+/* TIFFPageReader
+   open returns the number of pages (directories) in the TIFF, or 0 if it can't be opened.
+   read loads one page into matrix, pre-processed the same way as by ImageMatrix::OpenImage.
+   Pages can be read in any order, but reading them in order only has to follow one link in the TIFF's directory chain.
+*/
+int TIFFPageReader::open (const char *filename) {
+	close ();
+	TIFFSetWarningHandler(NULL);
+	if ( !(tif = TIFFOpen(filename, "r")) ) return (0);
+	source = filename;
+	n_pages = TIFFNumberOfDirectories(tif);
+	return (n_pages);
+}
+
+void TIFFPageReader::close () {
+	if (tif) TIFFClose(tif);
+	tif = NULL;
+	n_pages = 0;
+}
+
+int TIFFPageReader::read (ImageMatrix &matrix, int page, int downsample, rect *bounding_rect, double mean, double stddev, bool load_colors) {
+	int res = 0;
+	if (tif && page >= 0 && page < n_pages) {
+		if (TIFFCurrentDirectory(tif) == page || TIFFSetDirectory(tif, page))
+			res = matrix.LoadTIFFPage (tif, load_colors);
+	}
+	if (res) matrix.preprocess (downsample, bounding_rect, mean, stddev);
+	matrix.source = source;
+	matrix.finish();
+	return (res);
+}
+
 
 // pseudo-constructor helpers (see below)
 
@@ -279,9 +415,11 @@ void ImageMatrix::init() {
 	width      = 0;
 	height     = 0;
 	_is_pix_writeable = _is_clr_writeable = false;
+	_is_view = false;
 
 	stats.reset();
 	has_median = false;
+	has_int_levels = false;
 	_median    = 0;
 	source     = "";
 	ColorMode = cmGRAY;
@@ -292,26 +430,28 @@ void ImageMatrix::init() {
 // The object is created new at the same memory location it was before, so no new allocation happens
 // This allows us to call Eigen's Map constructor with new parameters without actually re-allocating the object
 // N.B.: THis does not do any memory allocation or deallocation, it simply assigns the passed in memory to an Eigen object.
-void ImageMatrix::remap_pix_plane(double *ptr, const unsigned int w, const unsigned int h) {
+// The stride is the number of elements between the starts of successive rows; 0 means the rows are contiguous (stride = w).
+void ImageMatrix::remap_pix_plane(pixDataType *ptr, const unsigned int w, const unsigned int h, const unsigned int stride) {
 	width  = 0;
 	height = 0;
 	// N.B. Eigen matrix parameter order is rows, cols, not X, Y
-	new (&_pix_plane) pixData(ptr, h, w);
+	new (&_pix_plane) pixData(ptr, h, w, Eigen::OuterStride<>(stride ? stride : w));
 	width  = (unsigned int)_pix_plane.cols();
 	height = (unsigned int)_pix_plane.rows();
 	// FIXME: Should check here if the pointer is different than what it was.
 	// May be possible to do a conservative re-mapping.
 	_is_pix_writeable = true;
 	has_median = false;
+	has_int_levels = false;
 	stats.reset();
 }
 // Same as above for the color plane.
-void ImageMatrix::remap_clr_plane(HSVcolor *ptr, const unsigned int w, const unsigned int h) {
+void ImageMatrix::remap_clr_plane(HSVcolor *ptr, const unsigned int w, const unsigned int h, const unsigned int stride) {
 	if (ColorMode == cmGRAY) return;
 	width  = 0;
 	height = 0;
 	// N.B. Eigen matrix parameter order is rows, cols, not X, Y
-	new (&_clr_plane) clrData(ptr, h, w);
+	new (&_clr_plane) clrData(ptr, h, w, Eigen::OuterStride<>(stride ? stride : w));
 	width  = (unsigned int)_clr_plane.cols();
 	height = (unsigned int)_clr_plane.rows();
 	// FIXME: Should check here if the pointer is different than what it was.
@@ -324,24 +464,31 @@ void ImageMatrix::remap_clr_plane(HSVcolor *ptr, const unsigned int w, const uns
 // Ensure that anything that's reallocated is deallocated first.
 void ImageMatrix::allocate (unsigned int w, unsigned int h) {
 
+	// A view doesn't own its planes, so drop them without deallocating.
+	if (_is_view) release_planes ();
+
 	if ((unsigned int) _pix_plane.cols() != w || (unsigned int)_pix_plane.rows() != h) {
 		// These throw exceptions, which we don't catch (catch in main?)
 		// FIXME: We could check for shrinkage and simply remap instead of allocating.
+		// Planes come from and go back to the PlanePool, so same-sized tiles and transforms reuse each other's memory.
 		if (verbosity > 7 && _pix_plane.data()) fprintf (stdout, "deallocating grayscale %p\n",(void *)_pix_plane.data());
-		if (_pix_plane.data()) Eigen::aligned_allocator<double>().deallocate (_pix_plane.data(), _pix_plane.size());
-		remap_pix_plane (Eigen::aligned_allocator<double>().allocate (w * h), w, h);
+		if (_pix_plane.data()) PlanePool::deallocate (_pix_plane.data(), _pix_plane.size());
+		remap_pix_plane (PlanePool::allocate<pixDataType> ((size_t)w * h), w, h);
 		if (verbosity > 7 && _pix_plane.data()) fprintf (stdout, "allocated grayscale %p (%d,%d)\n",(void *)_pix_plane.data(), w, h);
 	} else {
 		// No re-allocation necessary since size didn't change
 		// The width and height are updated to the parmeters here because remap_pix_plane was not called
 		width = w;
 		height = h;
+		// the re-used plane gets new contents (e.g. the next page of a multi-page TIFF), so it's writeable again
+		_is_pix_writeable = true;
+		if (ColorMode != cmGRAY) _is_clr_writeable = true;
 	}
 
 	// cleanup the color plane if it changed size, or if we have a gray image.
 	if ( ColorMode == cmGRAY || (_pix_plane.data() && ((unsigned int)_clr_plane.cols() != w || (unsigned int)_clr_plane.rows() != h)) ) {
 		if (verbosity > 7 && _clr_plane.data()) fprintf (stdout, "  deallocating color %p\n",(void *)_clr_plane.data());
-		if (_clr_plane.data()) Eigen::aligned_allocator<HSVcolor>().deallocate (_clr_plane.data(), _clr_plane.size());
+		if (_clr_plane.data()) PlanePool::deallocate (_clr_plane.data(), _clr_plane.size());
 		remap_clr_plane (NULL, 0, 0);
 	}
 
@@ -349,7 +496,7 @@ void ImageMatrix::allocate (unsigned int w, unsigned int h) {
 	if (ColorMode != cmGRAY && ! (_clr_plane.data()) ) {
 		// These throw exceptions, which we don't catch (catch in main?)
 		// FIXME: We could check for shrinkage and simply remap instead of allocating.
-		remap_clr_plane (Eigen::aligned_allocator<HSVcolor>().allocate (w * h), w, h);
+		remap_clr_plane (PlanePool::allocate<HSVcolor> ((size_t)w * h), w, h);
 		if (verbosity > 7 && _clr_plane.data()) fprintf (stdout, "  allocated color %p (%d,%d)\n",(void *)_clr_plane.data(), w, h);
 	}
 }
@@ -359,6 +506,7 @@ void ImageMatrix::copyFields(const ImageMatrix &copy) {
 	height = copy.height;
 	stats  = copy.stats;
 	has_median = copy.has_median;
+	has_int_levels = copy.has_int_levels;
 	_median    = copy._median;
 	source     = copy.source;
 	ColorMode = copy.ColorMode;
@@ -376,6 +524,7 @@ void ImageMatrix::copyData(const ImageMatrix &copy) {
 	}
 	stats = old_stats;
 	has_median = old_has_median;
+	has_int_levels = copy.has_int_levels;
 }
 void ImageMatrix::copy(const ImageMatrix &copy) {
 	copyFields (copy);
@@ -397,11 +546,43 @@ void ImageMatrix::submatrix (const ImageMatrix &matrix, const unsigned int x1, c
 	// Copy the Eigen matrixes
 	// N.B. Eigen matrix parameter order is rows, cols, not X, Y
 	WriteablePixels() = matrix.ReadablePixels().block(y0,x0,height,width);
+	has_int_levels = matrix.has_int_levels;
 	if (ColorMode != cmGRAY) {
 		WriteableColors() = matrix.ReadableColors().block(y0,x0,height,width);
 	}
 }
 
+/*
+Make this ImageMatrix a read-only view of a rectangle within matrix's pixel and color planes, without copying any pixels.
+The bounds are treated the same way as in submatrix().
+The view's rows keep the stride of matrix's planes, so matrix must outlive the view, and its planes must not be reallocated while the view is in use.
+Only the stats that don't depend on the pixels are inherited (e.g. has_int_levels) - the rest are computed on demand.
+*/
+void ImageMatrix::submatrix_view (const ImageMatrix &matrix, const unsigned int x1, const unsigned int y1, const unsigned int x2, const unsigned int y2) {
+	unsigned int x0, y0;
+
+	x0 = (x1 < 0 ? 0 : x1);
+	y0 = (y1 < 0 ? 0 : y1);
+	unsigned int new_width  = (x2 >= matrix.width  ? matrix.width  : x2 - x0 + 1);
+	unsigned int new_height = (y2 >= matrix.height ? matrix.height : y2 - y0 + 1);
+
+	assert (&matrix != this && "Attempt to make a view of itself");
+	// release any planes we own.
+	release_planes ();
+
+	copyFields (matrix);
+	// N.B. Eigen matrix parameter order is rows, cols, not X, Y
+	remap_pix_plane ((pixDataType *)matrix._pix_plane.data() + (size_t)y0 * matrix._pix_plane.outerStride() + x0,
+		new_width, new_height, matrix._pix_plane.outerStride());
+	if (ColorMode != cmGRAY) {
+		remap_clr_plane ((HSVcolor *)matrix._clr_plane.data() + (size_t)y0 * matrix._clr_plane.outerStride() + x0,
+			new_width, new_height, matrix._clr_plane.outerStride());
+	}
+	_is_view = true;
+	has_int_levels = matrix.has_int_levels;
+	finish();
+}
+
 /*
 * There is only one simple constructor implemented (no copy constructors or other constructors).
 * The reason for this is that a SharedImageMatrix subclass needs to override the allocate() method to make it shareable.
@@ -425,13 +606,26 @@ void ImageMatrix::submatrix (const ImageMatrix &matrix, const unsigned int x1, c
 */
 ImageMatrix::~ImageMatrix() {
 	finish();
-	if (verbosity > 7 && _pix_plane.data()) fprintf (stdout, "deallocating grayscale %p\n",(void *)_pix_plane.data());
-	if (_pix_plane.data()) Eigen::aligned_allocator<double>().deallocate (_pix_plane.data(), _pix_plane.size());
-	remap_pix_plane (NULL, 0, 0);
+	release_planes ();
+}
 
-	if (verbosity > 7 && _clr_plane.data()) fprintf (stdout, "deallocating color %p\n",(void *)_clr_plane.data());
-	if (_clr_plane.data()) Eigen::aligned_allocator<HSVcolor>().deallocate (_clr_plane.data(), _clr_plane.size());
-	remap_clr_plane (NULL, 0, 0);
+// Return the planes we own to the PlanePool.  A view's planes belong to another ImageMatrix, so they are only dropped.
+void ImageMatrix::release_planes () {
+	if (!_is_view) {
+		if (verbosity > 7 && _pix_plane.data()) fprintf (stdout, "deallocating grayscale %p\n",(void *)_pix_plane.data());
+		if (_pix_plane.data()) PlanePool::deallocate (_pix_plane.data(), _pix_plane.size());
+		if (verbosity > 7 && _clr_plane.data()) fprintf (stdout, "deallocating color %p\n",(void *)_clr_plane.data());
+		if (_clr_plane.data()) PlanePool::deallocate (_clr_plane.data(), _clr_plane.size());
+	}
+	drop_planes ();
+}
+
+// Empty both planes without deallocating anything.
+// Unlike remap_clr_plane(), this also empties the color plane of a matrix whose ColorMode is cmGRAY.
+void ImageMatrix::drop_planes () {
+	new (&_pix_plane) pixData(NULL, 0, 0, Eigen::OuterStride<>(0));
+	new (&_clr_plane) clrData(NULL, 0, 0, Eigen::OuterStride<>(0));
+	_is_view = false;
 }
 
 // This is a general transform method that applies the specified transform to the specified ImageMatrix,
@@ -466,7 +660,7 @@ void ImageMatrix::to8bits(const ImageMatrix &matrix_IN) {
 */
 
 void ImageMatrix::flipV() {
-	bool old_has_median = has_median;
+	bool old_has_median = has_median, old_has_int_levels = has_int_levels;
 	Moments2 old_stats = stats;
 
 	WriteablePixels() = ReadablePixels().rowwise().reverse();
@@ -476,12 +670,13 @@ void ImageMatrix::flipV() {
 	// on its own, this operation doesn't affect the stats
 	stats = old_stats;
 	has_median = old_has_median;
+	has_int_levels = old_has_int_levels;
 }
 /* flipH
    flip an image horizontally
 */
 void ImageMatrix::flipH() {
-	bool old_has_median = has_median;
+	bool old_has_median = has_median, old_has_int_levels = has_int_levels;
 	Moments2 old_stats = stats;
 
 	WriteablePixels() = ReadablePixels().colwise().reverse();
@@ -491,6 +686,7 @@ void ImageMatrix::flipH() {
 	// on its own, this operation doesn't affect the stats
 	stats = old_stats;
 	has_median = old_has_median;
+	has_int_levels = old_has_int_levels;
 }
 
 void ImageMatrix::invert() {
@@ -498,17 +694,62 @@ void ImageMatrix::invert() {
 	WriteablePixels() = (max_val - ReadablePixels().array() + min_val).unaryExpr (Moments2func(stats));
 }
 
+/* DownsampleTaps
+   The source pixels and weights that make up each of the new_size output pixels along one axis, when downsampling
+   old_size pixels by a factor of d (>= 1): output o covers [x, x+d) where x is o steps of d,
+   with the partial pixels at either end weighted by the fraction covered.
+   The taps of output o are tap_index / tap_weight [first_tap[o] .. first_tap[o+1]-1], in the order they are summed.
+*/
+static void DownsampleTaps (unsigned int old_size, double d, unsigned int new_size,
+	std::vector<unsigned int> &first_tap, std::vector<unsigned int> &tap_index, std::vector<double> &tap_weight) {
+	double x = 0, frac;
+	unsigned int o, a;
+
+	first_tap.resize (new_size + 1);
+	tap_index.clear();
+	tap_weight.clear();
+	for (o = 0; o < new_size; o++) {
+		first_tap[o] = tap_index.size();
+		if (x < old_size) {
+			/* the leftmost fraction of pixel */
+			a = (unsigned int)(floor(x));
+			frac = ceil(x)-x;
+			if (frac > 0 && a < old_size) {
+				tap_index.push_back (a);
+				tap_weight.push_back (frac);
+			}
+			/* the middle full pixels */
+			for (a = (unsigned int)(ceil(x)); a < floor(x+d); a++) {
+				if (a < old_size) {
+					tap_index.push_back (a);
+					tap_weight.push_back (1.0);
+				}
+			}
+			/* the right fraction of pixel */
+			frac = x+d - floor(x+d);
+			if (frac > 0 && a < old_size) {
+				tap_index.push_back (a);
+				tap_weight.push_back (frac);
+			}
+		}
+		x += d;
+	}
+	first_tap[new_size] = tap_index.size();
+}
+
 /* Downsample
    down sample an image
    x_ratio, y_ratio -double- (0 to 1) the size of the new image comparing to the old one
-   FIXME: Since this is done in-place, there is potential for aliasing (i.e. new pixel values interfering with old pixel values)
+   The area resampling is separable: each row is first reduced to the new width using the per-column taps,
+   then the new rows are made by accumulating whole intermediate rows with the per-row taps.
+   Only the width-reduced intermediate is stored, so matrix_IN may be this ImageMatrix.
+   The new pixels are added to the stats column by column, in the same order as before, so that the stats are unchanged.
 */
 void ImageMatrix::Downsample (const ImageMatrix &matrix_IN, double x_ratio, double y_ratio) {
-	double x,y,dx,dy,frac;
-	unsigned int new_x,new_y,a;
+	double dx,dy;
+	unsigned int x,y,t;
 	HSVcolor hsv;
 
-
 	if (x_ratio>1) x_ratio=1;
 	if (y_ratio>1) y_ratio=1;
 	dx=1/x_ratio;
@@ -516,71 +757,43 @@ void ImageMatrix::Downsample (const ImageMatrix &matrix_IN, double x_ratio, doub
 
 	if (dx == 1 && dy == 1) return;   /* nothing to scale */
 
-	ImageMatrix copy_matrix;
-	copy_matrix.copyFields (matrix_IN);
-	copy_matrix.allocate (matrix_IN.width, matrix_IN.height);
-	writeablePixels copy_pix_x = copy_matrix.WriteablePixels();
-	writeableColors copy_clr_x = copy_matrix.WriteableColors();
-
 	readOnlyPixels pix_plane_x = matrix_IN.ReadablePixels();
 	readOnlyColors clr_plane_x = matrix_IN.ReadableColors();
  	unsigned int new_width = (unsigned int)(x_ratio*matrix_IN.width), new_height = (unsigned int)(y_ratio*matrix_IN.height),
  		old_width = matrix_IN.width, old_height = matrix_IN.height;
 
-	// first downsample x
-	for (new_y = 0; new_y < old_height; new_y++) {
-		x = 0;
-		new_x = 0;
-		while (x < old_width) {
+	std::vector<unsigned int> x_first, x_index, y_first, y_index;
+	std::vector<double> x_weight, y_weight;
+	DownsampleTaps (old_width, dx, new_width, x_first, x_index, x_weight);
+	DownsampleTaps (old_height, dy, new_height, y_first, y_index, y_weight);
+
+	// first downsample x, into new_width x old_height intermediates
+	std::vector<double> pix_x ((size_t)new_width * old_height);
+	std::vector<HSVcolor> clr_x (ColorMode != cmGRAY ? (size_t)new_width * old_height : 0);
+	for (y = 0; y < old_height; y++) {
+		double *pix_x_row = &(pix_x[0]) + (size_t)y * new_width;
+		for (x = 0; x < new_width; x++) {
 			double sum_i = 0;
-			double sum_h = 0;
-			double sum_s = 0;
-			double sum_v = 0;
-
-			/* the leftmost fraction of pixel */
-			a = (unsigned int)(floor(x));
-			frac = ceil(x)-x;
-			if (frac > 0 && a < old_width) {
-				sum_i += pix_plane_x(new_y,a) * frac;
-				if (ColorMode != cmGRAY) {
-					sum_h += clr_plane_x(new_y,a).h * frac;
-					sum_s += clr_plane_x(new_y,a).s * frac;
-					sum_v += clr_plane_x(new_y,a).v * frac;
-				}
-			} 
-
-			/* the middle full pixels */
-			for (a = (unsigned int)(ceil(x)); a < floor(x+dx); a++) {
-				if (a < old_width) {
-					sum_i += pix_plane_x(new_y,a);
-					if (ColorMode != cmGRAY) {
-						sum_h += clr_plane_x(new_y,a).h;
-						sum_s += clr_plane_x(new_y,a).s;
-						sum_v += clr_plane_x(new_y,a).v;
-					}
-				}
-			}
-			/* the right fraction of pixel */
-			frac = x+dx - floor(x+dx);
-			if (frac > 0 && a < old_width) {
-				sum_i += pix_plane_x(new_y,a) * frac;
-				if (ColorMode != cmGRAY) {
-					sum_h += clr_plane_x(new_y,a).h * frac;
-					sum_s += clr_plane_x(new_y,a).s * frac;
-					sum_v += clr_plane_x(new_y,a).v * frac;
+			for (t = x_first[x]; t < x_first[x+1]; t++)
+				sum_i += pix_plane_x(y,x_index[t]) * x_weight[t];
+			pix_x_row[x] = sum_i/(dx);
+		}
+		if (ColorMode != cmGRAY) {
+			HSVcolor *clr_x_row = &(clr_x[0]) + (size_t)y * new_width;
+			for (x = 0; x < new_width; x++) {
+				double sum_h = 0;
+				double sum_s = 0;
+				double sum_v = 0;
+				for (t = x_first[x]; t < x_first[x+1]; t++) {
+					sum_h += clr_plane_x(y,x_index[t]).h * x_weight[t];
+					sum_s += clr_plane_x(y,x_index[t]).s * x_weight[t];
+					sum_v += clr_plane_x(y,x_index[t]).v * x_weight[t];
 				}
-			}
-
-			copy_pix_x (new_y,new_x) = sum_i/(dx);
-			if (ColorMode != cmGRAY) {
 				hsv.h = (byte)(sum_h/(dx));
 				hsv.s = (byte)(sum_s/(dx));
 				hsv.v = (byte)(sum_v/(dx));
-				copy_clr_x (new_y, new_x) = hsv;
+				clr_x_row[x] = hsv;
 			}
-
-			x+=dx;
-			new_x++;
 		}
 	}
 
@@ -588,69 +801,91 @@ void ImageMatrix::Downsample (const ImageMatrix &matrix_IN, double x_ratio, doub
 	writeablePixels copy_pix_y = WriteablePixels();
 	writeableColors copy_clr_y = WriteableColors();
 
-	readOnlyPixels pix_plane_y = copy_matrix.ReadablePixels();
-	readOnlyColors clr_plane_y = copy_matrix.ReadableColors();
-
-	/* downsample y */
-	for (new_x = 0; new_x < new_width; new_x++) {
-		y = 0;
-		new_y = 0;
-		while (y < old_height) {
-			double sum_i = 0;
-			double sum_h = 0;
-			double sum_s = 0;
-			double sum_v = 0;
-
-			a = (unsigned int)(floor(y));
-			frac = ceil(y) - y;
-			// take also the part of the leftmost pixel (if needed)
-			if (frac > 0 && a < old_height) {
-				sum_i += pix_plane_y(a,new_x) * frac;
-				if (ColorMode != cmGRAY) {
-					sum_h += clr_plane_y(a,new_x).h * frac;
-					sum_s += clr_plane_y(a,new_x).s * frac;
-					sum_v += clr_plane_y(a,new_x).v * frac;
-				}
-			}
-			for (a = (unsigned int)(ceil(y)); a < floor(y+dy); a++) {
-				if (a < old_height) {
-					sum_i += pix_plane_y(a,new_x);
-					if (ColorMode != cmGRAY) {
-						sum_h += clr_plane_y(a,new_x).h;
-						sum_s += clr_plane_y(a,new_x).s;
-						sum_v += clr_plane_y(a,new_x).v;
-					}
-				}
-			}
-			frac=y+dy-floor(y+dy);
-			if (frac > 0 && a < old_height) {
-				sum_i += pix_plane_y(a,new_x) * frac;
-				if (ColorMode != cmGRAY) {
-					sum_h += clr_plane_y(a,new_x).h * frac;
-					sum_s += clr_plane_y(a,new_x).s * frac;
-					sum_v += clr_plane_y(a,new_x).v * frac;
+	/* downsample y, one output row at a time */
+	std::vector<double> pix_y ((size_t)new_width * new_height), sum_h, sum_s, sum_v;
+	if (ColorMode != cmGRAY) {
+		sum_h.resize (new_width);
+		sum_s.resize (new_width);
+		sum_v.resize (new_width);
+	}
+	for (y = 0; y < new_height; y++) {
+		double *sum_i = &(pix_y[0]) + (size_t)y * new_width;
+		for (t = y_first[y]; t < y_first[y+1]; t++) {
+			const double *pix_x_row = &(pix_x[0]) + (size_t)y_index[t] * new_width;
+			const double w = y_weight[t];
+			for (x = 0; x < new_width; x++) sum_i[x] += pix_x_row[x] * w;
+		}
+		for (x = 0; x < new_width; x++) sum_i[x] /= dy;
+
+		if (ColorMode != cmGRAY) {
+			std::fill (sum_h.begin(), sum_h.end(), 0.0);
+			std::fill (sum_s.begin(), sum_s.end(), 0.0);
+			std::fill (sum_v.begin(), sum_v.end(), 0.0);
+			for (t = y_first[y]; t < y_first[y+1]; t++) {
+				const HSVcolor *clr_x_row = &(clr_x[0]) + (size_t)y_index[t] * new_width;
+				const double w = y_weight[t];
+				for (x = 0; x < new_width; x++) {
+					sum_h[x] += clr_x_row[x].h * w;
+					sum_s[x] += clr_x_row[x].s * w;
+					sum_v[x] += clr_x_row[x].v * w;
 				}
 			}
-			if (new_x < new_width && new_y < new_height) {
-				copy_pix_y (new_y,new_x) = stats.add (sum_i/dy);
-				if (ColorMode != cmGRAY) {
-					hsv.h = (byte)(sum_h/(dy));
-					hsv.s = (byte)(sum_s/(dy));
-					hsv.v = (byte)(sum_v/(dy));
-					copy_clr_y (new_y, new_x) = hsv;
-				}
+			for (x = 0; x < new_width; x++) {
+				hsv.h = (byte)(sum_h[x]/(dy));
+				hsv.s = (byte)(sum_s[x]/(dy));
+				hsv.v = (byte)(sum_v[x]/(dy));
+				copy_clr_y (y, x) = hsv;
 			}
-
-			y+=dy;
-			new_y++;
 		}
 	}
+
+	/* store the new pixels and add them to the stats, column by column */
+	for (x = 0; x < new_width; x++)
+		for (y = 0; y < new_height; y++)
+			copy_pix_y (y,x) = stats.add (pix_y[(size_t)y * new_width + x]);
 }
 
 
+/* RotatePlane
+   Rotate a plane of w x h elements (in_stride elements between the starts of rows) by 90, 180 or 270 degrees
+   into out (out_stride elements between rows), with the same orientation as:
+     90:  out = in.transpose().rowwise().reverse(), i.e. out(r,c) = in(h-1-c,r)
+     180: out = in.reverse(),                       i.e. out(r,c) = in(h-1-r,w-1-c)
+     270: out = in.transpose(),                     i.e. out(r,c) = in(c,r)
+   The 90 and 270 transposes are done in square blocks so that both the reads and the strided writes stay in cache.
+*/
+#define ROTATE_BLOCK 32
+template <typename T> static void RotatePlane (const T *in, size_t in_stride, unsigned int w, unsigned int h,
+	T *out, size_t out_stride, int angle) {
+	unsigned int x, y, bx, by, x_end, y_end;
+
+	if (angle == 180) {
+		for (y = 0; y < h; y++) {
+			const T *in_row = in + (size_t)(h - 1 - y) * in_stride + (w - 1);
+			T *out_row = out + (size_t)y * out_stride;
+			for (x = 0; x < w; x++) out_row[x] = *(in_row - x);
+		}
+		return;
+	}
+
+	for (by = 0; by < h; by += ROTATE_BLOCK) {
+		y_end = (by + ROTATE_BLOCK < h ? by + ROTATE_BLOCK : h);
+		for (bx = 0; bx < w; bx += ROTATE_BLOCK) {
+			x_end = (bx + ROTATE_BLOCK < w ? bx + ROTATE_BLOCK : w);
+			// input row y becomes output column (h-1-y) for 90, or column y for 270
+			for (y = by; y < y_end; y++) {
+				const T *in_row = in + (size_t)y * in_stride;
+				T *out_col = out + (angle == 90 ? h - 1 - y : y);
+				for (x = bx; x < x_end; x++) out_col[(size_t)x * out_stride] = in_row[x];
+			}
+		}
+	}
+}
+
 /* Rotate
    Rotate an image by 90, 120, or 270 degrees
    angle -double- (0 to 360) the degrees of rotation.  Only values of 90, 180, 270 are currently allowed
+   Both the intensity and the color planes are rotated.  matrix_IN may be this ImageMatrix.
 */
 void ImageMatrix::Rotate(const ImageMatrix &matrix_IN, double angle) {
 	unsigned int new_width,new_height;
@@ -660,6 +895,14 @@ void ImageMatrix::Rotate(const ImageMatrix &matrix_IN, double angle) {
 	// Only deal with right angles
 	if (! ( (angle == 90) || (angle == 180) || (angle == 270) ) ) return;
 
+	// rotating in place needs a copy of the source planes to read from
+	if (&matrix_IN == this) {
+		ImageMatrix copy_matrix;
+		copy_matrix.copy (*this);
+		Rotate (copy_matrix, angle);
+		return;
+	}
+
 	// switch width/height if 90 or 270
 	if ( (angle == 90) || (angle == 270) ) {
 		new_width = matrix_IN.height;
@@ -674,26 +917,21 @@ void ImageMatrix::Rotate(const ImageMatrix &matrix_IN, double angle) {
 
 	allocate (new_width, new_height);
 
-	// a 180 is simply a reverse of the matrix
-	// a 90 is m.transpose().rowwise.reverse()
-	// a 270 is m.transpose()
-	switch ((int)angle) {
-		case 90:
-			WriteablePixels() = matrix_IN.ReadablePixels().transpose().rowwise().reverse();
-		break;
-
-		case 180:
-			WriteablePixels() = matrix_IN.ReadablePixels().reverse();
-		break;
-
-		case 270:
-			WriteablePixels() = matrix_IN.ReadablePixels().transpose();
-		break;
+	writeablePixels out_pix_plane = WriteablePixels();
+	readOnlyPixels in_pix_plane = matrix_IN.ReadablePixels();
+	RotatePlane (in_pix_plane.data(), in_pix_plane.outerStride(), matrix_IN.width, matrix_IN.height,
+		out_pix_plane.data(), out_pix_plane.outerStride(), (int)angle);
+	if (ColorMode != cmGRAY) {
+		writeableColors out_clr_plane = WriteableColors();
+		readOnlyColors in_clr_plane = matrix_IN.ReadableColors();
+		RotatePlane (in_clr_plane.data(), in_clr_plane.outerStride(), matrix_IN.width, matrix_IN.height,
+			out_clr_plane.data(), out_clr_plane.outerStride(), (int)angle);
 	}
 	
 	// this operation does not change pixels statistics
 	stats = old_stats;
 	has_median = old_has_median;
+	has_int_levels = matrix_IN.has_int_levels;
 }
 
 // This pair of methods makes median-finding with and without caching for regular and const ImageMatrix objects
@@ -711,7 +949,10 @@ double ImageMatrix::get_median () const {
 	std::vector<double> v (num);
 
 	readOnlyPixels pix_plane = ReadablePixels();
-	for (size_t i = 0; i < num; i++) v[i] = pix_plane.array().coeff(i);
+	size_t i = 0;
+	for (unsigned int y = 0; y < height; y++)
+		for (unsigned int x = 0; x < width; x++)
+			v[i++] = pix_plane(y,x);
     size_t half = num / 2;
 	if (num % 2 == 0) {
 		nth_element(v.begin(), v.begin()+half, v.end());
@@ -849,7 +1090,6 @@ void ImageMatrix::GetColorStatistics(double *hue_avg_p, double *hue_std_p, doubl
 	unsigned int a, x, y, pixel_index=0;
 	unsigned long color_index=0;
 	double max_val,pixel_num;
-	double certainties[COLORS_NUM+1];
 	byte h, s, v;
 	readOnlyColors clr_plane = ReadableColors();
 
@@ -882,7 +1122,7 @@ void ImageMatrix::GetColorStatistics(double *hue_avg_p, double *hue_std_p, doubl
 			val_avg += delta/pixel_index;
 			M2v += delta * (v - val_avg);
 
-			color_index=FindColor(h,s,v,certainties);
+			color_index=FindColorLUT(h,s,v,NULL);
 			colors[color_index]+=1;
 		}
 	}
@@ -926,7 +1166,6 @@ void ImageMatrix::ColorTransform (const ImageMatrix &matrix_IN) {
 	double max_range = pow((double)2,8)-1;
 	HSVcolor hsv_pixel;
 	unsigned long color_index=0;   
-	double certainties[COLORS_NUM+1];
 
 	copyFields (matrix_IN);
 	// The result is an intensity image, so eliminate the color plane
@@ -939,7 +1178,7 @@ void ImageMatrix::ColorTransform (const ImageMatrix &matrix_IN) {
 	for( y = 0; y < height; y++ ) {
 		for( x = 0; x < width; x++ ) { 
 			hsv_pixel = clr_plane (y, x);
-			color_index = FindColor( hsv_pixel.h,  hsv_pixel.s, hsv_pixel.v, certainties );
+			color_index = FindColorLUT( hsv_pixel.h,  hsv_pixel.s, hsv_pixel.v, NULL );
 			// convert the color index to a greyscale value
 			cb_intensity = int( ( max_range * color_index ) / COLORS_NUM );
 			out_plane (y, x) = stats.add (cb_intensity);
@@ -965,6 +1204,39 @@ void ImageMatrix::HueTransform (const ImageMatrix &matrix_IN) {
 	}
 }
 
+/* LevelCounts
+   For a plane of integer levels (has_int_levels), count the pixels at each level from min_level to max_level,
+   which must span all the pixel values: counts[l] is the number of pixels equal to min_level + l.
+   This lets histogram-based methods on the untransformed image bin each level once rather than each pixel.
+   Returns false, leaving counts empty, if the plane is not made of integer levels.
+*/
+bool ImageMatrix::LevelCounts (std::vector<unsigned long> &counts, double min_level, double max_level) const {
+	counts.clear();
+	if (!has_int_levels || !(max_level - min_level < MAX_INT_LEVELS)) return (false);
+
+	unsigned int x, y;
+	counts.resize ((size_t)(max_level - min_level) + 1, 0);
+	for (y = 0; y < height; y++) {
+		const pixDataType *pixels = data_ptr() + (size_t)y * stride();
+		for (x = 0; x < width; x++) counts[(size_t)(pixels[x] - min_level)]++;
+	}
+	return (true);
+}
+
+/* bin the level counts from LevelCounts exactly as histogram() bins the pixels */
+static void LevelHistogram (const std::vector<unsigned long> &counts, double min_level,
+	double *bins, unsigned short nbins, double h_min, double h_scale) {
+	unsigned long bin;
+
+	memset(bins, 0, nbins * sizeof (double));
+	for (size_t level = 0; level < counts.size(); level++) {
+		if (!counts[level]) continue;
+		bin = (unsigned long)(( ((min_level + level) - h_min)*h_scale));
+		if (bin >= nbins) bin = nbins-1;
+		bins[bin] += counts[level];
+	}
+}
+
 /* get image histogram */
 void ImageMatrix::histogram(double *bins,unsigned short nbins, bool imhist, const Moments2 &in_stats) const {
 	unsigned long a, bin, num = width*height;
@@ -988,15 +1260,24 @@ void ImageMatrix::histogram(double *bins,unsigned short nbins, bool imhist, cons
 	if (h_max-h_min > 0) h_scale = (double)nbins / double(h_max-h_min);
 	else h_scale = 0;
 
+	// integer levels are binned per level
+	std::vector<unsigned long> counts;
+	if (LevelCounts (counts, h_min, h_max)) {
+		LevelHistogram (counts, h_min, bins, nbins, h_min, h_scale);
+		return;
+	}
+
 	// initialize the bins
 	memset(bins, 0, nbins * sizeof (double));
 
    // build the histogram
-	for (a = 0; a < num; a++) {
-		val = pix_plane.array().coeff(a);
-		bin = (unsigned long)(( (val - h_min)*h_scale));
-		if (bin >= nbins) bin = nbins-1;
-		bins[bin] += 1.0;
+	for (unsigned int y = 0; y < height; y++) {
+		for (unsigned int x = 0; x < width; x++) {
+			val = pix_plane(y,x);
+			bin = (unsigned long)(( (val - h_min)*h_scale));
+			if (bin >= nbins) bin = nbins-1;
+			bins[bin] += 1.0;
+		}
 	}
 
 	return;
@@ -1009,12 +1290,16 @@ double ImageMatrix::fft2 (const ImageMatrix &matrix_IN) {
 	unsigned int half_height = matrix_IN.height/2+1;
 
 	copyFields (matrix_IN);
+	// The result is a gray image, so eliminate the color plane
+	ColorMode = cmGRAY;
 	allocate (matrix_IN.width, matrix_IN.height);
 	writeablePixels out_plane = WriteablePixels();
 	readOnlyPixels in_plane = matrix_IN.ReadablePixels();
 
 	double *in = (double*) fftw_malloc(sizeof(double) * width*height);
  	fftw_complex *out = (fftw_complex*) fftw_malloc(sizeof(fftw_complex) * width*height);
+	// The FFTW planner is not thread-safe, only fftw_execute is.
+#pragma omp critical (fftw_planner)
 	p = fftw_plan_dft_r2c_2d(width,height,in,out, FFTW_MEASURE); // FFTW_ESTIMATE: deterministic
 	unsigned int x,y;
  	for (x=0;x<width;x++)
@@ -1042,6 +1327,7 @@ double ImageMatrix::fft2 (const ImageMatrix &matrix_IN) {
  			out_plane (y,x) = stats.add (out_plane (height - y, width - x));
 
 	// clean up
+#pragma omp critical (fftw_planner)
 	fftw_destroy_plan(p);
 	fftw_free(in);
 	fftw_free(out);
@@ -1092,6 +1378,8 @@ void ImageMatrix::ChebyshevTransform(const ImageMatrix &matrix_IN, unsigned int
 	unsigned int x,y;
 
 	copyFields (matrix_IN);
+	// The result is a gray image, so eliminate the color plane
+	ColorMode = cmGRAY;
 
 	if (N<2)
 		N = MIN( width, height );
@@ -1116,7 +1404,8 @@ void ImageMatrix::ChebyshevFourierTransform2D(double *coeff) const {
 	const ImageMatrix *const_matrix;
 	if( (width * height) > (300 * 300) ) {
 		matrix = new ImageMatrix;
-		matrix->copy (*this);
+		matrix->copyFields (*this);
+		matrix->ColorMode = cmGRAY;
 		matrix->Downsample(*this, MIN( 300.0/(double)width, 300.0/(double)height ), MIN( 300.0/(double)width, 300.0/(double)height ) );  /* downsample for avoiding memory problems */
 		const_matrix = matrix;
 	} else {
@@ -1127,31 +1416,24 @@ void ImageMatrix::ChebyshevFourierTransform2D(double *coeff) const {
 }
 
 
-/* Symlet5 transform */
+/* Symlet5 transform
+   Single-level decomposition done directly on the contiguous pixel plane
+*/
 void ImageMatrix::Symlet5Transform(const ImageMatrix &matrix_IN) {
 	unsigned int x,y;
-	DataGrid *grid=NULL;
-	Symlet5 *Sym5;
+	Symlet5 Sym5(0,1);
 
 	copyFields (matrix_IN);
-	readOnlyPixels in_plane = matrix_IN.ReadablePixels();
-
-	grid = new DataGrid2D(width,height,-1);
-  
-	for (y=0;y<height;y++)
-		for(x=0;x<width;x++)
-			grid->setData(x,y,-1,in_plane(y,x));
-	Sym5=new Symlet5(0,1);
-	Sym5->transform2D(grid);
-	
-	allocate (grid->getX(), grid->getY());
+	// The result is a gray image, so eliminate the color plane
+	ColorMode = cmGRAY;
+	allocate (2 * (int) floor((matrix_IN.width + Sym5.dec_len - 1) / 2.),
+		2 * (int) floor((matrix_IN.height + Sym5.dec_len - 1) / 2.));
 	writeablePixels out_plane = WriteablePixels();
+	Sym5.transform2D (matrix_IN.data_ptr(), matrix_IN.width, matrix_IN.height, matrix_IN.stride(), out_plane.data());
+
 	for (y=0;y<height;y++)
 		for(x=0;x<width;x++)
-			out_plane (y,x) = stats.add (grid->getData(x,y,-1));
-		 
-	delete Sym5;
-	delete grid;
+			stats.add (out_plane (y,x));
 }
 
 /* chebyshev statistics
@@ -1183,6 +1465,8 @@ void ImageMatrix::EdgeTransform (const ImageMatrix &matrix_IN) {
 	double max_x=0,max_y=0;
 
 	copyFields (matrix_IN);
+	// The result is a gray image, so eliminate the color plane
+	ColorMode = cmGRAY;
 	allocate (matrix_IN.width, matrix_IN.height);
 
 	readOnlyPixels in_plane = matrix_IN.ReadablePixels();
@@ -1206,6 +1490,8 @@ void ImageMatrix::PrewittMagnitude2D (const ImageMatrix &matrix_IN) {
 	double sumx,sumy;
 
 	copyFields (matrix_IN);
+	// The result is a gray image, so eliminate the color plane
+	ColorMode = cmGRAY;
 	allocate (matrix_IN.width, matrix_IN.height);
 	w = width;
 	h = height;
@@ -1242,6 +1528,8 @@ void ImageMatrix::PrewittDirection2D(const ImageMatrix &matrix_IN) {
 	double sumx,sumy;
 
 	copyFields (matrix_IN);
+	// The result is a gray image, so eliminate the color plane
+	ColorMode = cmGRAY;
 	allocate (matrix_IN.width, matrix_IN.height);
 	w = width;
 	h = height;
@@ -1290,7 +1578,7 @@ void ImageMatrix::EdgeStatistics(unsigned long *EdgeArea, double *MagMean, doubl
 	double *MagHist, double *DirecMean, double *DirecMedian, double *DirecVar, double *DirecHist,
 	double *DirecHomogeneity, double *DiffDirecHist, unsigned int nbins) const {
 
-	unsigned int a,bin_index;
+	unsigned int a,x,y,bin_index;
 	double min_val,max_val,sum, level;
 
 	ImageMatrix GradientMagnitude;
@@ -1315,8 +1603,9 @@ void ImageMatrix::EdgeStatistics(unsigned long *EdgeArea, double *MagMean, doubl
 	level = *MagMean;
 	// level = min_val + ((max_val-min_val)/2.0);   // level=duplicate->OtsuBinaryMaskTransform()   // level=MagMean
 
-	for (a = 0; a < GradientMagnitude.height*GradientMagnitude.width; a++)
-		if (GM_pix_plane.array().coeff(a) > level) (*EdgeArea)+=1; /* find the edge area */
+	for (y = 0; y < GradientMagnitude.height; y++)
+		for (x = 0; x < GradientMagnitude.width; x++)
+			if (GM_pix_plane(y,x) > level) (*EdgeArea)+=1; /* find the edge area */
 //   GradientMagnitude->OtsuBinaryMaskTransform();
 
 	/* find direction statistics */
@@ -1348,28 +1637,22 @@ void ImageMatrix::EdgeStatistics(unsigned long *EdgeArea, double *MagMean, doubl
    vec -array of double- output column. a pre-allocated vector of the size 3*4=12
 */
 void ImageMatrix::RadonTransform2D(double *vec) const {
-	unsigned int x,y,val_index,output_size,vec_index;
-	double *pixels,*ptr,bins[3];
+	unsigned int val_index,output_size,vec_index;
+	double *ptr,bins[3];
 	int angle,num_angles=4;
 	double theta[4]={0,45,90,135};
 	int rLast,rFirst;
 	rLast = (int) ceil(sqrt(pow( (double)(width-1-(width-1)/2),2)+pow( (double)(height-1-(height-1)/2),2))) + 1;
 	rFirst = -rLast;
 	output_size=rLast-rFirst+1;
-	readOnlyPixels pix_plane = ReadablePixels();
 
 	ptr = new double[output_size*num_angles];
 	for (val_index = 0; val_index < output_size*num_angles; val_index++)
 		ptr[val_index] = 0;  /* initialize the output vector */
 
-    pixels=new double[width*height];
     vec_index = 0;
 
-	for (x = 0; x < width; x++)
-		for (y = 0; y < height; y++)
-			pixels[y+height*x] = pix_plane(y,x);
-
-    radon(ptr,pixels, theta, height, width, (width-1)/2, (height-1)/2, num_angles, rFirst, output_size);
+    radon(ptr, data_ptr(), stride(), theta, height, width, (width-1)/2, (height-1)/2, num_angles, rFirst, output_size);
 
 	for (angle = 0; angle < num_angles; angle++) {
 		//radon(ptr,pixels, &theta, height, width, (width-1)/2, (height-1)/2, 1, rFirst, output_size);
@@ -1396,45 +1679,30 @@ void ImageMatrix::RadonTransform2D(double *vec) const {
 			vec[vec_index++] = bins[bin];
 	}
 	vd_RadonTextures(vec);
-	delete [] pixels;
 	delete [] ptr;
 }
 
 //-----------------------------------------------------------------------------------
-/* Otsu
-   Find otsu threshold
+/* OtsuLevel
+   Find the otsu threshold in a histogram of OTSU_LEVELS bins of num_pixels pixels.
+   The returned value is a histogram index.
 */
-double ImageMatrix::Otsu(bool dynamic_range) const {
+#define OTSU_LEVELS 1024
+static int OtsuLevel (const double *hist, unsigned int num_pixels) {
      /* binarization by Otsu's method 
 	based on maximization of inter-class variance */
-#define OTSU_LEVELS 1024
-	double hist[OTSU_LEVELS];
 	double omega[OTSU_LEVELS];
 	double myu[OTSU_LEVELS];
 	double max_sigma, sigma[OTSU_LEVELS]; // inter-class variance
 	int i;
 	int threshold;
-    double min_val,max_val; // pixel range
 
-	if (!dynamic_range) {
-		histogram(hist,OTSU_LEVELS,true);
-		min_val = 0.0;
-		max_val = pow(2.0,bits)-1;
-	} else {
-		// to keep this const method from modifying the object, we use GetStats on a local Moments2 object
-		Moments2 local_stats;
-		GetStats (local_stats);
-		min_val = local_stats.min();
-		max_val = local_stats.max();
-		histogram(hist,OTSU_LEVELS,false);
-	}
-  
 	// omega & myu generation
-	omega[0] = hist[0] / (width * height);
+	omega[0] = hist[0] / num_pixels;
 	myu[0] = 0.0;
 	for (i = 1; i < OTSU_LEVELS; i++) {
-		omega[i] = omega[i-1] + (hist[i] / (width * height));
-		myu[i] = myu[i-1] + i*(hist[i] / (width * height));
+		omega[i] = omega[i-1] + (hist[i] / num_pixels);
+		myu[i] = myu[i-1] + i*(hist[i] / num_pixels);
 	}
   
 	// maximization of inter-class variance
@@ -1451,6 +1719,30 @@ double ImageMatrix::Otsu(bool dynamic_range) const {
 			threshold = i;
 		}
 	}
+	return (threshold);
+}
+
+/* Otsu
+   Find otsu threshold
+*/
+double ImageMatrix::Otsu(bool dynamic_range) const {
+	double hist[OTSU_LEVELS];
+	int threshold;
+    double min_val,max_val; // pixel range
+
+	if (!dynamic_range) {
+		histogram(hist,OTSU_LEVELS,true);
+		min_val = 0.0;
+		max_val = pow(2.0,bits)-1;
+	} else {
+		// to keep this const method from modifying the object, we use GetStats on a local Moments2 object
+		Moments2 local_stats;
+		GetStats (local_stats);
+		min_val = local_stats.min();
+		max_val = local_stats.max();
+		histogram(hist,OTSU_LEVELS,false);
+	}
+	threshold = OtsuLevel (hist, width * height);
 
 	// threshold is a histogram index - needs to be scaled to a pixel value.
 	return ( (((double)threshold / (double)(OTSU_LEVELS-1)) * (max_val - min_val)) + min_val );
@@ -1465,6 +1757,8 @@ double ImageMatrix::OtsuBinaryMaskTransform (const ImageMatrix &matrix_IN) {
 	double OtsuGlobalThreshold;
 
 	copyFields (matrix_IN);
+	// The result is a gray image, so eliminate the color plane
+	ColorMode = cmGRAY;
 	allocate (matrix_IN.width, matrix_IN.height);
 
 	writeablePixels out_plane = WriteablePixels();
@@ -1473,9 +1767,10 @@ double ImageMatrix::OtsuBinaryMaskTransform (const ImageMatrix &matrix_IN) {
 	OtsuGlobalThreshold = matrix_IN.Otsu();
 
 	/* classify the pixels by the threshold */
-	for (unsigned int a = 0; a < width*height; a++)
-		if (in_plane.array().coeff(a) > OtsuGlobalThreshold) (out_plane.array())(a) = stats.add (1);
-		else (out_plane.array())(a) = stats.add (0);
+	for (unsigned int y = 0; y < height; y++)
+		for (unsigned int x = 0; x < width; x++)
+			if (in_plane(y,x) > OtsuGlobalThreshold) out_plane(y,x) = stats.add (1);
+			else out_plane(y,x) = stats.add (0);
 
 	return(OtsuGlobalThreshold);
 }
@@ -1499,108 +1794,87 @@ void ImageMatrix::centroid(double *x_centroid, double *y_centroid) const {
 //--------------------------------------------------------
 
 /*
-  FeatureStatistics
-  Find feature statistics. Before calling this function the image should be transformed into a binary
-  image using "OtsuBinaryMaskTransform".
-
-  count -int *- the number of objects detected in the binary image
-  Euler -int *- the euler number (number of objects - number of holes
-  centroid_x -int *- the x coordinate of the centroid of the binary image
-  centroid_y -int *- the y coordinate of the centroid of the binary image
-  AreaMin -int *- the smallest area
-  AreaMax -int *- the largest area
-  AreaMean -int *- the mean of the areas
-  AreaMedian -int *- the median of the areas
-  AreaVar -int *- the variance of the areas
-  DistMin -int *- the smallest distance
-  DistMax -int *- the largest distance
-  DistMean -int *- the mean of the distance
-  DistMedian -int *- the median of the distances
-  DistVar -int *- the variance of the distances
-
+  OtsuObjectStatistics
+  Statistics of the objects in the Otsu binary mask of the image (objects), and of the objects
+  in the Otsu binary mask of the inverted image (inv_objects). Either can be NULL.
+  This is equivalent to OtsuBinaryMaskTransform, BWlabel and FeatureCentroid on a copy of the image
+  (and on an inverted copy), but neither the inverted image nor the masks are built as ImageMatrix objects:
+  A single sweep histograms the image for both thresholds, a second sweep builds both masks
+  as bits of one byte plane, and each mask is labeled and measured in one flood-fill pass.
+  For integer-level images, the histograms and the masks are built per level instead of per pixel.
+  Inverted pixel values are computed on the fly exactly as invert() computes them.
 */
+void ImageMatrix::OtsuObjectStatistics (ObjectStatistics *objects, ObjectStatistics *inv_objects) const {
+	unsigned int a, num = width * height;
+	unsigned int x = 0, y = 0; // the pixel at a when sweeping the pixels rather than the level counts
+	unsigned long bin;
+	double hist[OTSU_LEVELS], inv_hist[OTSU_LEVELS];
+	double val, inv_val, threshold = 0, inv_threshold = 0;
+	readOnlyPixels pix_plane = ReadablePixels();
 
-int compare_ulongs (const void *a, const void *b) {
-	if (*((unsigned long *)a) > *((unsigned long *)b)) return(1);
-	if (*((unsigned long *)a) == *((unsigned long *)b)) return(0);
-	return(-1);
-}
-
-void ImageMatrix::FeatureStatistics(unsigned long *count, long *Euler, double *centroid_x, double *centroid_y, unsigned long *AreaMin, unsigned long *AreaMax,
-	double *AreaMean, unsigned int *AreaMedian, double *AreaVar, unsigned int *area_histogram,double *DistMin, double *DistMax,
-	double *DistMean, double *DistMedian, double *DistVar, unsigned int *dist_histogram, unsigned int nbins
-) const {
-	unsigned long object_index, bin;
-	double sum_areas,sum_dists;
-	ImageMatrix BWImage;
-	unsigned long *object_areas;
-	double *centroid_dists, sum_dist, hist_scale;
-
-	BWImage.OtsuBinaryMaskTransform(*this);
-	BWImage.centroid(centroid_x,centroid_y);
-	*count = BWImage.BWlabel(8);
-	*Euler=EulerNumber(BWImage,8);
-
-	// calculate the areas 
-	sum_areas = 0;
-	sum_dists = 0;
-	object_areas = new unsigned long[*count];
-	centroid_dists = new double[*count];
-	for (object_index = 0; object_index < *count; object_index++) {
-		double x_centroid,y_centroid;
-		object_areas[object_index] = FeatureCentroid(BWImage, object_index+1, &x_centroid, &y_centroid);
-		centroid_dists[object_index] = sqrt(pow(x_centroid-(*centroid_x),2) + pow(y_centroid - (*centroid_y),2));
-		sum_areas += object_areas[object_index];
-		sum_dists += centroid_dists[object_index];
-	}
-
-	// compute area statistics
-	qsort(object_areas,*count,sizeof(unsigned long),compare_ulongs);
-	*AreaMin=object_areas[0];
-	*AreaMax=object_areas[*count-1];
-	if (*count>0) *AreaMean=sum_areas/(*count);
-	else *AreaMean=0;
-	*AreaMedian=(unsigned int)(object_areas[(*count)/2]);
-	memset (area_histogram, 0, nbins * sizeof (int));
-	if ((*AreaMax - *AreaMin) > 0) hist_scale = (double)nbins / double(*AreaMax - *AreaMin);
-	else hist_scale = 0;
-	/* compute the variance and the histogram */
-	sum_areas = 0;
-	if (*AreaMax - *AreaMin > 0) {
-		for (object_index = 0; object_index < *count; object_index++) {
-			sum_areas += pow(object_areas[object_index] - *AreaMean,2);
-			bin = (unsigned long)( ((double)object_areas[object_index] - *AreaMin) * hist_scale);
-			if (bin >= nbins) bin = nbins - 1;
-			area_histogram[bin] += 1;
+	// to keep this const method from modifying the object, we use GetStats on a local Moments2 object
+	Moments2 local_stats;
+	GetStats (local_stats);
+	double min_val = local_stats.min(), max_val = local_stats.max();
+	// invert() maps v to (max_val - v) + min_val, which is monotonic, so these are the inverted image's min and max
+	double inv_min_val = (max_val - max_val) + min_val, inv_max_val = (max_val - min_val) + min_val;
+	double h_scale = 0, inv_h_scale = 0;
+	if (max_val - min_val > 0) h_scale = (double)OTSU_LEVELS / double(max_val - min_val);
+	if (inv_max_val - inv_min_val > 0) inv_h_scale = (double)OTSU_LEVELS / double(inv_max_val - inv_min_val);
+
+	// histogram the image and its inverse in one sweep (or from the level counts of an integer-level image)
+	std::vector<unsigned long> counts;
+	bool int_levels = LevelCounts (counts, min_val, max_val);
+	memset (hist, 0, OTSU_LEVELS * sizeof (double));
+	memset (inv_hist, 0, OTSU_LEVELS * sizeof (double));
+	for (a = 0; a < (int_levels ? counts.size() : num); a++) {
+		double n_pixels = 1.0;
+		if (int_levels) {
+			if (!counts[a]) continue;
+			val = min_val + a;
+			n_pixels = counts[a];
+		} else {
+			val = pix_plane(y,x);
+			if (++x == width) { x = 0; y++; }
+		}
+		if (objects) {
+			bin = (unsigned long)(( (val - min_val)*h_scale));
+			if (bin >= OTSU_LEVELS) bin = OTSU_LEVELS-1;
+			hist[bin] += n_pixels;
+		}
+		if (inv_objects) {
+			inv_val = (max_val - val) + min_val;
+			bin = (unsigned long)(( (inv_val - inv_min_val)*inv_h_scale));
+			if (bin >= OTSU_LEVELS) bin = OTSU_LEVELS-1;
+			inv_hist[bin] += n_pixels;
 		}
 	}
-	if (*count > 1) *AreaVar=sum_areas / ((*count)-1);
-	else *AreaVar=sum_areas;
-
-   /* compute distance statistics */
-	qsort(centroid_dists,*count,sizeof(double),compare_doubles);
-	*DistMin=centroid_dists[0];
-	*DistMax=centroid_dists[*count-1];
-	if (*count>0) *DistMean=sum_dists/(*count);
-	else *DistMean=0;
-	*DistMedian=centroid_dists[(*count)/2];
-	memset (dist_histogram, 0, nbins * sizeof (int));
-	if ((*DistMax - *DistMin) > 0) hist_scale = (double)nbins / double(*DistMax - *DistMin);
-	else hist_scale = 0;
-
-   /* compute the variance and the histogram */
-	sum_dist=0;
-	for (object_index = 0; object_index < *count; object_index++) {
-		sum_dist += pow(centroid_dists[object_index] - *DistMean,2);
-		bin = (unsigned long)((centroid_dists[object_index] - *DistMin) * hist_scale);
-		if (bin >= nbins) bin = nbins - 1;
-		dist_histogram[bin] += 1;
+	if (objects) threshold = ((((double)OtsuLevel (hist, num) / (double)(OTSU_LEVELS-1)) * (max_val - min_val)) + min_val);
+	if (inv_objects) inv_threshold = ((((double)OtsuLevel (inv_hist, num) / (double)(OTSU_LEVELS-1)) * (inv_max_val - inv_min_val)) + inv_min_val);
+
+	// both masks in one byte plane: bit 0 for the image, bit 1 for its inverse
+	PooledArray<unsigned char> mask (num);
+	if (int_levels) {
+		std::vector<unsigned char> mask_lut (counts.size(), 0);
+		for (a = 0; a < counts.size(); a++) {
+			val = min_val + a;
+			if (objects && val > threshold) mask_lut[a] |= 1;
+			if (inv_objects && (max_val - val) + min_val > inv_threshold) mask_lut[a] |= 2;
+		}
+		MapLevels (&(mask_lut[0]), min_val, mask.data());
+	} else {
+		for (a = 0, y = 0; y < height; y++) {
+			for (x = 0; x < width; x++, a++) {
+				val = pix_plane(y,x);
+				mask[a] = 0;
+				if (objects && val > threshold) mask[a] |= 1;
+				if (inv_objects && (max_val - val) + min_val > inv_threshold) mask[a] |= 2;
+			}
+		}
 	}
-	if (*count>1) *DistVar=sum_dist/((*count)-1);
-	else *DistVar=sum_dist;
 
-	delete [] object_areas;
-	delete [] centroid_dists;
+	if (objects) MaskObjectStatistics (mask, 1, width, height, objects);
+	if (inv_objects) MaskObjectStatistics (mask, 2, width, height, inv_objects);
 }
 
 /* GaborFilters */
@@ -1632,10 +1906,19 @@ void ImageMatrix::MultiScaleHistogram(double *out) const {
 	double max_val=0;
 	Moments2 local_moments;
 	GetStats (local_moments);
-	histogram (out,        3, false, local_moments);
-	histogram (&(out[3]),  5, false, local_moments);
-	histogram (&(out[8]),  7, false, local_moments);
-	histogram (&(out[15]), 9, false, local_moments);
+	// integer levels are counted once for all four histograms
+	std::vector<unsigned long> counts;
+	double h_min = local_moments.min(), h_max = local_moments.max();
+	if (LevelCounts (counts, h_min, h_max)) {
+		unsigned short nbins;
+		for (nbins = 3, a = 0; nbins <= 9; a += nbins, nbins += 2)
+			LevelHistogram (counts, h_min, &(out[a]), nbins, h_min, (h_max-h_min > 0 ? (double)nbins / double(h_max-h_min) : 0));
+	} else {
+		histogram (out,        3, false, local_moments);
+		histogram (&(out[3]),  5, false, local_moments);
+		histogram (&(out[8]),  7, false, local_moments);
+		histogram (&(out[15]), 9, false, local_moments);
+	}
 	for (a = 0; a < 24; a++)
 		if (out[a] > max_val) max_val = out[a];
 	for (a = 0; a < 24; a++)
@@ -37,6 +37,8 @@
 #undef NDEBUG
 #include <assert.h>
 #include <string> // for source field
+#include <vector>
+#include "config.h" // for FLOAT_PIXELS
 #include "Eigen/Dense"
 #include "colors/FuzzyCalc.h"
 #include "statistics/Moments.h"
@@ -46,9 +48,11 @@
 
 #define INF 10E200
 #define EPSILON 10E-20
+#define MAX_INT_LEVELS 65536  // the most levels an integer-level plane can have (16 bits)
 
 // Forward declarations
 class ImageTransform;
+typedef struct tiff TIFF;
 
 typedef unsigned char byte;
 typedef struct {
@@ -65,9 +69,18 @@ typedef MatrixXhsv clrDataMat;
 enum ColorModes { cmRGB, cmHSV, cmGRAY };
 
 
-typedef Eigen::Matrix< double, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor > pixDataMat;
-typedef Eigen::Map< pixDataMat, Eigen::Aligned > pixDataMap;
-typedef Eigen::Map< clrDataMat, Eigen::Aligned > clrDataMap;
+// Pixel planes are stored as doubles, or as floats when configured with --enable-float-pixels.
+// Pixel values are read out as doubles, and the stats, histograms and feature computations still accumulate in double.
+#ifdef FLOAT_PIXELS
+typedef float pixDataType;
+#else
+typedef double pixDataType;
+#endif
+typedef Eigen::Matrix< pixDataType, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor > pixDataMat;
+// Planes are mapped with a row stride, so that an ImageMatrix can also be a read-only view of
+// a rectangle within another ImageMatrix's planes (see submatrix_view).
+typedef Eigen::Map< pixDataMat, Eigen::Unaligned, Eigen::OuterStride<> > pixDataMap;
+typedef Eigen::Map< clrDataMat, Eigen::Unaligned, Eigen::OuterStride<> > clrDataMap;
 typedef pixDataMap pixData;
 typedef clrDataMap clrData;
 
@@ -79,6 +92,24 @@ typedef struct {
 	int x,y,w,h;
 } rect;
 
+/* Statistics of the objects in an Otsu-thresholded image (see ImageMatrix::OtsuObjectStatistics)
+  count - the number of 8-connected objects
+  Euler - the euler number (number of objects - number of holes)
+  centroid_x, centroid_y - the centroid of the binary mask
+  Area*, Dist* - min, max, mean, median, variance and histogram of the object areas,
+    and of the object centroid distances from the mask centroid
+*/
+#define OBJECT_STATS_NBINS 10
+typedef struct {
+	unsigned long count, AreaMin, AreaMax;
+	long Euler;
+	double centroid_x, centroid_y;
+	double AreaMean, AreaVar;
+	unsigned int AreaMedian, area_histogram[OBJECT_STATS_NBINS];
+	double DistMin, DistMax, DistMean, DistMedian, DistVar;
+	unsigned int dist_histogram[OBJECT_STATS_NBINS];
+} ObjectStatistics;
+
 //---------------------------------------------------------------------------
 // global functions
 #define MIN(a,b) (a<b?a:b)
@@ -166,6 +197,7 @@ private:
 	clrData _clr_plane;                              // 3-channel color data
 	bool _is_pix_writeable;
 	bool _is_clr_writeable;
+	bool _is_view;                                   // the planes belong to another ImageMatrix (see submatrix_view)
 	double _median;
 public:
 	std::string source;                             // path of image source file
@@ -174,12 +206,15 @@ public:
 	unsigned int width,height;                               // width and height of the picture
 	Moments2 stats;        // min, max, mean, std computed in single pass, median in separate pass
 	bool has_median;                     // if the median has been computed
-	const double *data_ptr() const { return _pix_plane.data(); }
-	double *writable_data_ptr() { return _pix_plane.data(); }	
+	bool has_int_levels;                 // if the pixels are the integer levels of an 8 or 16-bit source (see LevelCounts)
+	const pixDataType *data_ptr() const { return _pix_plane.data(); }
+	pixDataType *writable_data_ptr() { return _pix_plane.data(); }	
+	unsigned int stride() const { return (unsigned int)_pix_plane.outerStride(); } // elements between the starts of successive rows
 	
 	inline writeablePixels WriteablePixels() {
 		assert(_is_pix_writeable && "Attempt to write to read-only pixels");
 		has_median = false;
+		has_int_levels = false;
 		stats.reset();
 		return _pix_plane;
 	}
@@ -211,23 +246,27 @@ public:
 	void WriteableColorsFinish () {
 		_is_clr_writeable = false;
 	}
-	int LoadTIFF(char *filename);                   // load from TIFF file
+	int LoadTIFF(char *filename, bool load_colors = true); // load from TIFF file, optionally without the color plane
+	int LoadTIFFPage(TIFF *tif, bool load_colors = true);  // load the current page (directory) of an open TIFF
 	int SaveTiff(char *filename);                   // save a matrix in TIF format
 	virtual int OpenImage(char *image_file_name,            // load an image of any supported format
 		int downsample, rect *bounding_rect,
-		double mean, double stddev);
+		double mean, double stddev, bool load_colors = true);
+	void preprocess(int downsample, rect *bounding_rect, double mean, double stddev); // bounding rect, downsample and normalize as in OpenImage
 	// constructor helpers
 	void init();
-	void remap_pix_plane (double *ptr, const unsigned int w, const unsigned int h);
-	void remap_clr_plane (HSVcolor *ptr, const unsigned int w, const unsigned int h);
+	void remap_pix_plane (pixDataType *ptr, const unsigned int w, const unsigned int h, const unsigned int stride = 0);
+	void remap_clr_plane (HSVcolor *ptr, const unsigned int w, const unsigned int h, const unsigned int stride = 0);
 	virtual void allocate (unsigned int w, unsigned int h);
 	void copyFields(const ImageMatrix &copy);
 	void copyData(const ImageMatrix &copy);
 	void copy(const ImageMatrix &copy);
 	void submatrix(const ImageMatrix &matrix,
 		const unsigned int x1, const unsigned int y1, const unsigned int x2, const unsigned int y2);
+	void submatrix_view(const ImageMatrix &matrix,
+		const unsigned int x1, const unsigned int y1, const unsigned int x2, const unsigned int y2);
 	// N.B.: See note in implementation
-	ImageMatrix () : _pix_plane (NULL,0,0), _clr_plane (NULL,0,0) {
+	ImageMatrix () : _pix_plane (NULL,0,0,Eigen::OuterStride<>(0)), _clr_plane (NULL,0,0,Eigen::OuterStride<>(0)) {
 		init();
 	};
 	virtual ~ImageMatrix();                                 // destructor
@@ -274,6 +313,16 @@ public:
 	void ColorTransform(const ImageMatrix &matrix_IN);
 	void HueTransform(const ImageMatrix &matrix_IN);
 	void histogram(double *bins,unsigned short nbins, bool imhist = false, const Moments2 &in_stats = Moments2()) const; // by default, based on computed min and max.
+	bool LevelCounts (std::vector<unsigned long> &counts, double min_level, double max_level) const;
+	// Map each pixel of an integer-level plane through a per-level table into a contiguous width x height out array:
+	// out[i] = lut[pixel[i] - min_level]
+	template <typename T> void MapLevels (const T *lut, double min_level, T *out) const {
+		unsigned int x, y;
+		for (y = 0; y < height; y++) {
+			const pixDataType *pixels = _pix_plane.data() + (size_t)y * stride();
+			for (x = 0; x < width; x++) *out++ = lut[(size_t)(pixels[x] - min_level)];
+		}
+	}
     double Otsu(bool dynamic_range=true) const;                                  /* Otsu grey threshold                  */
 	void MultiScaleHistogram(double *out) const;
 	//   double AverageEdge();
@@ -293,20 +342,45 @@ public:
 	double OtsuBinaryMaskTransform (const ImageMatrix &matrix_IN);
 	unsigned long BWlabel(int level);
 	void centroid(double *x_centroid, double *y_centroid) const;
-	void FeatureStatistics(unsigned long *count, long *Euler, double *centroid_x, double *centroid_y, unsigned long *AreaMin, unsigned long *AreaMax,
-		double *AreaMean, unsigned int *AreaMedian, double *AreaVar, unsigned int *area_histogram,double *DistMin, double *DistMax,
-		double *DistMean, double *DistMedian, double *DistVar, unsigned int *dist_histogram, unsigned int nbins
-	) const;
+	void OtsuObjectStatistics (ObjectStatistics *objects, ObjectStatistics *inv_objects) const;
 	void GaborFilters2D(double *ratios) const;
 	void HaralickTexture2D(double distance, double *out) const;
 	void TamuraTexture2D(double *vec) const;
 	void zernike2D(double *zvalues, long *output_size) const;
 
+protected:
+	// Subclasses that keep their planes in their own memory (e.g. MappedImageMatrix) use these to manage the plane maps.
+	void release_planes ();  // return owned planes to the PlanePool (or drop a view's planes), leaving both planes empty
+	void drop_planes ();     // empty both planes without deallocating them
+
 	// disable the copy constructor
 private:
-    ImageMatrix(const ImageMatrix &matrix) : _pix_plane (NULL,0,0), _clr_plane (NULL,0,0) {
+    ImageMatrix(const ImageMatrix &matrix) : _pix_plane (NULL,0,0,Eigen::OuterStride<>(0)), _clr_plane (NULL,0,0,Eigen::OuterStride<>(0)) {
 		assert(false && "Attempt to use copy constructor");
 	};
 };
 
+/*! TIFFPageReader
+* Reads the pages (directories) of a multi-page TIFF (e.g. a z-stack or a time series) one at a time,
+* keeping the file open between pages.
+*/
+class TIFFPageReader {
+	public:
+		TIFFPageReader () : tif (NULL), n_pages (0) {};
+		~TIFFPageReader () { close(); };
+		int open (const char *filename);  // returns the number of pages, 0 if the file can't be opened
+		void close ();
+		int pages () const { return (n_pages); };
+		int read (ImageMatrix &matrix, int page,
+			int downsample, rect *bounding_rect,
+			double mean, double stddev, bool load_colors = true);
+	private:
+		TIFF *tif;
+		int n_pages;
+		std::string source;
+		// disable copies
+		TIFFPageReader (const TIFFPageReader &);
+		TIFFPageReader &operator= (const TIFFPageReader &);
+};
+
 #endif
@@ -43,6 +43,13 @@ color_type colors[COLORS_NUM+1];
 
 int rules_loaded=0;
 
+/* FindColor results indexed by quantized (h,s,v), stored as color_index+1 so that 0 means "not computed yet".
+   Images may be processed concurrently, so each thread has its own table, allocated on its first use.
+   Being calloc'ed, the table only occupies memory for the pages that get touched. */
+#define COLOR_LUT_SHIFT (8-COLOR_LUT_BITS)
+static unsigned char *color_lut = NULL;
+#pragma omp threadprivate(color_lut)
+
 char rulesfile[]="\ncolor_functions:\n\
 \n\
 red            0   0   0    11\n\
@@ -593,7 +600,7 @@ int LoadColorsFunctions(char *filename) {
 		}
 		if (strstr(p_line,"rules:")) {
 			*(strchr(p_line,'\0'))='\n';
-			return(1);
+			break;
 		}
 		if (colorfunctions && strlen(p_line) > 4) {
 			p_line=strtok(p_line," \n\t");
@@ -802,17 +809,33 @@ double CalculateRules2(double hue, double saturation, double value, int color) {
 long FindColor(short hue, short saturation, short value, double *color_certainties) {
 	double max_membership,membership;
 	int color_index,res;
-	if (!rules_loaded) {
-		char *ColorFunctionsStart,*RulesStart;
-
-		SetColors();
-		ColorFunctionsStart=strstr(rulesfile,"color_functions:");
-		RulesStart=strstr(rulesfile,"rules:");
-		if (!LoadColorsFunctions(ColorFunctionsStart) || !LoadRules(RulesStart)) {
-			printf("Could not load rules \n");
-			return(-1);
+	int loaded;
+
+	// the rules are loaded once, by whichever thread gets here first.
+	// rules_loaded is only set after the tables are filled and flushed, so a thread that reads it as set also sees the tables.
+#pragma omp atomic read
+	loaded = rules_loaded;
+#pragma omp flush
+	if (!loaded) {
+#pragma omp critical (fuzzy_rules)
+		{
+			if (!rules_loaded) {
+				char *ColorFunctionsStart,*RulesStart;
+
+				SetColors();
+				ColorFunctionsStart=strstr(rulesfile,"color_functions:");
+				RulesStart=strstr(rulesfile,"rules:");
+				if (!LoadColorsFunctions(ColorFunctionsStart) || !LoadRules(RulesStart)) {
+					printf("Could not load rules \n");
+				} else {
+#pragma omp flush
+#pragma omp atomic write
+					rules_loaded=1;
+				}
+			}
+			loaded = rules_loaded;
 		}
-		rules_loaded=1;
+		if (!loaded) return(-1);
 	}
 
 	max_membership = 0;
@@ -830,5 +853,30 @@ long FindColor(short hue, short saturation, short value, double *color_certainti
 	return(res);
 }
 //---------------------------------------------------------------------------
-
-
+/* FindColorLUT
+   Same as FindColor, but memoizes the winning color index for each (quantized) HSV triplet.
+   The certainties aren't stored in the table, so if they are requested the rules are evaluated as usual.
+*/
+long FindColorLUT(unsigned char hue, unsigned char saturation, unsigned char value, double *color_certainties) {
+	unsigned long lut_index;
+	long res;
+
+	if (color_certainties) return (FindColor (hue, saturation, value, color_certainties));
+	if (!color_lut && !(color_lut = (unsigned char *)calloc (1 << (3*COLOR_LUT_BITS), 1)))
+		return (FindColor (hue, saturation, value, NULL));
+	lut_index = ( (((unsigned long)(hue >> COLOR_LUT_SHIFT)) << (2*COLOR_LUT_BITS))
+		| (((unsigned long)(saturation >> COLOR_LUT_SHIFT)) << COLOR_LUT_BITS)
+		| (value >> COLOR_LUT_SHIFT) );
+	if (color_lut[lut_index]) return (color_lut[lut_index] - 1);
+
+	// evaluate the rules in the center of the bin (the pixel value itself when COLOR_LUT_BITS is 8)
+	res = FindColor (
+		((hue >> COLOR_LUT_SHIFT) << COLOR_LUT_SHIFT) | ((1 << COLOR_LUT_SHIFT) >> 1),
+		((saturation >> COLOR_LUT_SHIFT) << COLOR_LUT_SHIFT) | ((1 << COLOR_LUT_SHIFT) >> 1),
+		((value >> COLOR_LUT_SHIFT) << COLOR_LUT_SHIFT) | ((1 << COLOR_LUT_SHIFT) >> 1),
+		NULL
+	);
+	if (res >= 0) color_lut[lut_index] = (unsigned char)(res + 1);
+	return (res);
+}
+//---------------------------------------------------------------------------
@@ -147,6 +147,16 @@ typedef enum {clMin=-0x7fffffff-1, clMax=0x7fffffff} TColor;
 
 #define COLORS_NUM 19
 
+/* FindColorLUT keeps a table of FindColor results indexed by the (h,s,v) bytes.
+   Entries are filled on first use, so only the colors actually seen are evaluated.
+   Each thread keeps its own table.
+   COLOR_LUT_BITS is the number of bits kept per channel: 8 is exact (16MB table),
+   smaller values quantize each channel to bins evaluated at the bin center (e.g. 6 -> 256KB).
+*/
+#ifndef COLOR_LUT_BITS
+#define COLOR_LUT_BITS 8
+#endif
+
 
 typedef struct COLOR_TYPE
 {  char name[30];     /* the name of the color (e.g. "red") */
@@ -193,6 +203,7 @@ double light_value(double value);
 
 double CalculateRules2(double hue,double saturation,double value);
 long FindColor(short hue, short saturation, short value, double *certainties);
+long FindColorLUT(unsigned char hue, unsigned char saturation, unsigned char value, double *certainties);
 int color2num(char *color);
 int saturation2num(char *saturation);
 int value2num(char *value);
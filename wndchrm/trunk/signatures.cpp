@@ -28,6 +28,7 @@
 /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
 
 #include <cmath>
+#include <algorithm> // std::copy, std::fill
 #include <cfloat> // Has definition of DBL_EPSILON, FLT_EPSILON
 #include <stdio.h>
 #include <string.h>
@@ -58,7 +59,8 @@ long signatures::max_sigs = NUM_DEF_FEATURES;
 /*  signatures (constructor)
 */
 signatures::signatures() {
-	data.clear();
+	data = NULL;
+	bound = false;
 	version = 0;
 	feature_vec_type = StdFeatureComputationPlans::fv_unknown;
 	count=0;
@@ -77,8 +79,10 @@ signatures::~signatures() {
 	wf = NULL;
 }
 /* duplicate
+   row -double *- if not NULL, the copy's values are stored in this row (e.g. of a TrainingSet's feature matrix, see bind), which must hold count values.
+     If row is our own data, the copy is a view of our values, which are not copied at all: they must outlive it, and not be changed through it.
 */
-signatures *signatures::duplicate() {
+signatures *signatures::duplicate(double *row) {
 	signatures *new_samp;
 	new_samp=new signatures();
 	new_samp->sample_class=sample_class;
@@ -89,9 +93,16 @@ signatures *signatures::duplicate() {
 	new_samp->ScoresTrainingSet=ScoresTrainingSet;
 	strcpy(new_samp->full_path,full_path);
 
-	new_samp->Resize (count);
-	new_samp->data = data;
-	wf = NULL;
+	if (row) {
+		if (count > 0 && row != data) std::copy (data, data + count, row);
+		new_samp->data = row;
+		new_samp->allocated = count;
+		new_samp->bound = true;
+	} else {
+		new_samp->Resize (count);
+		if (count > 0) std::copy (data, data + count, new_samp->data);
+	}
+	new_samp->wf = NULL;
 	new_samp->version = version;
 	new_samp->feature_vec_type = feature_vec_type;
 	return(new_samp);
@@ -102,26 +113,91 @@ signatures *signatures::duplicate() {
    nsigs -size_t - number of signatures to preallocate
 */
 void signatures::Resize(size_t nsigs) {
+	if (bound && nsigs <= (size_t)allocated) return; // the row has room
+	unbind ();
 	allocated = nsigs;
-	data.resize (nsigs);
+	values.resize (nsigs);
+	data = (nsigs ? &(values[0]) : NULL);
+}
+
+/* bind
+   Use a row of a TrainingSet's feature matrix as the storage for our values (see TrainingSet::PackSamples).
+   row -double *- the row, which must stay valid until the sample is deleted, resized beyond row_size or cleared.
+   row_size -size_t- the number of values the row holds.  Values past our count are set to 0.
+*/
+void signatures::bind(double *row, size_t row_size) {
+	size_t n_values = ((size_t)count < row_size ? (size_t)count : row_size);
+	if (n_values) std::copy (data, data + n_values, row);
+	std::fill (row + n_values, row + row_size, 0.0);
+	std::vector<double>().swap (values);
+	data = row;
+	allocated = row_size;
+	bound = true;
+}
+
+void signatures::unbind() {
+	if (!bound) return;
+	values.assign (data, data + allocated);
+	data = (allocated ? &(values[0]) : NULL);
+	bound = false;
 }
 
 /* Add
    add a signature
    name -char *- the name of the signature (e.g. Multiscale Histogram bin 3)
    value -double- the value to add
+   The names and max_sigs are shared by sigs computed concurrently (see compute_plan), so this locks for each value.
+   LoadFromFilep, which adds many values, uses AddValue and publishes the names once with PublishNames instead.
 */
 void signatures::Add(const char *name,double value) {
-	if (name && *name && NamesTrainingSet) {
-		char *char_p = ((TrainingSet *)(NamesTrainingSet))->SignatureNames[count];
-		if (! *char_p) strcpy(char_p,name);
+#pragma omp critical (signature_names)
+	{
+		if (name && *name && NamesTrainingSet) {
+			char *char_p = ((TrainingSet *)(NamesTrainingSet))->SignatureNames[count];
+			if (! *char_p) strcpy(char_p,name);
+		}
+		if (count + 1 > max_sigs) {
+#pragma omp atomic write
+			max_sigs = count + 1;
+		}
 	}
-	
-	if (count == 0 && allocated == 0) Resize (max_sigs);
-	else if (count >= allocated) Resize (count + 1024);
+	AddValue (value);
+}
+
+/* AddValue
+   add a signature value, sizing the storage by max_sigs for the first one.
+   max_sigs is only read, so nothing is locked.
+*/
+void signatures::AddValue(double value) {
+	if (count == 0 && allocated == 0) {
+		long new_size;
+#pragma omp atomic read
+		new_size = max_sigs;
+		if (new_size > 0) Resize (new_size);
+	}
+	if (count >= allocated) Resize (count + 1024);
 	data[count]=value;
 	count++;
-	if (count > max_sigs) max_sigs = count;
+}
+
+/* PublishNames
+   Update max_sigs with our count, and if we have an attached NamesTrainingSet, copy the names of the values
+   starting at first_index over, but only the first time.  This takes the lock once for the whole sample.
+*/
+void signatures::PublishNames(const std::vector<std::string> &names, long first_index) {
+#pragma omp critical (signature_names)
+	{
+		if (count > max_sigs) {
+#pragma omp atomic write
+			max_sigs = count;
+		}
+		if (NamesTrainingSet) {
+			for (size_t i = 0; i < names.size(); i++) {
+				char *char_p = ((TrainingSet *)(NamesTrainingSet))->SignatureNames[first_index + i];
+				if (! *char_p && !names[i].empty()) strcpy(char_p,names[i].c_str());
+			}
+		}
+	}
 }
 
 
@@ -150,7 +226,9 @@ void signatures::SetFeatureVectorType () {
    clear all signature values
 */
 void signatures::Clear() {
-	data.clear();
+	std::vector<double>().swap (values);
+	data = NULL;
+	bound = false;
 	allocated = 0;
 	count = 0;
 	feature_vec_type = StdFeatureComputationPlans::fv_unknown;
@@ -173,16 +251,23 @@ void signatures::compute_plan (const ImageMatrix &matrix, const FeatureComputati
 	Resize (plan->n_features);
 	executor.run(&matrix, data, 0);
 	
-	// update the feature count and the max_count;
+	// update the feature count
 	count = plan->n_features;
-	if (count > max_sigs) max_sigs = count;
 	
-	// If we have an attached NamesTrainingSet, copy the feature names over, but only the first time.
-	if (NamesTrainingSet) {
-		for (int i = 0; i < count; i++) {
-			char *char_p = ((TrainingSet *)(NamesTrainingSet))->SignatureNames[i];
-			if (! *char_p) {
-				strcpy(char_p,plan->getFeatureNameByIndex(i).c_str());
+	// Update max_sigs, and if we have an attached NamesTrainingSet, copy the feature names over, but only the first time.
+	// Sigs for several images may be computed concurrently (see TrainingSet::LoadFromFilesDir)
+#pragma omp critical (signature_names)
+	{
+		if (count > max_sigs) {
+#pragma omp atomic write
+			max_sigs = count;
+		}
+		if (NamesTrainingSet) {
+			for (int i = 0; i < count; i++) {
+				char *char_p = ((TrainingSet *)(NamesTrainingSet))->SignatureNames[i];
+				if (! *char_p) {
+					strcpy(char_p,plan->getFeatureNameByIndex(i).c_str());
+				}
 			}
 		}
 	}
@@ -283,6 +368,8 @@ void signatures::LoadFromFilep (FILE *value_file) {
 	char buffer[IMAGE_PATH_LENGTH+SAMPLE_NAME_LENGTH+1],*p_buffer, name[SIGNATURE_NAME_LENGTH];
 	int version_maj = 0, version_min = 0;
 	double val;
+	std::vector<std::string> names;   // the names of the values read, published once at the end
+	long first_index = count;
 
 	/* read the class or value and version */
 	fgets(buffer,sizeof(buffer),value_file);
@@ -311,10 +398,12 @@ void signatures::LoadFromFilep (FILE *value_file) {
 	while (p_buffer) {
 		name[0] = '\0';
 		sscanf (buffer, "%lf%*[\t ]%[^\t\r\n]", &val, name);
-		Add(name,val);
+		AddValue (val);
+		if (NamesTrainingSet) names.push_back (name);
 		p_buffer=fgets(buffer,sizeof(buffer),value_file);
 		chomp (p_buffer);
 	}
+	PublishNames (names, first_index);
 
 	// FIXME: There is opportunity here to check for inconsistent number of features if minor version is specified.
 	SetFeatureVectorType();
@@ -68,8 +68,16 @@ class signatures
 {
   private:
     int IsNeeded(long start_index, long group_length);  /* check if the group of signatures is needed */
+    std::vector<double> values;         // storage for data, unless the sample is bound to a row of a TrainingSet's feature matrix
+    bool bound;                         // data is a row of a TrainingSet's feature matrix (see bind())
+    void unbind();                      // move the values of a bound sample back into our own storage
+    void AddValue(double value);        // add a value without touching the state shared with other samples (see Add)
+    void PublishNames(const std::vector<std::string> &names, long first_index);  // update max_sigs and copy the names once per sample
+    // disable copies - data may point into our own storage
+    signatures(const signatures &);
+    signatures &operator=(const signatures &);
   public:
-    std::vector<double> data;
+    double *data;                       // the signature values (allocated of them)
     int feature_vec_type;              // stores the integer value of the StdFeatureComputationPlans::feature_vec_types enum.
     int version;                       // The major version of the sig file (1 for wndchrm versions prior to 1.33 , 2 for wndchrm versions > 1.33).
                                        // The full version designation is version.feature_vec_type
@@ -86,8 +94,9 @@ class signatures
 	WORMfile *wf;                       // class for mutex'ed files for storing sig values
     signatures();                       // constructor
     ~signatures();                      // destructor
-    signatures *duplicate();            // create an identical signature vector object */
+    signatures *duplicate(double *row = NULL);  // create an identical signature vector object, optionally with its values in row */
     void Resize(size_t nsigs);          // call before adding sigs
+    void bind(double *row, size_t row_size);  // copy the values to a row of a TrainingSet's feature matrix, and use the row as our storage
     void Add(const char *name, double value);
 	void SetFeatureVectorType();
     void Clear();
@@ -29,6 +29,9 @@
 
 
 #include <string.h>
+#include <stdlib.h>
+#include <math.h>
+#include <vector>
 
 #include "FeatureStatistics.h"
 
@@ -250,3 +253,139 @@ long EulerNumber(const ImageMatrix &Im, int mode) {
 	else
 		return ( (C1 - C3 - (2*Cd)) / 4);
 }
+
+
+int compare_ulongs (const void *a, const void *b) {
+	if (*((unsigned long *)a) > *((unsigned long *)b)) return(1);
+	if (*((unsigned long *)a) == *((unsigned long *)b)) return(0);
+	return(-1);
+}
+
+/* MaskObjectStatistics
+   Object statistics of a binary mask held in one bit of a byte plane (w*h, row-major).
+   Gives the same results as GlobalCentroid, bwlabel(8), EulerNumber(8) and FeatureCentroid
+   on the equivalent binary ImageMatrix:
+   Objects are found in the same order as bwlabel finds them, and each object's area and centroid are
+   accumulated while it is flood-filled, instead of rescanning the whole image for every label.
+   The mask bit is cleared as objects are consumed.
+*/
+void MaskObjectStatistics(unsigned char *mask, unsigned char bit, unsigned int w, unsigned int h, ObjectStatistics *objects) {
+	unsigned int x, y, nbins = OBJECT_STATS_NBINS;
+	unsigned long index, num = (unsigned long)w * h, object_index, bin;
+	double x_mass = 0, y_mass = 0, mass = 0;
+
+	/* centroid of the mask */
+	for (y = 0; y < h; y++)
+		for (x = 0; x < w; x++)
+			if (mask[y*w+x] & bit) {
+				x_mass=x_mass+x+1;    /* the "+1" is only for compatability with matlab code (where index starts from 1) */
+				y_mass=y_mass+y+1;
+				mass++;
+			}
+	if (mass) {
+		objects->centroid_x = x_mass/mass;
+		objects->centroid_y = y_mass/mass;
+	} else objects->centroid_x = objects->centroid_y = 0;
+
+	/* euler number: quads with one pixel set minus quads with three set (see EulerNumber, mode 8) */
+	long C1 = 0, C3 = 0;
+	for (y = 1; y < h; y++) {
+		for (x = 1; x < w; x++) {
+			int n_set = ((mask[(y-1)*w+x-1] & bit) != 0) + ((mask[(y-1)*w+x] & bit) != 0)
+				+ ((mask[y*w+x-1] & bit) != 0) + ((mask[y*w+x] & bit) != 0);
+			if (n_set == 1) C1++;
+			else if (n_set == 3) C3++;
+		}
+	}
+	objects->Euler = (C1 - C3) / 4;
+
+	/* label 8-connected objects, measuring each one as it is filled */
+	std::vector<unsigned long> object_areas;
+	std::vector<double> centroid_dists;
+	unsigned long *queue = new unsigned long[num];
+	double sum_areas = 0, sum_dists = 0;
+	for (index = 0; index < num; index++) {
+		if (!(mask[index] & bit)) continue;
+		unsigned long head = 0, tail = 0;
+		unsigned long obj_x_mass = 0, obj_y_mass = 0, obj_mass = 0;
+		mask[index] &= ~bit;
+		queue[tail++] = index;
+		while (head < tail) {
+			unsigned long pix = queue[head++];
+			long base_x = pix % w, base_y = pix / w;
+			obj_x_mass += base_x+1;
+			obj_y_mass += base_y+1;
+			obj_mass++;
+			for (long ny = base_y-1; ny <= base_y+1; ny++) {
+				if (ny < 0 || ny >= (long)h) continue;
+				for (long nx = base_x-1; nx <= base_x+1; nx++) {
+					if (nx < 0 || nx >= (long)w) continue;
+					unsigned long neighbor = ny*w+nx;
+					if (mask[neighbor] & bit) {
+						mask[neighbor] &= ~bit;
+						queue[tail++] = neighbor;
+					}
+				}
+			}
+		}
+		double dx = (double)obj_x_mass/(double)obj_mass - objects->centroid_x,
+			dy = (double)obj_y_mass/(double)obj_mass - objects->centroid_y;
+		object_areas.push_back (obj_mass);
+		centroid_dists.push_back (sqrt(pow(dx,2) + pow(dy,2)));
+		sum_areas += obj_mass;
+		sum_dists += centroid_dists.back();
+	}
+	delete [] queue;
+
+	unsigned long count = object_areas.size();
+	objects->count = count;
+	memset (objects->area_histogram, 0, nbins * sizeof (int));
+	memset (objects->dist_histogram, 0, nbins * sizeof (int));
+	if (count == 0) {
+		objects->AreaMin = objects->AreaMax = objects->AreaMedian = 0;
+		objects->AreaMean = objects->AreaVar = 0;
+		objects->DistMin = objects->DistMax = objects->DistMean = objects->DistMedian = objects->DistVar = 0;
+		return;
+	}
+
+	/* compute area statistics */
+	double hist_scale, sum_var;
+	qsort(&(object_areas[0]),count,sizeof(unsigned long),compare_ulongs);
+	objects->AreaMin = object_areas[0];
+	objects->AreaMax = object_areas[count-1];
+	objects->AreaMean = sum_areas/count;
+	objects->AreaMedian = (unsigned int)(object_areas[count/2]);
+	if ((objects->AreaMax - objects->AreaMin) > 0) hist_scale = (double)nbins / double(objects->AreaMax - objects->AreaMin);
+	else hist_scale = 0;
+	/* compute the variance and the histogram */
+	sum_var = 0;
+	if (objects->AreaMax - objects->AreaMin > 0) {
+		for (object_index = 0; object_index < count; object_index++) {
+			sum_var += pow(object_areas[object_index] - objects->AreaMean,2);
+			bin = (unsigned long)( ((double)object_areas[object_index] - objects->AreaMin) * hist_scale);
+			if (bin >= nbins) bin = nbins - 1;
+			objects->area_histogram[bin] += 1;
+		}
+	}
+	if (count > 1) objects->AreaVar = sum_var / (count-1);
+	else objects->AreaVar = sum_var;
+
+	/* compute distance statistics */
+	qsort(&(centroid_dists[0]),count,sizeof(double),compare_doubles);
+	objects->DistMin = centroid_dists[0];
+	objects->DistMax = centroid_dists[count-1];
+	objects->DistMean = sum_dists/count;
+	objects->DistMedian = centroid_dists[count/2];
+	if ((objects->DistMax - objects->DistMin) > 0) hist_scale = (double)nbins / double(objects->DistMax - objects->DistMin);
+	else hist_scale = 0;
+	/* compute the variance and the histogram */
+	sum_var = 0;
+	for (object_index = 0; object_index < count; object_index++) {
+		sum_var += pow(centroid_dists[object_index] - objects->DistMean,2);
+		bin = (unsigned long)((centroid_dists[object_index] - objects->DistMin) * hist_scale);
+		if (bin >= nbins) bin = nbins - 1;
+		objects->dist_histogram[bin] += 1;
+	}
+	if (count > 1) objects->DistVar = sum_var / (count-1);
+	else objects->DistVar = sum_var;
+}
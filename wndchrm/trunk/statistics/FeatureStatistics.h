@@ -39,5 +39,6 @@ void GlobalCentroid(const ImageMatrix &Im, double *x_centroid, double *y_centroi
 unsigned long FeatureCentroid(const ImageMatrix &Im, double object_index,double *x_centroid, double *y_centroid);
 unsigned long area(const ImageMatrix &Im);
 long EulerNumber(const ImageMatrix &Im, int mode);
+void MaskObjectStatistics(unsigned char *mask, unsigned char bit, unsigned int w, unsigned int h, ObjectStatistics *objects);
 
 #endif
@@ -1,6 +1,7 @@
 
 #include <math.h>
 #include "cmatrix.h"
+#include "PlanePool.h"
 #include "gabor.h"
 
 
@@ -163,15 +164,16 @@ double *Gabor(double f0, double sig2lam, double gamma, double theta, double fi,
 
 /* Computes Gabor energy */
 //Function [e2] = GaborEnergy(Im,f0,sig2lam,gamma,theta,n),
-double *GaborEnergy(const ImageMatrix &Im, double* out, double f0, double sig2lam, double gamma, double theta, int n) {
-	double *Gexp, *image, *c;
+pixDataType *GaborEnergy(const ImageMatrix &Im, pixDataType* out, double f0, double sig2lam, double gamma, double theta, int n) {
+	double *Gexp;
 	double fi = 0;
 	unsigned int a,b,x,y;
 	Gexp = Gabor(f0,sig2lam,gamma,theta,fi,n);
 	readOnlyPixels pix_plane = Im.ReadablePixels();
 
-	c = new double[(Im.width+n-1)*(Im.height+n-1)*2];
-	image = new double[Im.width*Im.height];
+	// the scratch planes are reused by the next call through the PlanePool
+	PooledArray<double> c ((Im.width+n-1)*(Im.height+n-1)*2);
+	PooledArray<double> image (Im.width*Im.height);
 	for (y = 0; y < Im.height; y++)
 		for (x = 0; x < Im.width; x++)
 			image[y*Im.width+x] = pix_plane(y,x);
@@ -188,9 +190,7 @@ double *GaborEnergy(const ImageMatrix &Im, double* out, double f0, double sig2la
 		b++;
 	}
 
-	delete [] image;
 	delete [] Gexp;
-	delete [] c;
 	return(out);
 }
 
@@ -3,6 +3,7 @@
 #include <stdlib.h>
 #include "haralick.h"
 #include "CVIPtexture.h"
+#include "PlanePool.h"
 
 //---------------------------------------------------------------------------
 /* haralick
@@ -22,8 +23,10 @@ void haralick2D(const ImageMatrix &Im, double distance, double *out) {
 	if (distance <= 0) distance = 1;
 
 	p_gray = new unsigned char *[Im.height];
-	for (y = 0; y < Im.height; y++)
-		p_gray[y] = new unsigned char[Im.width];
+	PooledArray<unsigned char> gray_plane (Im.width * Im.height);
+	p_gray[0] = gray_plane;
+	for (y = 1; y < Im.height; y++)
+		p_gray[y] = p_gray[0] + y * Im.width;
 
 	// to keep this method from modifying the const Im, we use GetStats on a local Moments2 object
 	Moments2 local_stats;
@@ -32,9 +35,17 @@ void haralick2D(const ImageMatrix &Im, double distance, double *out) {
 	max_value = local_stats.max();
 
 	scale255 = (255.0/(max_value-min_value));
-	for (y = 0; y < Im.height; y++)
-		for (x = 0; x < Im.width; x++)
-			p_gray[y][x] = (unsigned char)((pix_plane(y,x) - min_value) * scale255);
+	if (Im.has_int_levels && max_value - min_value < MAX_INT_LEVELS) {
+		// integer levels are requantized once per level
+		std::vector<unsigned char> gray_lut ((size_t)(max_value - min_value) + 1);
+		for (a = 0; a < gray_lut.size(); a++)
+			gray_lut[a] = (unsigned char)(((min_value + a) - min_value) * scale255);
+		Im.MapLevels (&(gray_lut[0]), min_value, p_gray[0]);
+	} else {
+		for (y = 0; y < Im.height; y++)
+			for (x = 0; x < Im.width; x++)
+				p_gray[y][x] = (unsigned char)((pix_plane(y,x) - min_value) * scale255);
+	}
 
 	for (a = 0; a < 14; a++) {
 		min[a] = INF;
@@ -102,8 +113,6 @@ void haralick2D(const ImageMatrix &Im, double distance, double *out) {
 		free(features);
 	}
 
-	for (y = 0; y < Im.height; y++)
-		delete [] p_gray[y];
 	delete [] p_gray;
 
 	/* copy the values to the output vector in the right output order */
@@ -4,6 +4,12 @@
 #include <cfloat> // DBL_MAX
 #include "../statistics/Moments.h"
 #include "tamura.h"
+#include "PlanePool.h"
+
+// running sums and local means stay in double even when pixel planes are stored as floats
+typedef Eigen::Matrix< double, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor > accumDataMat;
+// the per-scale planes are mapped onto PlanePool memory
+typedef Eigen::Map< accumDataMat > accumDataMap;
 
 
 
@@ -102,7 +108,7 @@ double directionality(const ImageMatrix &image) {
 }
 
 
-double efficientLocalMean(const long x,const long y,const long k, const pixDataMat &laufendeSumme) {
+double efficientLocalMean(const long x,const long y,const long k, const accumDataMat &laufendeSumme) {
 	long k2 = k/2;
 
 	long dimx = laufendeSumme.cols();
@@ -150,8 +156,8 @@ double coarseness(const ImageMatrix &image, double *hist,unsigned int nbins) {
 	const unsigned int xDim = image.width;
 	double sum = 0.0;
 	ImageMatrix *Sbest;
-	pixDataMat laufendeSumme (yDim,xDim);
-	pixDataMat *Ak[K_VALUE], *Ekh[K_VALUE], *Ekv[K_VALUE];
+	accumDataMat laufendeSumme (yDim,xDim);
+	accumDataMap *Ak[K_VALUE], *Ekh[K_VALUE], *Ekv[K_VALUE];
 
 	readOnlyPixels image_pix_plane = image.ReadablePixels();
 
@@ -173,9 +179,9 @@ double coarseness(const ImageMatrix &image, double *hist,unsigned int nbins) {
 	}
 
 	for (k = 1; k <= K_VALUE; k++) {
-		Ak[k-1] = new pixDataMat(yDim,xDim);
-		Ekh[k-1] = new pixDataMat(yDim,xDim);
-		Ekv[k-1] = new pixDataMat(yDim,xDim);
+		Ak[k-1] = new accumDataMap(PlanePool::allocate<double> ((size_t)yDim*xDim),yDim,xDim);
+		Ekh[k-1] = new accumDataMap(PlanePool::allocate<double> ((size_t)yDim*xDim),yDim,xDim);
+		Ekv[k-1] = new accumDataMap(PlanePool::allocate<double> ((size_t)yDim*xDim),yDim,xDim);
 	}
 	Sbest = new ImageMatrix;
 	Sbest->allocate (image.width,image.height);
@@ -185,7 +191,7 @@ double coarseness(const ImageMatrix &image, double *hist,unsigned int nbins) {
 	int lenOfk = 1;
 	for(k = 1; k <= K_VALUE; ++k) {
 		lenOfk *= 2;
-		pixDataMat &Ak_pix_plane = *Ak[k-1];
+		accumDataMap &Ak_pix_plane = *Ak[k-1];
 		for(y = 0; y < yDim; ++y)
 			for(x = 0; x < xDim; ++x)
 				Ak_pix_plane(y,x) = efficientLocalMean(x,y,lenOfk,laufendeSumme);
@@ -196,9 +202,9 @@ double coarseness(const ImageMatrix &image, double *hist,unsigned int nbins) {
 	for(k = 1; k <= K_VALUE; ++k) {
 		int k2 = lenOfk;
 		lenOfk *= 2;
-		pixDataMat &Ekh_pix_plane = *Ekh[k-1];
-		pixDataMat &Ekv_pix_plane = *Ekv[k-1];
-		pixDataMat &Ak_pix_plane = *Ak[k-1];
+		accumDataMap &Ekh_pix_plane = *Ekh[k-1];
+		accumDataMap &Ekv_pix_plane = *Ekv[k-1];
+		accumDataMap &Ak_pix_plane = *Ak[k-1];
 		for(y = 0; y < yDim; ++y) {
 			for(x = 0; x < xDim; ++x) {
 				int posx1 = x+k2;
@@ -258,6 +264,9 @@ double coarseness(const ImageMatrix &image, double *hist,unsigned int nbins) {
 
 	/* free allocated memory */
 	for (k = 1; k <= K_VALUE; k++) {
+		PlanePool::deallocate (Ak[k-1]->data(), Ak[k-1]->size());
+		PlanePool::deallocate (Ekh[k-1]->data(), Ekh[k-1]->size());
+		PlanePool::deallocate (Ekv[k-1]->data(), Ekv[k-1]->size());
 		delete Ak[k-1];
 		delete Ekh[k-1];
 		delete Ekv[k-1];
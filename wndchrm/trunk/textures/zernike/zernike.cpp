@@ -74,6 +74,9 @@ void mb_Znl(double *X, double *Y, double *P, int size, double D, double m10_m00,
 // Other hard-coded D values should just need changing MAX_D, MAX_Z and MAX_LUT above.
 	assert (D == MAX_D);
 
+	// The tables are filled by the first call.  Images are sampled concurrently, so the check and the fill are in a critical section,
+	// which makes the filled tables visible to the threads that see init_lut set.
+#pragma omp critical(zernike_lut)
 	if (!init_lut) {
 		theZ=0;
 		theLUT=0;
@@ -249,7 +252,8 @@ void mb_zernike2D (const ImageMatrix &Im, double order, double rad, double *zval
 	double m01_m00 = moment01/moment00;
 			
 
-// Pre-initialization of statics
+// Pre-initialization of statics (in a critical section, like the LUT of mb_Znl)
+#pragma omp critical(zernike_h)
 	if (init) {
 		for (n = 0; n < MAX_L; n++) {
 			for (m = 0; m <= n; m++) {
@@ -35,6 +35,7 @@
 #include <math.h>
 #include <stdio.h>
 #include "ChebyshevFourier.h"
+#include "PlanePool.h"
 
 #define min(a, b)  (((a) < (b)) ? (a) : (b))
 //---------------------------------------------------------------------------
@@ -58,18 +59,17 @@ ChebyshevFourier - Chebyshev Fourier transform
 */
 void ChebyshevFourier2D(const ImageMatrix &Im, unsigned long N, double *coeff_packed, unsigned int packingOrder) {
 	unsigned long a,m,n,x,y,nLast,NN,Nmax,ind;
-	double *sum_r,*sum_i,*f,*r,*img,*Tn,*coeff;
+	double *sum_r,*sum_i,*Tn,*coeff;
 	double min,max;
-	long *kk;
 
 	if (N==0) N=11;
 	m=Im.height;
 	n=Im.width;
 
-	img = new double[m*n];
-	f   = new double[m*n];
-	r   = new double[m*n];
-	kk  = new long[m*n];  /* the required size of kk is equal to nLast */
+	PooledArray<double> img (m*n);
+	PooledArray<double> f (m*n);
+	PooledArray<double> r (m*n);
+	PooledArray<long> kk (m*n);  /* the required size of kk is equal to nLast */
 
 	readOnlyPixels Im_pix_plane = Im.ReadablePixels();
 	double x_ind,x_2, y_ind;
@@ -152,9 +152,5 @@ void ChebyshevFourier2D(const ImageMatrix &Im, unsigned long N, double *coeff_pa
 	delete [] sum_r;
 	delete [] sum_i;
 	delete [] coeff;
-	delete [] f;
-	delete [] r;
-	delete [] kk;
-	delete [] img;
 	delete [] Tn;
 }
@@ -32,18 +32,18 @@
 #include <math.h>
 
 #include "cmatrix.h"
+#include "PlanePool.h"
 #include "chebyshev.h"
 
 //---------------------------------------------------------------------------
 
 void TNx(double *x, double *out, int N, int height) {
 	int ix,iy;
-	double *temp,*temp1;
 //	if( max(abs(x(:))) > 1 )
 //		error(':: Cheb. Polynomials Tn :: abs(arg) > 1');
 //	end;
-	temp = new double[N*height];
-	temp1 = new double[N*height];
+	PooledArray<double> temp (N*height);
+	PooledArray<double> temp1 (N*height);
 
 // 	T = cos((ones(size(x,2),1)*(0:(N-1))).*acos(x'*ones(1,N)));
 //     	T(:,1) = ones(size(x'));
@@ -72,9 +72,6 @@ void TNx(double *x, double *out, int N, int height) {
 
 	for (iy = 0; iy < height; iy++)
 		out[iy*N+0] = 1;
-
-	delete [] temp1;
-	delete [] temp;
 }
 
 void getChCoeff1D(double *f,double *out,double *Tj,int N,int width) {
@@ -117,7 +114,6 @@ height - height of the image
 */
 void Chebyshev2D(const ImageMatrix &Im, double *out, unsigned int N) {
 	double *TjIn,*Tj;
-	double *in;
 	unsigned int a,i,j;
 
 // Make a default value for coeficient order if it was not given as an input
@@ -133,7 +129,7 @@ void Chebyshev2D(const ImageMatrix &Im, double *out, unsigned int N) {
 	TNx(TjIn,Tj,N,Im.width);
 
 
-	in = new double[Im.width*Im.height];
+	PooledArray<double> in (Im.width*Im.height);
 	readOnlyPixels Im_pix_plane = Im.ReadablePixels();
 
 	for (j = 0; j < Im.height; j++)
@@ -159,7 +155,6 @@ void Chebyshev2D(const ImageMatrix &Im, double *out, unsigned int N) {
 	}
 	getChCoeff(in,out,Tj,N,Im.height,N);
 
-	delete [] in;
 	delete [] TjIn;
 	delete [] Tj;
 }
@@ -2,57 +2,66 @@
 
 
 #include <math.h>
+#include "cmatrix.h"
+#include "PlanePool.h"
 #include "radon.h"
 
 //---------------------------------------------------------------------------
 /*
-pPtr -array of double- output column. a pre-allocated vector of the size 2*ceil(norm(size(I)-floor((size(I)-1)/2)-1))+3
-iPtr -double *- input pixels
+pPtr -array of double- output columns, one per angle. a pre-allocated, zeroed vector of numAngles*rSize,
+     rSize being 2*ceil(norm(size(I)-floor((size(I)-1)/2)-1))+3
+iPtr -double *- input pixels, row-major (M rows of N columns)
+iStride -int- the number of pixels between the starts of successive rows of iPtr (N if contiguous)
 thetaPtr -array of double- array of the size numAngles (degrees)
 numAngles -int- the number of theta angles to compute
+
+Each pixel is split into four sub-pixels offset by 0.25, and each sub-pixel's mass is divided
+between the two projection bins straddling R = X*cos(angle) + Y*sin(angle).
+The coordinate tables for the image size are computed once, and the per-angle X*cos / Y*sin tables
+turn the bin index into a single add per sub-pixel.
+The sub-pixels are added to the bins column by column, in the order of the original column-major version,
+so that the sums (and the features) are identical to it.  The input is copied once into a column-major scratch plane
+shared by all the angles, so each angle reads it sequentially.
+The angles write to separate output columns, so they are projected in parallel.
 */
-void radon(double *pPtr, double *iPtr, double *thetaPtr, int M, int N,
+void radon(double *pPtr, const pixDataType *iPtr, int iStride, const double *thetaPtr, int M, int N,
       int xOrigin, int yOrigin, int numAngles, int rFirst, int rSize)
 {
-  int k, m, n, p;           /* loop counters */
-  double angle;             /* radian angle value */
-  double cosine, sine;      /* cosine and sine of current angle */
-  double *pr;               /* points inside output array */
-  double *pixelPtr;         /* points inside input array */
-  double pixel;             /* current pixel value */
-  double rIdx;              /* r value offset from initial array element */
-  int rLow;                 /* (int) rIdx */
-  double pixelLow;          /* amount of pixel's mass to be assigned to */
-                            /* the bin below Idx */
+  int k, x, y;
   double *yTable, *xTable;  /* x- and y-coordinate tables */
-  double *ySinTable, *xCosTable;
-                            /* tables for x*cos(angle) and y*sin(angle) */
+  PooledArray<double> columns ((size_t)M*N);  /* the input pixels, column-major */
 
+  for (y = 0; y < M; y++) {
+    const pixDataType *row = iPtr + (size_t)y*iStride;
+    for (x = 0; x < N; x++)
+      columns[(size_t)x*M + y] = row[x];
+  }
 
   /* Allocate space for the lookup tables */
   yTable = new double[2*M];
   xTable = new double[2*N];
-  xCosTable = new double[2*N];
-  ySinTable = new double[2*M];
 
   /* x- and y-coordinates are offset from pixel locations by 0.25 */
   /* spaced by intervals of 0.5. */
 
   /* We want bottom-to-top to be the positive y direction */
   yTable[2*M-1] = -yOrigin - 0.25;
-  for (k = 2*M-2; k >=0; k--)       
+  for (k = 2*M-2; k >=0; k--)
     yTable[k] = yTable[k+1] + 0.5;
 
   xTable[0] = -xOrigin - 0.25;
   for (k = 1; k < 2*N; k++)
     xTable[k] = xTable[k-1] + 0.5;
 
+#pragma omp parallel for schedule(dynamic,1)
   for (k = 0; k < numAngles; k++) {
-    angle = thetaPtr[k];
-    angle = (angle*M_PI)/180;
-    pr = pPtr + k*rSize;  /* pointer to the top of the output column */
-    cosine = cos(angle);
-    sine = sin(angle);   
+    int m, n, p;
+    double angle = (thetaPtr[k]*M_PI)/180;
+    double *pr = pPtr + k*rSize;  /* pointer to the top of the output column */
+    double cosine = cos(angle);
+    double sine = sin(angle);
+    double *xCosTable = new double[2*N];
+    double *ySinTable = new double[2*M];
 
     /* Radon impulse response locus:  R = X*cos(angle) + Y*sin(angle) */
     /* Fill the X*cos table and the Y*sin table.  Incorporate the */
@@ -65,29 +74,27 @@ void radon(double *pPtr, double *iPtr, double *thetaPtr, int M, int N,
     /* Remember that n and m will each change twice as fast as the */
     /* pixel pointer should change. */
     for (n = 0; n < 2*N; n++) {
-      pixelPtr = iPtr + (n/2)*M;
-      for (m = 0; m < 2*M; m++)
-      {
-	pixel = *pixelPtr;
-	if (pixel)
-        {
-	  pixel *= 0.25;                         /* 1 flop/pixel */
-	  rIdx = (xCosTable[n] + ySinTable[m]);  /* 1 flop/pixel */
-	  rLow = (int) rIdx;                     /* 1 flop/pixel */
-	  pixelLow = pixel*(1 - rIdx + rLow);    /* 3 flops/pixel */
-	  pr[rLow++] += pixelLow;                /* 1 flop/pixel */
-	  pr[rLow] += pixel - pixelLow;          /* 2 flops/pixel */
+      const double *pixelPtr = columns.data() + (size_t)(n/2)*M;
+      const double xCos = xCosTable[n];
+      for (m = 0; m < 2*M; m++) {
+        double pixel = pixelPtr[m/2];
+        if (pixel) {
+          pixel *= 0.25;
+          double rIdx = xCos + ySinTable[m];
+          int rLow = (int) rIdx;
+          double pixelLow = pixel*(1 - rIdx + rLow);
+          pr[rLow++] += pixelLow;
+          pr[rLow] += pixel - pixelLow;
         }
-	if (m%2)
-	  pixelPtr++;   
       }
     }
+
+    delete [] xCosTable;
+    delete [] ySinTable;
   }
 
   delete [] yTable;
   delete [] xTable;
-  delete [] xCosTable;
-  delete [] ySinTable;
 }
 
 /* vd_RadonTextures
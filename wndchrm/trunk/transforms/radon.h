@@ -3,7 +3,7 @@
 #ifndef radonH
 #define radonH
 //---------------------------------------------------------------------------
-void radon(double *pPtr, double *iPtr, double *thetaPtr, int M, int N,
+void radon(double *pPtr, const pixDataType *iPtr, int iStride, const double *thetaPtr, int M, int N,
       int xOrigin, int yOrigin, int numAngles, int rFirst, int rSize);
 
 void vd_RadonTextures(double *vec);
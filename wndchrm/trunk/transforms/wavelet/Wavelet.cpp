@@ -434,6 +434,74 @@ added here (end) ***************************************************************
 }
 
 
+/* Single-level 2D decomposition of a row-major buffer (ysize rows of xsize values, with input_stride values between
+   the starts of successive rows).
+   Produces the same coefficients and layout as transform2D(DataGrid *) with nsteps == 1,
+   without going through per-column DataGrid2D storage:
+   the vertical pass streams whole rows, and the horizontal pass runs along contiguous rows.
+   output must hold (2*outsizex) * (2*outsizey) doubles, row-major, with
+   outsize = floor((size + dec_len - 1) / 2).
+   The zero-padded convolution sums are accumulated in double, in the same (ascending tap) order as
+   downsampling_convolution(), so the results are identical to the DataGrid version.
+   Instantiated for double and float buffers.
+*/
+template <typename T> void Wavelet::transform2D(const T * input, int xsize, int ysize, int input_stride, T * output) {
+	const int flen = this->dec_len;
+	const double *lo = this->analysisLow->coeff, *hi = this->analysisHigh->coeff;
+	int outsizex = (int) floor((xsize + flen - 1) / 2.);
+	int outsizey = (int) floor((ysize + flen - 1) / 2.);
+	int outwidth = 2 * outsizex;
+	int x, o, j, jmin, jmax;
+
+	// vertical pass: approx and detail along y, each outsizey rows of xsize
+	double * approxy = new double[outsizey * xsize];
+	double * detaily = new double[outsizey * xsize];
+	for (o = 0; o < outsizey; o++) {
+		double *arow = approxy + o * xsize, *drow = detaily + o * xsize;
+		for (x = 0; x < xsize; x++) arow[x] = drow[x] = 0;
+		jmin = 2*o + 2 - ysize; if (jmin < 0) jmin = 0;
+		jmax = 2*o + 1; if (jmax > flen - 1) jmax = flen - 1;
+		for (j = jmin; j <= jmax; j++) {
+			const T *irow = input + (size_t)(2*o + 1 - j) * input_stride;
+			const double fl = lo[j], fh = hi[j];
+			for (x = 0; x < xsize; x++) {
+				arow[x] += fl * irow[x];
+				drow[x] += fh * irow[x];
+			}
+		}
+	}
+
+	// horizontal pass: split each row into approx and detail along x, writing the four
+	// sub-bands straight into their quadrants (detail/detail in the top-left, approx/approx in the bottom-right)
+	for (int row = 0; row < outsizey; row++) {
+		const double *arow = approxy + row * xsize, *drow = detaily + row * xsize;
+		T *aa = output + (outsizey + row) * outwidth + outsizex;
+		T *ad = output + row * outwidth + outsizex;
+		T *da = output + (outsizey + row) * outwidth;
+		T *dd = output + row * outwidth;
+		for (o = 0; o < outsizex; o++) {
+			double aa_sum = 0, ad_sum = 0, da_sum = 0, dd_sum = 0;
+			jmin = 2*o + 2 - xsize; if (jmin < 0) jmin = 0;
+			jmax = 2*o + 1; if (jmax > flen - 1) jmax = flen - 1;
+			for (j = jmin; j <= jmax; j++) {
+				const int k = 2*o + 1 - j;
+				aa_sum += lo[j] * arow[k];
+				ad_sum += hi[j] * arow[k];
+				da_sum += lo[j] * drow[k];
+				dd_sum += hi[j] * drow[k];
+			}
+			aa[o] = aa_sum; ad[o] = ad_sum;
+			da[o] = da_sum; dd[o] = dd_sum;
+		}
+	}
+
+	delete [] approxy;
+	delete [] detaily;
+}
+template void Wavelet::transform2D<double>(const double * input, int xsize, int ysize, int input_stride, double * output);
+template void Wavelet::transform2D<float>(const float * input, int xsize, int ysize, int input_stride, float * output);
+
+
 void Wavelet::transform3D(DataGrid * data) {
 	int xsize = data->getX();
 	int ysize = data->getY();
@@ -70,6 +70,7 @@ public:
 //protected:
 	void transform1D(DataGrid * data);
 	void transform2D(DataGrid * data);
+	template <typename T> void transform2D(const T * input, int xsize, int ysize, int input_stride, T * output);
 	void transform3D(DataGrid * data);
 	
 	void inverseTransform1D(DataGrid * data);
@@ -44,6 +44,7 @@
 #include "TrainingSet.h"
 #include "wndchrm_error.h"
 #include "Tasks.h"
+#include "MappedImageMatrix.h"
 
 #define MAX_SPLITS 10000
 #define MAX_SAMPLES 190000
@@ -231,11 +232,10 @@ int check_split_params (int *n_train_p, int *n_test_p, double *split_ratio, Trai
 int split_and_test(TrainingSet *ts, char *report_file_name, int argc, char **argv, int class_num, int method, featureset_t *featureset, double split_ratio, int balanced_splits, double max_features, double used_mrmr, long split_num,
 	int report,int max_training_images, int exact_training_images, int max_test_images, char *phylib_path,int distance_method, int phylip_algorithm,int export_tsv,
 	long first_n, char *weight_file_buffer, char weight_vector_action, int N, TrainingSet *testset, int ignore_group, int tile_areas, int max_tile, int image_similarities, int random_splits) {
-	TrainingSet *train,*test,**TilesTrainingSets=NULL;
 	std::vector<data_split> splits;
 	char group_name[64];
 	FILE *output_file;
-	int split_index,tile_index;
+	int split_index;
 	int n_train,n_test;
 	int class_index;
 	int res;
@@ -324,15 +324,44 @@ int split_and_test(TrainingSet *ts, char *report_file_name, int argc, char **arg
 		if (split_ratio > 0) printf ("samples per image=%d, UNBALANCED training fraction=%g\n",samples_per_image,split_ratio);
 		else printf ("samples per image=%d, training images: %d, testing images %d\n",samples_per_image,n_train,n_test);
 	}
+	if (ignore_group)   /* assign to zero all features of the group */
+	{
+		if (!(ts->IgnoreFeatureGroup(ignore_group,group_name))) {
+			showError(1,"Errors while trying to ignore group %d '%s'\n",ignore_group,group_name);
+			return(0);
+		}
+	}
+
+	// The splits run concurrently when there's more than one and the test samples are split from ts.
+	// Each split is made from ts in the ordered section, in split order, so the random splits are the same as when they run one at a time.
+	// Each split prints into its own temporary file, which is copied to stdout in split order once it and the splits before it are done.
+	// The feature weights of the splits are aggregated in split order after they're all done.
+	bool concurrent_splits = (split_num > 1 && !testset);
+	std::vector<FILE *> split_outputs (split_num, (FILE *)NULL);
+	std::vector<bool> split_done (split_num, false);
+	std::vector< std::vector<double> > split_weights (split_num);
+	int next_split_output = 0;
+	bool failed = false;
+
 	splits.resize(split_num);
+#pragma omp parallel for ordered schedule(dynamic,1) if(concurrent_splits)
 	for (split_index=0;split_index<split_num;split_index++)
 	{
 		double accuracy;
 		double feature_weight_distance=-1.0;
+		TrainingSet *train,*test,**TilesTrainingSets=NULL;
+		int tile_index,class_index;
+		int split_res = 1;
+		FILE *output = stdout;
+
+		if (concurrent_splits && !(output = split_outputs[split_index] = tmpfile())) {
+			showError(1,"Could not create a temporary file for the output of split %d\n",split_index+1);
+		}
 
 		train=new TrainingSet(ts->count,ts->class_num);
 		if (testset) test = testset;
 		else test=new TrainingSet(ts->count,ts->class_num);
+		splits[split_index].output = output;
 		splits[split_index].confusion_matrix=new unsigned short[(ts->class_num+1)*(ts->class_num+1)];
 		splits[split_index].training_images=new unsigned short[(ts->class_num+1)];
 		splits[split_index].testing_images=new unsigned short[(ts->class_num+1)];
@@ -345,117 +374,93 @@ int split_and_test(TrainingSet *ts, char *report_file_name, int argc, char **arg
 		}
 		else splits[split_index].tile_area_accuracy=NULL;
 
-		res=ts->split(random_splits,split_ratio,train,test,samples_per_image,n_train,n_test,&(splits[split_index]));
-		if ( res < 0) return (res);
-		if (image_similarities) splits[split_index].image_similarities=new double[(1+test->count/(samples_per_image))*(1+test->count/(samples_per_image))];
-		else splits[split_index].image_similarities=NULL;
-
-		//int temp=train->class_num;
-		//train->class_num=1;
-		if (tile_areas)  // split into several datasets such that each dataset contains tiles of the same location
+#pragma omp ordered
 		{
-			TilesTrainingSets=new TrainingSet*[samples_per_image];
-			res = train->SplitAreas(samples_per_image, TilesTrainingSets);
-			if (res < 0) return (res);
-			for (tile_index=0;tile_index<samples_per_image;tile_index++)
-			{
-				TilesTrainingSets[tile_index]->normalize();
-				TilesTrainingSets[tile_index]->SetFisherScores(max_features,used_mrmr,NULL);
+#pragma omp flush(failed)
+			if (!failed) split_res=ts->split(random_splits,split_ratio,train,test,samples_per_image,n_train,n_test,&(splits[split_index]));
+			if (split_res < 0) {
+#pragma omp critical(split_failures)
+				{ res = split_res; failed = true; }
+#pragma omp flush(failed)
 			}
 		}
-		else
-		{
-			train->normalize(); // normalize the feature values of the training set
-			train->SetFisherScores(max_features,used_mrmr,&(splits[split_index]));  // compute the Fisher Scores for the image features
-			if( ts->aggregated_feature_stats ) {
-				if( ts->aggregated_feature_stats->empty() ) {
-					featuregroup_stats_t temp;
-					for( i = 0; i < ts->signature_count; i++ ) {
-						temp.name = train->SignatureNames[i];
-						temp.min = train->SignatureWeights[i];
-						temp.max = train->SignatureWeights[i];
-						temp.sum_weight = train->SignatureWeights[i];
-						temp.sum_weight2 = train->SignatureWeights[i] * train->SignatureWeights[i];
-						temp.mean = 0;
-						temp.stddev = 0;
-						temp.n_features = 1;	
-						ts->aggregated_feature_stats->push_back( temp ); // makes a copy
-					}
+		if (failed) split_res = -1;
+		if (split_res >= 0) {
+			if (image_similarities) splits[split_index].image_similarities=new double[(1+test->count/(samples_per_image))*(1+test->count/(samples_per_image))];
+			else splits[split_index].image_similarities=NULL;
+
+			//int temp=train->class_num;
+			//train->class_num=1;
+			if (tile_areas)  // split into several datasets such that each dataset contains tiles of the same location
+			{
+				TilesTrainingSets=new TrainingSet*[samples_per_image];
+				split_res = train->SplitAreas(samples_per_image, TilesTrainingSets);
+				if (split_res < 0) {
+#pragma omp critical(split_failures)
+					{ res = split_res; failed = true; }
+#pragma omp flush(failed)
 				}
-				else
+				else for (tile_index=0;tile_index<samples_per_image;tile_index++)
 				{
-					for( i = 0; i < ts->signature_count; i++ ) {
-						if( train->SignatureWeights[i] < (*(ts->aggregated_feature_stats))[i].min )
-							 (*(ts->aggregated_feature_stats))[i].min = train->SignatureWeights[i];
-						if( train->SignatureWeights[i] > (*(ts->aggregated_feature_stats))[i].max )
-							 (*(ts->aggregated_feature_stats))[i].max = train->SignatureWeights[i];
-						(*(ts->aggregated_feature_stats))[i].sum_weight += train->SignatureWeights[i];
-						(*(ts->aggregated_feature_stats))[i].sum_weight2 += train->SignatureWeights[i] * train->SignatureWeights[i];
-						(*(ts->aggregated_feature_stats))[i].n_features++;
-					}
+					TilesTrainingSets[tile_index]->normalize();
+					TilesTrainingSets[tile_index]->SetFisherScores(max_features,used_mrmr,NULL);
 				}
 			}
-		}
-		//train->class_num=temp;
-		if (weight_vector_action=='w')
-			if(!train->SaveWeightVector(weight_file_buffer))
-				showError(1,"Could not write weight vector to '%s'\n",weight_file_buffer);
-		if (weight_vector_action=='r' || weight_vector_action=='+' || weight_vector_action=='-')
-		{
-			feature_weight_distance=train->LoadWeightVector(weight_file_buffer,(weight_vector_action=='+')-(weight_vector_action=='-'));
-			if (tile_areas) for (tile_index=0;tile_index<samples_per_image;tile_index++) feature_weight_distance=TilesTrainingSets[tile_index]->LoadWeightVector(weight_file_buffer,(weight_vector_action=='+')-(weight_vector_action=='-'));	   
-			if (feature_weight_distance<0) showError(1,"Could not load weight vector from '%s'\n",weight_file_buffer);
-		}
-		if (report) splits[split_index].individual_images=new char[(int)((test->count/(samples_per_image))*(class_num*15))];
-		else splits[split_index].individual_images=NULL;
-		if (ignore_group)   /* assign to zero all features of the group */
-		{
-			if (!(ts->IgnoreFeatureGroup(ignore_group,group_name))) {
-				delete train;
-				if (!testset) delete test;
-				delete splits[split_index].confusion_matrix;
-				delete splits[split_index].training_images;
-				delete splits[split_index].testing_images;
-				delete splits[split_index].class_accuracies;
-				delete splits[split_index].similarity_matrix;
-				delete splits[split_index].individual_images;
-				showError(1,"Errors while trying to ignore group %d '%s'\n",ignore_group,group_name);
-				return(0);
+			else
+			{
+				train->normalize(); // normalize the feature values of the training set
+				train->SetFisherScores(max_features,used_mrmr,&(splits[split_index]));  // compute the Fisher Scores for the image features
+				if( ts->aggregated_feature_stats )
+					split_weights[split_index].assign (train->SignatureWeights, train->SignatureWeights + ts->signature_count);
 			}
 		}
-		
-		// The following is the separator between split results
-		printf( "\n----------\n" );
-
-		// Label the columns
-		if (verbosity>=1) {
-			printf("image\t");
-			if (ts->is_continuous) {
-				printf("act. val.\tpred. val.\n");
-			} else {
-				printf ("norm. fact.\t");
-				for (class_index=1;class_index<=ts->class_num;class_index++) {
-					printf("p(%s)\t",ts->class_labels[class_index]);
+		if (split_res >= 0) {
+			//train->class_num=temp;
+			if (weight_vector_action=='w' && split_index == split_num - 1)   // the weights of the last split are the ones left in the file
+				if(!train->SaveWeightVector(weight_file_buffer,output))
+					showError(1,"Could not write weight vector to '%s'\n",weight_file_buffer);
+			if (weight_vector_action=='r' || weight_vector_action=='+' || weight_vector_action=='-')
+			{
+				feature_weight_distance=train->LoadWeightVector(weight_file_buffer,(weight_vector_action=='+')-(weight_vector_action=='-'),output);
+				if (tile_areas) for (tile_index=0;tile_index<samples_per_image;tile_index++) feature_weight_distance=TilesTrainingSets[tile_index]->LoadWeightVector(weight_file_buffer,(weight_vector_action=='+')-(weight_vector_action=='-'),output);	   
+				if (feature_weight_distance<0) showError(1,"Could not load weight vector from '%s'\n",weight_file_buffer);
+			}
+			if (report) splits[split_index].individual_images=new char[(int)((test->count/(samples_per_image))*(class_num*15))];
+			else splits[split_index].individual_images=NULL;
+			
+			// The following is the separator between split results
+			fprintf( output, "\n----------\n" );
+
+			// Label the columns
+			if (verbosity>=1) {
+				fprintf(output, "image\t");
+				if (ts->is_continuous) {
+					fprintf(output, "act. val.\tpred. val.\n");
+				} else {
+					fprintf (output, "norm. fact.\t");
+					for (class_index=1;class_index<=ts->class_num;class_index++) {
+						fprintf(output, "p(%s)\t",ts->class_labels[class_index]);
+					}
+					fprintf(output, "act. class\tpred. class");
+					if (ts->is_numeric) fprintf (output, "\tpred. val.");
+					fprintf (output, "\n");
 				}
-				printf("act. class\tpred. class");
-				if (ts->is_numeric) printf ("\tpred. val.");
-				printf ("\n");
 			}
-		}
 
-		accuracy=train->Test(test,method,samples_per_image,tile_areas,TilesTrainingSets,max_tile,first_n,&(splits[split_index]));
+			accuracy=train->Test(test,method,samples_per_image,tile_areas,TilesTrainingSets,max_tile,first_n,&(splits[split_index]));
 
-		splits[split_index].feature_weight_distance=feature_weight_distance;
-		splits[split_index].method=method;
-		splits[split_index].pearson_coefficient=test->pearson(samples_per_image,&(splits[split_index].avg_abs_dif),&(splits[split_index].pearson_p_value));
+			splits[split_index].feature_weight_distance=feature_weight_distance;
+			splits[split_index].method=method;
+			splits[split_index].pearson_coefficient=test->pearson(samples_per_image,&(splits[split_index].avg_abs_dif),&(splits[split_index].pearson_p_value));
 
-		if (!report && !ignore_group && verbosity > 2 )   // print the accuracy and confusion and similarity matrices
-		{ 
-			printf( "\n" );
-			ts->PrintConfusion(stdout,splits[split_index].confusion_matrix,NULL);//,0,0);
-			ts->PrintConfusion(stdout,NULL,splits[split_index].similarity_matrix);//,0,0);
-			if (ts->is_continuous) printf("Pearson Correlation: %f \n\n",splits[split_index].pearson_coefficient);
-			else printf("\nAccuracy: %f \n",accuracy);
+			if (!report && !ignore_group && verbosity > 2 )   // print the accuracy and confusion and similarity matrices
+			{ 
+				fprintf( output, "\n" );
+				ts->PrintConfusion(output,splits[split_index].confusion_matrix,NULL);//,0,0);
+				ts->PrintConfusion(output,NULL,splits[split_index].similarity_matrix);//,0,0);
+				if (ts->is_continuous) fprintf(output, "Pearson Correlation: %f \n\n",splits[split_index].pearson_coefficient);
+				else fprintf(output, "\nAccuracy: %f \n",accuracy);
+			}
 		}
 
 		if (TilesTrainingSets)    // delete the training sets allocated for the different areas
@@ -466,7 +471,63 @@ int split_and_test(TrainingSet *ts, char *report_file_name, int argc, char **arg
 		}
 		delete train;
 		if (!testset) delete test;
+		splits[split_index].output = NULL;
+
+		// print the outputs of the splits that are done, up to the first one that isn't
+		if (concurrent_splits) {
+#pragma omp critical(split_outputs)
+			{
+				split_done[split_index] = true;
+				while (next_split_output < split_num && split_done[next_split_output]) {
+					char buffer[4096];
+					size_t n_read;
+					FILE *split_output = split_outputs[next_split_output];
+					if (split_output) {
+						rewind (split_output);
+						while ( (n_read = fread (buffer, 1, sizeof (buffer), split_output)) > 0) fwrite (buffer, 1, n_read, stdout);
+						fclose (split_output);
+					}
+					next_split_output++;
+				}
+				fflush (stdout);
+			}
+		}
 	} // End for (split_index=0;split_index<split_num;split_index++)
+	if (failed) return (res);
+
+	// aggregate the feature weights of the splits in split order
+	if( ts->aggregated_feature_stats ) {
+		for (split_index=0;split_index<split_num;split_index++) {
+			std::vector<double> &weights = split_weights[split_index];
+			if (weights.empty()) continue;
+			if( ts->aggregated_feature_stats->empty() ) {
+				featuregroup_stats_t temp;
+				for( i = 0; i < ts->signature_count; i++ ) {
+					temp.name = ts->SignatureNames[i];
+					temp.min = weights[i];
+					temp.max = weights[i];
+					temp.sum_weight = weights[i];
+					temp.sum_weight2 = weights[i] * weights[i];
+					temp.mean = 0;
+					temp.stddev = 0;
+					temp.n_features = 1;	
+					ts->aggregated_feature_stats->push_back( temp ); // makes a copy
+				}
+			}
+			else
+			{
+				for( i = 0; i < ts->signature_count; i++ ) {
+					if( weights[i] < (*(ts->aggregated_feature_stats))[i].min )
+						 (*(ts->aggregated_feature_stats))[i].min = weights[i];
+					if( weights[i] > (*(ts->aggregated_feature_stats))[i].max )
+						 (*(ts->aggregated_feature_stats))[i].max = weights[i];
+					(*(ts->aggregated_feature_stats))[i].sum_weight += weights[i];
+					(*(ts->aggregated_feature_stats))[i].sum_weight2 += weights[i] * weights[i];
+					(*(ts->aggregated_feature_stats))[i].n_features++;
+				}
+			}
+		}
+	}
 
 	if( ts->aggregated_feature_stats ) {
 		// Finish up computing the averages for the feature weights
@@ -592,7 +653,7 @@ int split_and_test(TrainingSet *ts, char *report_file_name, int argc, char **arg
 void ShowHelp()
 {
 	printf("\n"PACKAGE_STRING".  Laboratory of Genetics/NIA/NIH \n");
-	printf("usage: \n======\nwndchrm [ train | test | classify ] [-mtslcdowfrijnpqvNSBACDTh] [<dataset>|<train set>] [<test set>|<feature file>] [<report_file>]\n");
+	printf("usage: \n======\nwndchrm [ train | test | classify ] [-mtslcdowbkfrijnpqvNSBMACDTh] [<dataset>|<train set>] [<test set>|<feature file>] [<report_file>]\n");
 	printf("  <dataset> is a <root directory>, <feature file>, <file of filenames>, <image directory> or <image filename>\n");
 	printf("  <root directory> is a directory of sub-directories containing class images with one class per sub-directory.\n");
 	printf("      The sub-directory names will be used as the class labels. Currently supported file formats: TIFF, PPM. \n");
@@ -620,6 +681,8 @@ void ShowHelp()
 	printf("dN - Downsample the images (N percents, where N is 1 to 100)\n");
 	printf("Sx[:y] - normalize the images such that the mean is set to x and (optinally) the stddev is set to y.\n");   
 	printf("Bx,y,w,h - compute features only from the (x,y,w,h) block of the image.\n");      
+	printf("M[path] - keep images larger than %d MB in memory-mapped scratch files in the 'path' directory (default $TMPDIR or /tmp)\n", (int)(MAPPED_IMAGE_MIN_BYTES / (1024 * 1024)));
+	printf("    instead of in RAM.  Used with -t, only the tile being sampled needs to be in memory.  Must be the last letter in the switch.\n");
 	
 	printf("\nImage Feature options:\n======================\n");
 	printf("l - Use a large image feature set.\n");
@@ -630,11 +693,17 @@ void ShowHelp()
 	
 	printf("\nFeature reduction options:\n==========================\n");
 	printf("fN[:M] - maximum number of features out of the dataset (0,1) . The default is 0.15. \n");
+	printf("    If M is specified, the fraction M (0,1) of those features is selected by mRMR (minimum redundancy maximum relevance).\n");
+	printf("    mRMR is computed by wndchrm itself: the external ./mrmr program is no longer used (without it, M was ignored).\n");
 	printf("v[r|w|+|-][path] - read/write/add/subtract the feature weights from a file.\n");   
 	printf("A - assess the contribution of each group of image features independently.\n");
 	
 	printf("\nClassifier options:\n===================\n");
 	printf("w - Classify with wnn instead of wnd. \n");
+	printf("b - Compute the distances of %d test samples at a time to all training samples as a matrix product.\n", BATCH_DISTANCES_BLOCK);
+	printf("    Faster for large tests, but the marginal probabilities (and interpolated values) may differ from the default computation by rounding.\n");
+	printf("k - With -w, find the nearest training samples of each class in an index (vantage-point trees) instead of comparing to all of them.\n");
+	printf("    The results are the same.  Faster for large training sets with few features.  Not used with -b.\n");
 	printf("qN - the number of first closest classes among which the presence of the right class is considered a match.\n");
 	printf("r[#]N - Fraction of images/samples to be used for training (0,1). The default is 0.75 of\n");
 	printf("        the smallest class. if '#' is specified, force unbalanced training\n");
@@ -766,6 +835,7 @@ int main(int argc, char *argv[])
 	strcpy (sampling_opts->tile_base,"t");
 	sampling_opts->tiles_x = 1;
 	sampling_opts->tiles_y = 1;
+	strcpy (sampling_opts->page_base,"p");
 
 	strcpy (feature_opts->compute_colors_base,"c");
 	feature_opts->compute_colors = 0;
@@ -832,6 +902,12 @@ int main(int argc, char *argv[])
 	    	arg_index++;
 			continue;	/* so that the path will not trigger other switches */
 		}
+		if ( (char_p = strchr(argv[arg_index],'M')) ) {
+			if (*(char_p+1)) MappedImageMatrix::SetMapping (char_p+1);
+			else if (getenv ("TMPDIR")) MappedImageMatrix::SetMapping (getenv ("TMPDIR"));
+			else MappedImageMatrix::SetMapping ("/tmp");
+			*char_p = '\0';   /* so that the path will not trigger other switches */
+		}
         /* a block for computing features */
         if ( (char_p = strchr(argv[arg_index],'B'))  && isdigit (*(char_p+1)) ) {
 			strcpy(arg,char_p+1);
@@ -916,6 +992,8 @@ int main(int argc, char *argv[])
         }
         if (strchr(argv[arg_index],'j')) max_test_images=atoi(&(strchr(argv[arg_index],'j')[1]));
         if (strchr(argv[arg_index],'w')) method=0;
+        if (strchr(argv[arg_index],'b')) TrainingSet::SetBatchDistances (true);
+        if (strchr(argv[arg_index],'k')) TrainingSet::SetWNNIndex (true);
         if (strchr(argv[arg_index],'h'))
         {  ShowHelp();
            return(1);
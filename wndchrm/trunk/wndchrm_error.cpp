@@ -71,12 +71,16 @@ void catError (const char *fmt, ...) {
 	err_lngth = vsnprintf (error_buffer,MAX_ERROR_MESSAGE, fmt, ap);
 	va_end (ap);
 
-	error_messages << error_buffer;
-
-	catErrno();
+	// images are processed concurrently (see TrainingSet::LoadFromFilesDir)
+#pragma omp critical (error_messages)
+	{
+		error_messages << error_buffer;
+		catErrno();
+	}
 }
 
 void catError (const std::string &error) {
+#pragma omp critical (error_messages)
 	error_messages << error;
 }
 